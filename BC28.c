@@ -7,50 +7,315 @@
   ***************** Application Notes *********************
   *********************************************************
   * 1. MUST implement wrapper functions.
-  *	2. Call BC28_PushReceivedByte() in UART ISR or thread to handle received data.
+  *	2. Call BC28_PushReceivedByte() in UART ISR or thread to handle received data,
+  *    or BC28_PushReceivedBytes() for a block of data.
   * 3. Call BC28_Init() before calling any public functions.
   * 4. BC28_Reboot() is a good solution for connection issues.
   * 5. Call BC28_WaitReady() before opening socket.
   * 6. Set socket listener to handle incoming data via internet.
+  * 7. BC28_SubmitATCmd() queues AT command and returns immediately, the callback
+  *    is called in the context of BC28_PushReceivedByte().
+  * 8. For battery powered devices, queue uplink by BC28_QueueUplink() and send it by
+  *    BC28_FlushUplink() in one radio connection released by RAI.
   *********************************************************/
 
 #include <string.h>
 #include <stdio.h>
 #include "BC28.h"
-
-#define MAX_SOCKET_NUM			1		//keep it as 1, not support multi-socket yet
-#define MAX_SOCKET_PACKET_SIZE	1024	//total memory usage will be 4x, so be careful of this value 
-#define UART_RCV_BUF_SIZE		((MAX_SOCKET_PACKET_SIZE << 1) + 20)
+#include "HexCodec.h"
+
+// Socket receive queue is single-producer/single-consumer without lock,
+// indexes are published with acquire/release ordering.
+// Define ATOMIC_INT and ATOMIC_xxx before this for other compilers.
+#ifndef ATOMIC_INT
+#if defined(__cplusplus)
+#include <atomic>
+#define ATOMIC_INT					std::atomic<int>
+#define ATOMIC_LOAD_ACQUIRE(p)		(p)->load(std::memory_order_acquire)
+#define ATOMIC_LOAD_RELAXED(p)		(p)->load(std::memory_order_relaxed)
+#define ATOMIC_STORE_RELEASE(p, v)	(p)->store((v), std::memory_order_release)
+#define ATOMIC_STORE_RELAXED(p, v)	(p)->store((v), std::memory_order_relaxed)
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L) && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#define ATOMIC_INT					atomic_int
+#define ATOMIC_LOAD_ACQUIRE(p)		atomic_load_explicit((p), memory_order_acquire)
+#define ATOMIC_LOAD_RELAXED(p)		atomic_load_explicit((p), memory_order_relaxed)
+#define ATOMIC_STORE_RELEASE(p, v)	atomic_store_explicit((p), (v), memory_order_release)
+#define ATOMIC_STORE_RELAXED(p, v)	atomic_store_explicit((p), (v), memory_order_relaxed)
+#elif defined(__GNUC__)
+// GCC and Clang builtins, e.g. C99 builds of ARM compilers
+#define ATOMIC_INT					int
+#define ATOMIC_LOAD_ACQUIRE(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_LOAD_RELAXED(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define ATOMIC_STORE_RELEASE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_STORE_RELAXED(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#elif defined(_MSC_VER)
+// MSVC C, interlocked functions are full barriers
+#include <intrin.h>
+#define ATOMIC_INT					volatile long
+#define ATOMIC_LOAD_ACQUIRE(p)		_InterlockedOr((p), 0)
+#define ATOMIC_LOAD_RELAXED(p)		_InterlockedOr((p), 0)
+#define ATOMIC_STORE_RELEASE(p, v)	_InterlockedExchange((p), (v))
+#define ATOMIC_STORE_RELAXED(p, v)	_InterlockedExchange((p), (v))
+#else
+#error "No atomic operations for socket receive queue, define ATOMIC_INT and ATOMIC_xxx"
+#endif
+#endif
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE			64		//keep producer and consumer indexes in different cache lines
+#endif
+
+#ifndef MAX_SOCKET_NUM
+#define MAX_SOCKET_NUM			7		//number of sockets opened at the same time, BC28 supports 7 at most
+#endif
+#define SOCKET_ID_NUM			7		//socket index given by BC28 is 0 ~ 6
+#define LOCAL_PORT_BASE			4587
+#define LOCAL_PORT_NUM			100
+#define MAX_SOCKET_PACKET_SIZE	1024	//memory usage will be 2x per socket plus 4x, so be careful of this value
+#define UART_RCV_BUF_SIZE		((MAX_SOCKET_PACKET_SIZE << 1) + 128)
+#define RCV_ARENA_SIZE			(UART_RCV_BUF_SIZE - 64)	//response kept in UART buffer, see BC28_RCV_ARENA
 #define SOCKET_RCV_BUF_SIZE		(MAX_SOCKET_PACKET_SIZE << 1)
+#define HEX_CHUNK_SIZE			32		//bytes encoded per UART write
+#define URC_BUILTIN_NUM			9
+#define URC_USER_NUM			8		//number of URC handlers registered by BC28_RegisterURCHandler()
 
 static uint8_t	bufUartRcv[UART_RCV_BUF_SIZE];
 static int		countUartRcvBuf = 0;
-
-static uint8_t	bufSocketRcvQ[MAX_SOCKET_NUM][SOCKET_RCV_BUF_SIZE];
-static int		headSocketRcvQ[MAX_SOCKET_NUM] = {0};
-static int		tailSocketRcvQ[MAX_SOCKET_NUM] = {0};
-
-static char		*pRcvBuf = NULL;
-static int		ActOrNack = 0;	// -1: nack, 0: none, 1: ack
+static uint32_t	countUartRxBytes = 0;	//RX context only, added to statBC28 under lock per line
+static int		posUartRcvLine = -1;	//start of text in line, -1: no text yet
+static int		baseUartRcvLine = 0;	//start of line, bytes before it are response kept in arena
+
+// Known URCs and final result codes, matched with the start of line byte by byte
+enum {
+	URC_TYPE_NONE,		//response of AT command
+	URC_TYPE_URC,
+	URC_TYPE_OK,
+	URC_TYPE_ERROR
+};
+
+typedef struct {
+	const char			*prefix;
+	int					type;
+	int					exact;		//the whole line must be the same as prefix
+	BC28_URC_HANDLER	handler;
+} URC_ENTRY;
+
+static void OnNSONMI(const char *line, int len);
+static void OnNSOCLI(const char *line, int len);
+static void OnNSOSTR(const char *line, int len);
+static void OnCEREG(const char *line, int len);
+static void OnCSCON(const char *line, int len);
+static void OnREBOOT(const char *line, int len);
+
+static URC_ENTRY	tableURC[URC_BUILTIN_NUM + URC_USER_NUM] = {
+	{"OK",			URC_TYPE_OK,	1,	NULL},
+	{"ERROR",		URC_TYPE_ERROR,	1,	NULL},
+	{"+CME ERROR",	URC_TYPE_ERROR,	0,	NULL},
+	{"+NSONMI:",	URC_TYPE_URC,	0,	OnNSONMI},
+	{"+NSOCLI:",	URC_TYPE_URC,	0,	OnNSOCLI},
+	{"+NSOSTR:",	URC_TYPE_URC,	0,	OnNSOSTR},
+	{"+CEREG:",		URC_TYPE_URC,	0,	OnCEREG},
+	{"+CSCON:",		URC_TYPE_URC,	0,	OnCSCON},
+	{"REBOOT_",		URC_TYPE_URC,	0,	OnREBOOT}
+};
+static int		countURC = URC_BUILTIN_NUM;
+static uint32_t	maskURC = 0;		//candidates of current line
+static int		matchURC = -1;		//matched entry of current line, -1: none
+
+// Socket receive queue keeps one byte empty, so it holds (SOCKET_RCV_BUF_SIZE - 1) bytes at most.
+// Producer is OnSocketRead(), consumer is the caller of BC28_ReadTcpSocket().
+typedef struct {
+	ATOMIC_INT	head;		//written by consumer only
+	uint8_t		pad_head[CACHE_LINE_SIZE - sizeof(ATOMIC_INT)];
+	ATOMIC_INT	tail;		//written by producer only
+	uint8_t		pad_tail[CACHE_LINE_SIZE - sizeof(ATOMIC_INT)];
+	uint8_t		buf[SOCKET_RCV_BUF_SIZE];
+} SOCKET_RCV_Q;
+
+static SOCKET_RCV_Q	queueSocketRcv[MAX_SOCKET_NUM];
+static int		droppedSocketRcvQ[MAX_SOCKET_NUM] = {0};	//number of bytes dropped by overflow
+static int		pendingSocketRcv[MAX_SOCKET_NUM] = {0};		//number of bytes left in BC28
+static int		flagSocketRcvBlocked[MAX_SOCKET_NUM] = {0};	//reading BC28 is paused by full queue
+static int		flagSocketReading[MAX_SOCKET_NUM] = {0};	//AT+NSORF is in flight, 2: read again
+static int		flagSocketUdp[MAX_SOCKET_NUM] = {0};		//queue holds datagram records
+static BC28_TASK	taskSocketListenerQ[MAX_SOCKET_NUM];
+
+// UDP record in receive queue: <ip:4><port:2><length:2><data>, big endian
+#define DATAGRAM_HEADER_SIZE	8
+
+// slot of receive queue for each socket index, -1: not opened
+static int8_t	slotSocket[SOCKET_ID_NUM] = {-1, -1, -1, -1, -1, -1, -1};
+static int		countLocalPort = 0;
+static int		policySocketOverflow = BC28_SOCKET_OVERFLOW_BLOCK;
+static int		modeSocketNotify = BC28_SOCKET_NOTIFY_LENGTH;
+
+static BC28_STATISTICS	statBC28;
+
+#ifndef MAX_SEND_WINDOW
+#define MAX_SEND_WINDOW			8		//max number of asynchronous sends waiting for +NSOSTR
+#endif
+
+// state of SEND_ENTRY
+enum {
+	SEND_FREE = 0,
+	SEND_QUEUED,		// AT+NSOSD is in AT queue, which refers to cmd, suffix and entry
+	SEND_ACCEPTED		// OK of AT+NSOSD is received, waiting for +NSOSTR
+};
+
+#define SEND_STATUS_NONE		(-2)
+
+typedef struct {
+	int					used;		// SEND_xxx
+	int					socket;
+	int					seq;		// sequence of AT+NSOSD, 1 ~ 255
+	int					size;
+	int					status;		// known before AT+NSOSD completes, SEND_STATUS_NONE: not yet
+	BC28_SEND_CALLBACK	callback;
+	void				*context;
+	char				cmd[24];	// AT+NSOSD=<socket>,<length>,
+	char				suffix[16];	// ,<flag>,<sequence>\r
+} SEND_ENTRY;
+
+#define RECOVER_ATTACH_TIMEOUT	30000	//miliseconds to register after AT+CFUN=1 or reboot
+#define RECOVER_BACKOFF_BASE	1000	//delay before the second step, doubled for each failed step
+#define RECOVER_BACKOFF_MAX		60000
+
+static int		countRecoverFail = 0;	//failed recovery steps in a row
+static uint32_t	seedRecover = 0;
+
+static SEND_ENTRY	tableSend[MAX_SEND_WINDOW];
+static int		windowSend = MAX_SEND_WINDOW;
+static int		seqSend = 0;
+
+typedef struct {
+	int					socket;
+	const uint8_t		*data;
+	int					size;
+	int					reply;		// reply is expected, release radio after it
+	BC28_SEND_CALLBACK	callback;
+	void				*context;
+} UPLINK_ENTRY;
+
+static UPLINK_ENTRY	queueUplink[MAX_SEND_WINDOW];
+static int		countUplink = 0;
+static int		flagFlushingUplink = 0;
+
+typedef struct {
+	int					socket;
+	char				cmd[24];	// AT+NSORF is asynchronous, keep it until completed
+} SOCKET_READ;
+
+static SOCKET_READ	readSocket[MAX_SOCKET_NUM];
+
+typedef struct {
+	const char			*cmd;
+	BC28_IOVEC			data[BC28_MAX_IOVEC];	// appended to cmd as hex string, then suffix or "\r"
+	int					data_num;
+	const char			*suffix;
+	char				*rcv;
+	int					rcv_size;
+	int					rcv_len;	// number of received bytes, may be more than rcv_size
+	int					arena;		// response is kept in UART buffer instead of rcv
+	BC28_AT_CALLBACK	callback;
+	void				*context;
+	int					held;		// slot is kept until the blocking waiter returns
+	int					timedout;	// result 0 is given, late response is discarded
+	int					elapsed;	// miliseconds since sent, asynchronous command only
+} AT_REQ;
+
+typedef struct {
+	volatile int		done;
+	int					result;
+	int					event;
+} AT_WAIT;
+
+#define AT_RESYNC_GUARD_TIME	5000	//miliseconds to wait for late final result code after timeout
+#define AT_RESYNC_POLL_TIME		50
+#define AT_ASYNC_TIMEOUT		5000	//miliseconds for final result code of asynchronous command
+
+// AT command queue, indexes keep increasing and slot is (index % BC28_AT_QUEUE_SIZE)
+// head: waiting for final result code, send: next to write to UART, tail: next to submit
+// Final result codes are matched in FIFO order, so a timed-out command is not removed:
+// its caller gets result 0 at once, but the slot stays at head with response discarded
+// until its late final result code arrives. Meanwhile no more commands are written to
+// UART, so the late response can't be taken by the next command. If nothing arrives in
+// AT_RESYNC_GUARD_TIME, the command is regarded as lost and the queue continues.
+static AT_REQ	queueATReq[BC28_AT_QUEUE_SIZE];
+static volatile unsigned int	headATQ = 0;
+static volatile unsigned int	sendATQ = 0;
+static volatile unsigned int	tailATQ = 0;
+static volatile int		flagSendingAT = 0;
+static unsigned int		indexArenaATQ = 0;		//command which response is kept in arena
+static int				flagResyncAT = 0;		//draining timed-out commands, sending is paused
+static unsigned int		indexResyncATQ = 0;		//end of timed-out commands
+static int				flagWatchingAT = 0;		//WatchATTask() is running
 
 static char		IMSI[20] = "";
 static char		IMEI[20] = "";
+static volatile int	flagBootOK = 0;		//"OK" after boot message is not response of command
 
 static BC28_TASK	taskSocketListener = NULL;
 
-static volatile int mutexSendAT = 0;
+// updated by +CEREG and +CSCON URC
+static BC28_NETWORK_STATE	stateNetwork = {-1, -1, 0, 0, -1, -1};
+static int		flagNetworkURC = 0;		//URC is enabled, no need to poll
 
 static int BC28_SendATCmd(const char *cmd);
+static int BC28_SendHex(const uint8_t *data, int size);
+static int SendATReqWaitRcv(const char *cmd, const BC28_IOVEC *data, int data_num,
+							char *rcv, int rcv_size, int timeout);
+static int SubmitATReq(const char *cmd, const BC28_IOVEC *data, int data_num, const char *suffix,
+					   char *rcv, int rcv_size,
+					   BC28_AT_CALLBACK callback, void *context, unsigned int *index);
+static int QueueATReq(const char *cmd, const BC28_IOVEC *data, int data_num, const char *suffix,
+					  char *rcv, int rcv_size,
+					  BC28_AT_CALLBACK callback, void *context, unsigned int *index);
+static void SendQueuedATReq(void);
+static void CompleteATReq(int result);
+static void TimeoutATReq(unsigned int index, AT_WAIT *wait);
+static void ResyncATTask(int param1, int param2);
+static void WatchATTask(int param1, int param2);
+static void FailSentATReq(void);
+static void SendQueuedATTask(int param1, int param2);
+static void DoneATWait(int result, char *rcv, int rcv_len, void *context);
+static int FinishATWait(AT_REQ *req, int result);
 
 static int BC28_strlen(const char *src);
 static char *BC28_strstr(const char *src, const char *tar);
 
-static int InitSocketRcvQ(int socket);
-static int PushSocketRcvQ(int socket, uint8_t *data, int size);
-static int PopSocketRcvQ(int socket, uint8_t *data, int size);
+static int AllocSocketSlot(int socket);
+static int GetSocketSlot(int socket);
+static void FreeSocketSlot(int socket);
+static int InitSocketRcvQ(int idxQ);
+static int CountSocketRcvQ(int idxQ);
+static int SpaceSocketRcvQ(int idxQ);
+static int PopSocketRcvQ(int idxQ, uint8_t *data, int size);
+static int PushSocketRcvQ(int idxQ, const uint8_t *data, int size);
+static int PeekSocketRcvQ(int idxQ, uint8_t *data, int size);
+static int SkipSocketRcvQ(int idxQ, int size);
+static void ResumeSocketRcv(int socket);
+static void PostSocketListener(int socket, int idxQ, int size);
 
 static void ReadSocketTask(int socket, int size);
+static void OnSocketRead(int result, char *rcv, int rcv_len, void *context);
+static void OnSocketSent(int result, char *rcv, int rcv_len, void *context);
+static void FailSocketSend(int socket);
+static void ReleaseSocketSend(SEND_ENTRY *entry, int status);
+static int SendSocketReq(int socket, const uint8_t *data, int size, int flag,
+						 BC28_SEND_CALLBACK callback, void *context);
+static int QueueSocketReq(int socket, const uint8_t *data, int size, int flag,
+						  BC28_SEND_CALLBACK callback, void *context);
+static void FlushUplinkTask(int param1, int param2);
+static int CreateSocket(const char *type);
+static int WriteSocketData(int socket, const BC28_IOVEC *data, int data_num, int size);
+static void PushSocketPacket(int idxQ, uint8_t *buf, const char *hex, int len, const char *addr);
+static void MatchURC(uint8_t b, int offset);
+static void HandleUartRcvLine(void);
 static char* FindField(const char *str, char separator, int index);
+static void ParseCEREG(const char *p);
+static int WaitRecoverBackoff(void);
+static void ResetNetworkState(void);
 
 
 /**
@@ -60,26 +325,38 @@ static char* FindField(const char *str, char separator, int index);
   */
 int BC28_Init(void)
 {
-	int count = 10000/500;
+	int count, timeout = 100;
 	int ret = 0;
 	char szRcv[64];
 
+	BC28_Wrap_Lock();
 	countUartRcvBuf = 0;
+	posUartRcvLine = -1;
+	baseUartRcvLine = 0;
+	maskURC = 0;
+	matchURC = -1;
 	taskSocketListener = NULL;
-	mutexSendAT = 0;
+	BC28_Wrap_Unlock();
 
-	// check response
-	while(count--)
+	ResetNetworkState();
+
+	// sockets are closed by reboot
+	for(count=0; count<SOCKET_ID_NUM; count++)
+		FreeSocketSlot(count);
+
+	// check response, probe quickly at first and slow down up to 500ms, 10s in total
+	for(count=0; count<10000; count+=timeout)
 	{
-		ret = BC28_SendATCmdWaitRcv("AT\r", szRcv, 60, 500);
+		ret = BC28_SendATCmdWaitRcv("AT\r", szRcv, 60, timeout);
 		if(ret != 0)
 			break;
 
-		BC28_Wrap_Sleep(500);
+		if(timeout < 500)
+			timeout = (timeout << 1) > 500 ? 500 : (timeout << 1);
 	}
 
-	// read IMSI
-	if(ret)
+	// read IMSI and IMEI once, they are kept over reboot
+	if(ret && (IMSI[0] == 0 || IMEI[0] == 0))
 	{
 		if(BC28_SendATCmdWaitRcv("AT+CIMI\r", szRcv, 60, 500))
 		{
@@ -108,6 +385,43 @@ int BC28_Init(void)
 		}
 	}
 
+	if(ret)
+	{
+		// notify mode is reset by reboot
+		if(modeSocketNotify != BC28_SOCKET_NOTIFY_LENGTH)
+		{
+			char szCmd[16];
+
+			sprintf(szCmd, "AT+NSONMI=%d\r", modeSocketNotify);
+			if(BC28_SendATCmdWaitRcv(szCmd, szRcv, 60, 500) != 1)
+				modeSocketNotify = BC28_SOCKET_NOTIFY_LENGTH;
+		}
+
+		// registration and RRC connection are reported by URC instead of polling
+		if(BC28_SendATCmdWaitRcv("AT+CEREG=5\r", szRcv, 60, 500) == 1 ||
+			BC28_SendATCmdWaitRcv("AT+CEREG=2\r", szRcv, 60, 500) == 1)
+		{
+			flagNetworkURC = 1;
+		}
+		BC28_SendATCmdWaitRcv("AT+CSCON=1\r", szRcv, 60, 500);
+
+		// current state, +CEREG:<n>,<stat>,... and +CSCON:<n>,<mode>
+		if(BC28_SendATCmdWaitRcv("AT+CEREG?\r", szRcv, 64, 500) == 1)
+		{
+			char *p = strchr(szRcv, ',');
+
+			if(p != NULL)
+				ParseCEREG(p + 1);
+		}
+		if(BC28_SendATCmdWaitRcv("AT+CSCON?\r", szRcv, 64, 500) == 1)
+		{
+			char *p = strchr(szRcv, ',');
+
+			if(p != NULL && (p[1] == '0' || p[1] == '1'))
+				stateNetwork.rrc = p[1] - '0';
+		}
+	}
+
 	return ret;
 }
 
@@ -134,6 +448,31 @@ const char* BC28_GetIMEI(void)
 }
 
 
+/**
+  * @brief  To set IMSI and IMEI, e.g. loaded from flash, so that BC28_Init()
+  *			does not read them from BC28. NULL or "" to read again.
+  * @param  imsi: IMSI string, imei: IMEI string
+  * @retval None
+  */
+void BC28_SetIdentity(const char *imsi, const char *imei)
+{
+	IMSI[0] = 0;
+	IMEI[0] = 0;
+
+	if(imsi != NULL)
+	{
+		strncpy(IMSI, imsi, sizeof(IMSI) - 1);
+		IMSI[sizeof(IMSI) - 1] = 0;
+	}
+
+	if(imei != NULL)
+	{
+		strncpy(IMEI, imei, sizeof(IMEI) - 1);
+		IMEI[sizeof(IMEI) - 1] = 0;
+	}
+}
+
+
 /**
   * @brief  To reboot BC28. May wait for half minute.
   * @param  None
@@ -141,8 +480,10 @@ const char* BC28_GetIMEI(void)
   */
 void BC28_Reboot(void)
 {
-	BC28_SendATCmd("AT+NRB\r");
-	BC28_Wrap_Sleep(5000);
+	char szRcv[64];
+
+	// final OK of AT+NRB comes after boot message, no need to sleep
+	BC28_SendATCmdWaitRcv("AT+NRB\r", szRcv, 64, 10000);
 	BC28_Init();
 }
 
@@ -154,51 +495,122 @@ void BC28_Reboot(void)
   */
 void BC28_PushReceivedByte(uint8_t b)
 {
-	char *p;
-
+	countUartRxBytes++;
 	bufUartRcv[countUartRcvBuf++] = b;
 
-	if(b == '\n' && countUartRcvBuf > 2)
+	if(b == '\r' || b == '\n')
+	{
+		if(b == '\n' && posUartRcvLine >= 0)
+			HandleUartRcvLine();
+	}
+	else
+	{
+		if(posUartRcvLine < 0)
+		{
+			// start of line, all entries are candidates
+			posUartRcvLine = countUartRcvBuf - 1;
+			maskURC = (1UL << countURC) - 1;
+			matchURC = -1;
+		}
+
+		if(maskURC != 0)
+			MatchURC(b, countUartRcvBuf - 1 - posUartRcvLine);
+	}
+
+	// line is too long, pass it as response
+	if(countUartRcvBuf >= UART_RCV_BUF_SIZE - 1)
+	{
+		maskURC = 0;
+		matchURC = -1;
+		HandleUartRcvLine();
+	}
+}
+
+
+/**
+  * @brief  Call this function while receiving a block of data via UART,
+  *			e.g. DMA half/full transfer interrupt or read() of serial port.
+  * @param  data: pointer to received data, size: number of bytes
+  * @retval None
+  */
+void BC28_PushReceivedBytes(const uint8_t *data, int size)
+{
+	countUartRxBytes += size;
+
+	while(size > 0)
 	{
-		bufUartRcv[countUartRcvBuf] = 0;
+		const uint8_t *end = (const uint8_t*)memchr(data, '\n', size);
+		int num = (end != NULL) ? (int)(end - data) + 1 : size;
+		int space = UART_RCV_BUF_SIZE - 1 - countUartRcvBuf;
+		int i;
 
-		// check NSONMI URC
-		if((p = strstr((char*)bufUartRcv, "+NSONMI")) != NULL)
+		if(num > space)
+			num = space;
+
+		memcpy(&bufUartRcv[countUartRcvBuf], data, num);
+
+		// only the start of line is checked for URC
+		for(i=countUartRcvBuf; i<countUartRcvBuf+num && (posUartRcvLine < 0 || maskURC != 0); i++)
 		{
-			int socket, size = 0;
+			uint8_t b = bufUartRcv[i];
 
-			p += 8;
-			socket = *p - '0';
+			if(b == '\r' || b == '\n')
+				continue;
 
-			p += 2;
-			while(*p != '\r')
+			if(posUartRcvLine < 0)
 			{
-				size = size*10 + (*p - '0');
-				p++;
+				posUartRcvLine = i;
+				maskURC = (1UL << countURC) - 1;
+				matchURC = -1;
 			}
 
-			BC28_Wrap_PostTask(ReadSocketTask, socket, size);
+			MatchURC(b, i - posUartRcvLine);
+		}
 
-			if(taskSocketListener != NULL)
-			{
-				BC28_Wrap_PostTask(taskSocketListener, socket, size);
-			}
+		countUartRcvBuf += num;
+		data += num;
+		size -= num;
+
+		if(bufUartRcv[countUartRcvBuf - 1] == '\n' && posUartRcvLine >= 0)
+		{
+			HandleUartRcvLine();
 		}
-		else if(pRcvBuf != NULL)
+		else if(countUartRcvBuf >= UART_RCV_BUF_SIZE - 1)
 		{
-			strcat(pRcvBuf, (char*)bufUartRcv);
-			if(strstr((char*)bufUartRcv, "OK") != NULL)
-			{
-				ActOrNack = 1;
-			}
-			else if(strstr((char*)bufUartRcv, "ERROR") != NULL)
-			{
-				ActOrNack = -1;
-			}
+			// line is too long, pass it as response
+			maskURC = 0;
+			matchURC = -1;
+			HandleUartRcvLine();
 		}
+	}
+}
 
-		countUartRcvBuf = 0;
+
+/**
+  * @brief  To register handler of URC not handled by driver, e.g. "+NPSMR:".
+  *			Handler is called in the context of BC28_PushReceivedByte(), maybe ISR,
+  *			with the line excluding "\r\n". If the line is response of the command
+  *			being executed, e.g. "+CEREG:" of "AT+CEREG?", it is passed as response.
+  * @param  prefix: start of URC, must be valid all the time, handler: function pointer
+  * @retval 1: Done, 0: table is full
+  */
+int BC28_RegisterURCHandler(const char *prefix, BC28_URC_HANDLER handler)
+{
+	int ret = 0;
+
+	BC28_Wrap_Lock();
+	if(countURC < URC_BUILTIN_NUM + URC_USER_NUM && prefix != NULL && prefix[0] != 0)
+	{
+		tableURC[countURC].prefix = prefix;
+		tableURC[countURC].type = URC_TYPE_URC;
+		tableURC[countURC].exact = 0;
+		tableURC[countURC].handler = handler;
+		countURC++;
+		ret = 1;
 	}
+	BC28_Wrap_Unlock();
+
+	return ret;
 }
 
 
@@ -206,47 +618,94 @@ void BC28_PushReceivedByte(uint8_t b)
   * @brief  To send AT command and wait for response.
   * @param  cmd: pointer to AT command, 
   *			rcv: pointer to response buffer, rcv_size: max number of bytes,
-  *			timeout: miliseconds
-  * @retval 0: timeout, 1: OK, 2: ERROR
+  *			response longer than (rcv_size - 1) is truncated,
+  *			timeout: miliseconds, late response after timeout is discarded
+  * @retval 0: timeout, 1: OK, -1: ERROR
   */
 int BC28_SendATCmdWaitRcv(const char* cmd, char *rcv, int rcv_size, int timeout)
 {
+	return SendATReqWaitRcv(cmd, NULL, 0, rcv, rcv_size, timeout);
+}
+
+
+/**
+  * @brief  To queue AT command without waiting. Commands are written to UART
+  *			back-to-back and final result codes are matched to them in FIFO order.
+  *			Callback is called in the context of BC28_PushReceivedByte(), maybe ISR,
+  *			with result 1: OK, -1: ERROR, 0: timeout, and rcv_len is length of the whole
+  *			response, response is truncated if rcv_len is not less than rcv_size.
+  *			Result 0 is given if no final result code arrives in AT_ASYNC_TIMEOUT after
+  *			the command is written, or the command is lost by reboot of BC28.
+  *			After a timeout, queued commands are not written to UART until the late
+  *			final result code of the timed-out command is received and discarded,
+  *			or AT_RESYNC_GUARD_TIME passes.
+  * @param  cmd: pointer to AT command, must be valid until it is completed,
+  *			rcv: pointer to response buffer, NULL to ignore response, rcv_size: max number of bytes,
+  *			or rcv is NULL and rcv_size is BC28_RCV_ARENA to get response in driver buffer
+  *			without copy, which is valid in callback only,
+  *			callback: called while completed, NULL to ignore result,
+  *			context: user pointer passed to callback
+  * @retval 1: queued, 0: queue is full
+  */
+int BC28_SubmitATCmd(const char *cmd, char *rcv, int rcv_size, BC28_AT_CALLBACK callback, void *context)
+{
+	return SubmitATReq(cmd, NULL, 0, NULL, rcv, rcv_size, callback, context, NULL);
+}
+
+
+/**
+  * Send AT command with data as hex string, and wait for response.
+  * Data may be in several buffers, they are encoded one after another.
+  */
+static int SendATReqWaitRcv(const char *cmd, const BC28_IOVEC *data, int data_num,
+							char *rcv, int rcv_size, int timeout)
+{
+	AT_WAIT wait;
+	unsigned int index;
 	int count = 10000/100 + 1;
+	int queued = 0, done, result;
 
-	while(mutexSendAT && count--)
-		BC28_Wrap_Sleep(100);
+	wait.done = 0;
+	wait.result = 0;
 
-	if(mutexSendAT == 0)
+	// wait for free slot
+	while(count--)
 	{
-		int ack;
+		queued = SubmitATReq(cmd, data, data_num, NULL, rcv, rcv_size, DoneATWait, &wait, &index);
+		if(queued)
+			break;
 
-		mutexSendAT = 1;
+		BC28_Wrap_WaitEvent(BC28_EVENT_AT_FREE, 100);
+	}
 
-		count = timeout/100 + 1;
+	if(!queued)
+		return 0;
 
-		pRcvBuf = rcv;
-		*pRcvBuf = 0;
-		ActOrNack = 0;
-		countUartRcvBuf = 0;
+	// woken up by BC28_PushReceivedByte() as soon as OK/ERROR is received,
+	// wait is written by FinishATWait() under lock
+	while(1)
+	{
+		BC28_Wrap_Lock();
+		done = wait.done;
+		BC28_Wrap_Unlock();
 
-		BC28_SendATCmd(cmd);
-		if(strchr(cmd, '\r') == NULL)
-			BC28_SendATCmd("\r");
+		if(done)
+			break;
 
-		while(count-- && ActOrNack == 0)
+		if(!BC28_Wrap_WaitEvent(wait.event, timeout))
 		{
-			BC28_Wrap_Sleep(100);
+			TimeoutATReq(index, &wait);
+			break;
 		}
-
-		pRcvBuf = NULL;
-		ack = ActOrNack;
-
-		mutexSendAT = 0;
-
-		return ack;
 	}
 
-	return 0;
+	BC28_Wrap_Lock();
+	queueATReq[index % BC28_AT_QUEUE_SIZE].held = 0;
+	result = wait.result;
+	BC28_Wrap_Unlock();
+	BC28_Wrap_SetEvent(BC28_EVENT_AT_FREE);
+
+	return result;
 }
 
 
@@ -258,51 +717,61 @@ int BC28_SendATCmdWaitRcv(const char* cmd, char *rcv, int rcv_size, int timeout)
 int BC28_WaitReady(int timeout)
 {
 	int count = timeout/500 + 1;
-	int ret = 0;
 
-	// check response
-	while(count--)
+	while(1)
 	{
-		char szRcv[32];
-
-		ret = BC28_SendATCmdWaitRcv("AT\r", szRcv, 30, 500);
-
-		if(ret != 0)
-			break;
+		int reg;
 
-		BC28_Wrap_Sleep(500);
-	}
-
-	// check registration
-	if(ret == 1)
-	{
-		while(count--)
+		// without URC, query registration
+		if(!flagNetworkURC)
 		{
-			char szRcv[32];
+			char szRcv[64];
 
-			ret = BC28_SendATCmdWaitRcv("AT+CEREG?\r", szRcv, 30, 500);
-
-			if(ret == 1)
+			if(BC28_SendATCmdWaitRcv("AT+CEREG?\r", szRcv, 64, 500) == 1)
 			{
 				char *p = strchr(szRcv, ',');
-				if(p != NULL)
-				{
-					p++;
-					if(*p == '1')
-					{
-						ret = 1;
-						break;
-					}
-				}
 
-				ret = 0;
+				if(p != NULL)
+					ParseCEREG(p + 1);
 			}
-
-			BC28_Wrap_Sleep(500);
 		}
+
+		reg = stateNetwork.reg;
+		if(reg == BC28_REG_HOME || reg == BC28_REG_ROAMING)
+			return 1;
+
+		if(count-- <= 0)
+			break;
+
+		BC28_WaitNetworkChange(500);
 	}
 
-	return ret;
+	return 0;
+}
+
+
+/**
+  * @brief  To get network state cached from +CEREG and +CSCON URC, no AT command is sent.
+  * @param  state: pointer to receive state
+  * @retval None
+  */
+void BC28_GetNetworkState(BC28_NETWORK_STATE *state)
+{
+	BC28_Wrap_Lock();
+	*state = stateNetwork;
+	BC28_Wrap_Unlock();
+}
+
+
+/**
+  * @brief  To wait for change of registration or RRC connection, e.g. in reconnect
+  *			logic. Only one thread should wait at a time.
+  * @param  timeout in miliseconds
+  * @retval 1: changed, 0: timeout
+  */
+int BC28_WaitNetworkChange(int timeout)
+{
+	return BC28_Wrap_WaitEvent(BC28_EVENT_NETWORK, timeout);
 }
 
 
@@ -313,40 +782,19 @@ int BC28_WaitReady(int timeout)
   */
 int BC28_OpenTcpSocket(const char *ip, const char *port)
 {
-	int count = 3;
-	int ret = 0;
-	int socket = -1;
+	int socket;
+	char szCmd[64];
 	char szRcv[32];
 
-	while(count--)
-	{
-		ret = BC28_SendATCmdWaitRcv("AT+NSOCR=STREAM,6,4587,1\r", szRcv, 30, 1000);
-		if(ret == 1)
-		{
-			char *p = szRcv;
-			while(*p != 0 && *p < '+') p++;
-			socket = (*p - '0');
-			break;
-		}
-
-		BC28_Wrap_Sleep(1000);
-	}
-
+	socket = CreateSocket("STREAM,6");
 	if(socket >= 0)
 	{
-		char szCmd[64];
-
 		sprintf(szCmd, "AT+NSOCO=%d,%s,%s\r", socket, ip, port);
 		if(BC28_SendATCmdWaitRcv(szCmd, szRcv, 30, 5000) != 1)
 		{
-			sprintf(szCmd, "AT+NSOCL=%d\r", socket);
-			BC28_SendATCmd(szCmd);
+			BC28_CloseTcpSocket(socket);
 			socket = -1;
 		}
-		else
-		{
-			InitSocketRcvQ(socket);
-		}
 	}
 
 	return socket;
@@ -354,52 +802,60 @@ int BC28_OpenTcpSocket(const char *ip, const char *port)
 
 
 /**
-  * @brief  Use this function to send data via TCP connection.
-  * @param  socket: socket index, data: pointer to data, size: number of bytes
+  * @brief  Use this function to open UDP socket, no connection is made.
+  *			Close it by BC28_CloseUdpSocket().
+  * @param  None
+  * @retval socket index, -1: Failed
+  */
+int BC28_OpenUdpSocket(void)
+{
+	int socket = CreateSocket("DGRAM,17");
+	int idxQ = GetSocketSlot(socket);
+
+	if(idxQ >= 0)
+		flagSocketUdp[idxQ] = 1;
+
+	return socket;
+}
+
+
+/**
+  * @brief  Use this function to send a datagram by AT+NSOST.
+  * @param  socket: socket index, ip: IP address of peer, port: port number of peer,
+  *			data: pointer to data, size: number of bytes
   * @retval number of sent bytes
   */
-int BC28_WriteTcpSocket(int socket, uint8_t *data, int size)
+int BC28_SendUdpSocket(int socket, const char *ip, const char *port, const uint8_t *data, int size)
 {
-	char *szCmd = (char*)bufUartRcv;
+	BC28_IOVEC vec;
+	char szCmd[64];
 	char szRcv[32];
-	int i;
 
 	size = (size < MAX_SOCKET_PACKET_SIZE ? size : MAX_SOCKET_PACKET_SIZE);
-	sprintf(szCmd, "AT+NSOSD=%d,%d,", socket, size);
-
-	for(i=0; i<size; i++)
-	{
-		char szHex[4];
-
-		sprintf(szHex, "%02X", data[i]);
-		strcat(szCmd, szHex);
-	}
+	sprintf(szCmd, "AT+NSOST=%d,%s,%s,%d,", socket, ip, port, size);
 
-	strcat(szCmd, "\r");
+	vec.data = data;
+	vec.size = size;
 
-	if(BC28_SendATCmdWaitRcv(szCmd, szRcv, 30, 5000) == 1)
+	// response: <socket>,<length>
+	if(SendATReqWaitRcv(szCmd, &vec, 1, szRcv, 30, 5000) == 1)
 	{
 		char *p = strchr(szRcv, ',');
-		
+
 		size = 0;
 		if(p != NULL)
 		{
-			char *p1;
-
 			p++;
-			p1 = strchr(p, '\r');
-			if(p1 != NULL)
+			while(*p >= '0' && *p <= '9')
 			{
-				int digits;
-
-				digits = p1 - p;
-				for(i=0; i<digits; i++)
-				{
-					size = size*10 + (*p - '0');
-					p++;
-				}
+				size = size*10 + (*p - '0');
+				p++;
 			}
 		}
+
+		BC28_Wrap_Lock();
+		statBC28.socket_tx_bytes += size;
+		BC28_Wrap_Unlock();
 	}
 	else
 	{
@@ -411,255 +867,2256 @@ int BC28_WriteTcpSocket(int socket, uint8_t *data, int size)
 
 
 /**
-  * @brief  Use this function to read data from TCP connection.
-  * @param  socket: socket index, data: pointer to data, size: number of bytes
-  * @retval number of read bytes
+  * @brief  Use this function to read a datagram, the part longer than size is discarded.
+  * @param  socket: socket index, data: pointer to data, size: max number of bytes,
+  *			ip: buffer of 16 bytes to receive IP address of peer, NULL to ignore,
+  *			port: to receive port number of peer, NULL to ignore
+  * @retval number of read bytes, 0: no datagram
   */
-int BC28_ReadTcpSocket(int socket, uint8_t *data, int size)
+int BC28_ReadUdpSocket(int socket, uint8_t *data, int size, char *ip, int *port)
 {
-	int count = 0;
+	int idxQ = GetSocketSlot(socket);
+	uint8_t header[DATAGRAM_HEADER_SIZE];
+	int len;
 
-	while(count < size)
-	{
-		if(PopSocketRcvQ(socket, &data[count], 1) == 0)
-			break;
+	if(idxQ < 0 || !flagSocketUdp[idxQ])
+		return 0;
 
-		count++; 
-	}
+	// record is pushed at once, so header means the whole datagram is in queue
+	if(PeekSocketRcvQ(idxQ, header, DATAGRAM_HEADER_SIZE) < DATAGRAM_HEADER_SIZE)
+		return 0;
 
-	return count;
+	SkipSocketRcvQ(idxQ, DATAGRAM_HEADER_SIZE);
+
+	len = (header[6] << 8) | header[7];
+	if(size > len)
+		size = len;
+
+	size = PeekSocketRcvQ(idxQ, data, size);
+	SkipSocketRcvQ(idxQ, len);
+
+	if(ip != NULL)
+		sprintf(ip, "%d.%d.%d.%d", header[0], header[1], header[2], header[3]);
+	if(port != NULL)
+		*port = (header[4] << 8) | header[5];
+
+	ResumeSocketRcv(socket);
+
+	return size;
 }
 
 
 /**
-  * @brief  Use this function to close TCP connection.
+  * @brief  Use this function to close UDP socket.
   * @param  socket: socket index
   * @retval 1: Done, 0: no response, -1: ERROR
   */
-int BC28_CloseTcpSocket(int socket)
+int BC28_CloseUdpSocket(int socket)
 {
-	char szCmd[32], szRcv[32];
-
-	sprintf(szCmd, "AT+NSOCL=%d\r", socket);
-	return BC28_SendATCmdWaitRcv(szCmd, szRcv, 30, 5000);
+	return BC28_CloseTcpSocket(socket);
 }
 
 
 /**
-  * @brief  Use this function to set listener to handle received data via socket.
-  *			First parameter is socket index, and next parameter is number of bytes to read.
-  * @param  function pointer to listener
-  * @retval None
+  * @brief  Use this function to send data via TCP connection.
+  * @param  socket: socket index, data: pointer to data, size: number of bytes
+  * @retval number of sent bytes
   */
-void BC28_SetSocketListener(BC28_TASK listener)
+int BC28_WriteTcpSocket(int socket, uint8_t *data, int size)
 {
-	taskSocketListener = listener;
+	BC28_IOVEC vec;
+
+	vec.data = data;
+	vec.size = (size < MAX_SOCKET_PACKET_SIZE ? size : MAX_SOCKET_PACKET_SIZE);
+
+	return WriteSocketData(socket, &vec, 1, vec.size);
 }
 
 
 /**
-  * Local functions
+  * @brief  Use this function to write data in several buffers without copying them together,
+  *			e.g. header and payload of MQTT PUBLISH. Data longer than one AT+NSOSD is
+  *			sent by several commands.
+  * @param  socket: socket index, iov: array of buffers, iov_num: number of buffers,
+  *			up to BC28_MAX_IOVEC
+  * @retval number of sent bytes
   */
-static int InitSocketRcvQ(int socket)
+int BC28_WriteTcpSocketV(int socket, const BC28_IOVEC *iov, int iov_num)
 {
-	int idxQ = 0;	//TODO: get index of Q from socket#
-
-	headSocketRcvQ[idxQ] = 0;
-	tailSocketRcvQ[idxQ] = 0;
+	BC28_IOVEC part[BC28_MAX_IOVEC];
+	int index = 0, offset = 0, total = 0;
 
-	return 0;
-}
-
-static int PushSocketRcvQ(int socket, uint8_t *data, int size)
-{
-	int i = 0;
-	int idxQ = 0;	//TODO: get index of Q from socket#
+	if(iov == NULL || iov_num <= 0 || iov_num > BC28_MAX_IOVEC)
+		return 0;
 
-	for(; i<size; i++)
+	while(index < iov_num)
 	{
-		bufSocketRcvQ[idxQ][tailSocketRcvQ[idxQ]++] = data[i];
-		if(tailSocketRcvQ[idxQ] >= SOCKET_RCV_BUF_SIZE)
-			tailSocketRcvQ[idxQ] = 0;
+		int num = 0, size = 0, sent;
 
-		//overwrite
-		if(tailSocketRcvQ[idxQ] == headSocketRcvQ[idxQ])
-			headSocketRcvQ[idxQ]++;
-		if(headSocketRcvQ[idxQ] >= SOCKET_RCV_BUF_SIZE)
-			headSocketRcvQ[idxQ] = 0;
-	}
+		// take up to MAX_SOCKET_PACKET_SIZE bytes from buffers
+		while(index < iov_num && size < MAX_SOCKET_PACKET_SIZE)
+		{
+			int len = iov[index].size - offset;
 
-	return i;
-}
+			if(len > MAX_SOCKET_PACKET_SIZE - size)
+				len = MAX_SOCKET_PACKET_SIZE - size;
 
-static int PopSocketRcvQ(int socket, uint8_t *data, int size)
-{
-	int count = 0;
-	int idxQ = 0;	//TODO: get index of Q from socket#
+			if(len > 0)
+			{
+				part[num].data = iov[index].data + offset;
+				part[num].size = len;
+				num++;
+				size += len;
+				offset += len;
+			}
 
-	if(tailSocketRcvQ[idxQ] == headSocketRcvQ[idxQ])
+			if(offset >= iov[index].size)
+			{
+				index++;
+				offset = 0;
+			}
+		}
+
+		if(size == 0)
+			break;
+
+		sent = WriteSocketData(socket, part, num, size);
+		total += sent;
+		if(sent != size)
+			break;
+	}
+
+	return total;
+}
+
+// AT+NSOSD=<socket>,<length>,<data>, returns number of bytes accepted by BC28
+static int WriteSocketData(int socket, const BC28_IOVEC *data, int data_num, int size)
+{
+	char szCmd[32];
+	char szRcv[32];
+	int i;
+
+	sprintf(szCmd, "AT+NSOSD=%d,%d,", socket, size);
+
+	// payload is encoded to hex while writing UART
+	if(SendATReqWaitRcv(szCmd, data, data_num, szRcv, 30, 5000) == 1)
+	{
+		char *p = strchr(szRcv, ',');
+		
+		size = 0;
+		if(p != NULL)
+		{
+			char *p1;
+
+			p++;
+			p1 = strchr(p, '\r');
+			if(p1 != NULL)
+			{
+				int digits;
+
+				digits = p1 - p;
+				for(i=0; i<digits; i++)
+				{
+					size = size*10 + (*p - '0');
+					p++;
+				}
+			}
+		}
+
+		BC28_Wrap_Lock();
+		statBC28.socket_tx_bytes += size;
+		BC28_Wrap_Unlock();
+	}
+	else
+	{
+		size = 0;
+	}
+
+	return size;
+}
+
+
+/**
+  * @brief  Use this function to send data via TCP connection without waiting.
+  *			AT+NSOSD is queued with a sequence number, and callback is called with
+  *			status 1: sent by radio, 0: failed to send, -1: rejected by BC28 or no
+  *			response, in the context of BC28_PushReceivedByte(), maybe ISR.
+  * @param  socket: socket index, data: pointer to data which must be valid until callback,
+  *			size: number of bytes, callback: called while completed, NULL to ignore,
+  *			context: user pointer passed to callback
+  * @retval sequence number 1 ~ 255, 0: window or AT queue is full
+  */
+int BC28_SendTcpSocket(int socket, const uint8_t *data, int size,
+					   BC28_SEND_CALLBACK callback, void *context)
+{
+	return SendSocketReq(socket, data, size, BC28_RAI_NONE, callback, context);
+}
+
+
+/**
+  * @brief  Use this function to queue data until BC28_FlushUplink(), so that data of
+  *			several calls, e.g. MQTT publish and ping, is sent in one radio connection.
+  *			The queue is flushed as well while BC28 enters connected mode for others.
+  * @param  socket: socket index, data: pointer to data which must be valid until callback,
+  *			size: number of bytes, reply: 1 if a reply is expected, e.g. PUBACK,
+  *			callback and context: see BC28_SendTcpSocket()
+  * @retval 1: queued, 0: queue is full
+  */
+int BC28_QueueUplink(int socket, const uint8_t *data, int size, int reply,
+					 BC28_SEND_CALLBACK callback, void *context)
+{
+	UPLINK_ENTRY *entry;
+
+	BC28_Wrap_Lock();
+
+	if(countUplink >= MAX_SEND_WINDOW)
+	{
+		BC28_Wrap_Unlock();
+		return 0;
+	}
+
+	entry = &queueUplink[countUplink++];
+	entry->socket = socket;
+	entry->data = data;
+	entry->size = size;
+	entry->reply = reply;
+	entry->callback = callback;
+	entry->context = context;
+
+	BC28_Wrap_Unlock();
+
+	return 1;
+}
+
+
+/**
+  * @brief  Use this function to send data queued by BC28_QueueUplink() back-to-back.
+  *			The last AT+NSOSD carries Release Assistance Indication, so that the
+  *			radio is released right after it, or after the reply if one is expected,
+  *			instead of waiting for the inactivity timer.
+  *			Packets queued during flushing are sent as well, RAI goes with the
+  *			packet which is the last one in queue when it is sent.
+  *			Packets of closed socket are dropped with callback status 0.
+  * @param  None
+  * @retval number of sent packets, the rest is kept if send window is full
+  */
+int BC28_FlushUplink(void)
+{
+	int i, sent = 0, reply = 0;
+
+	BC28_Wrap_Lock();
+
+	if(flagFlushingUplink)
+	{
+		BC28_Wrap_Unlock();
+		return 0;
+	}
+	flagFlushingUplink = 1;
+
+	// only this function removes packets, QueueUplink() appends them at any time
+	while(countUplink > 0)
+	{
+		UPLINK_ENTRY entry = queueUplink[0];
+		int ret = 0;
+
+		reply |= entry.reply;
+
+		BC28_Wrap_Unlock();
+
+		// wait a while if AT queue or send window is full
+		for(i=10000/100; i>0; i--)
+		{
+			int flag = BC28_RAI_NONE;
+
+			if(GetSocketSlot(entry.socket) < 0)
+			{
+				ret = -1;
+				break;
+			}
+
+			// choose flag and queue AT+NSOSD in one lock, UART is written after unlocking
+			BC28_Wrap_Lock();
+			if(countUplink == 1)
+				flag = reply ? BC28_RAI_DL : BC28_RAI_UL;
+			ret = QueueSocketReq(entry.socket, entry.data, entry.size, flag, entry.callback, entry.context) ? 1 : 0;
+			BC28_Wrap_Unlock();
+
+			if(ret > 0)
+			{
+				SendQueuedATReq();
+				break;
+			}
+
+			BC28_Wrap_WaitEvent(BC28_EVENT_AT_FREE, 100);
+		}
+
+		if(ret < 0 && entry.callback != NULL)
+			entry.callback(entry.socket, 0, 0, entry.context);
+
+		BC28_Wrap_Lock();
+
+		// keep the rest
+		if(ret == 0)
+			break;
+
+		for(i=1; i<countUplink; i++)
+			queueUplink[i - 1] = queueUplink[i];
+		countUplink--;
+
+		if(ret > 0)
+			sent++;
+	}
+
+	flagFlushingUplink = 0;
+
+	BC28_Wrap_Unlock();
+
+	return sent;
+}
+
+
+/**
+  * @brief  Use this function to request PSM timers by AT+CPSMS, strings are 8-bit
+  *			binary values of 3GPP TS 24.008, e.g. tau "00100011", active "00000101".
+  * @param  tau: periodic TAU (T3412), active: active time (T3324), NULL to disable PSM
+  * @retval 1: Done, 0: no response, -1: ERROR
+  */
+int BC28_SetPowerSaving(const char *tau, const char *active)
+{
+	char szCmd[48];
+	char szRcv[32];
+
+	if(tau == NULL || active == NULL)
+		sprintf(szCmd, "AT+CPSMS=0\r");
+	else
+		sprintf(szCmd, "AT+CPSMS=1,,,\"%.8s\",\"%.8s\"\r", tau, active);
+
+	return BC28_SendATCmdWaitRcv(szCmd, szRcv, 32, 1000);
+}
+
+
+/**
+  * @brief  Use this function to request eDRX by AT+NPTWEDRXS, strings are 4-bit
+  *			binary values, e.g. ptw "0011", edrx "0101".
+  * @param  ptw: paging time window, edrx: eDRX cycle, NULL to disable eDRX
+  * @retval 1: Done, 0: no response, -1: ERROR
+  */
+int BC28_SetEDRX(const char *ptw, const char *edrx)
+{
+	char szCmd[48];
+	char szRcv[32];
+
+	if(ptw == NULL || edrx == NULL)
+		sprintf(szCmd, "AT+NPTWEDRXS=0,5\r");
+	else
+		sprintf(szCmd, "AT+NPTWEDRXS=2,5,\"%.4s\",\"%.4s\"\r", ptw, edrx);
+
+	return BC28_SendATCmdWaitRcv(szCmd, szRcv, 32, 1000);
+}
+
+// flag: <flag> of AT+NSOSD, e.g. BC28_RAI_UL
+static int SendSocketReq(int socket, const uint8_t *data, int size, int flag,
+						 BC28_SEND_CALLBACK callback, void *context)
+{
+	int seq;
+
+	BC28_Wrap_Lock();
+	seq = QueueSocketReq(socket, data, size, flag, callback, context);
+	BC28_Wrap_Unlock();
+
+	if(seq > 0)
+		SendQueuedATReq();
+
+	return seq;
+}
+
+// Called with lock held, AT+NSOSD is written to UART by SendQueuedATReq() after unlocking.
+static int QueueSocketReq(int socket, const uint8_t *data, int size, int flag,
+						  BC28_SEND_CALLBACK callback, void *context)
+{
+	SEND_ENTRY *entry = NULL;
+	BC28_IOVEC vec;
+	int i, j;
+	int count = 0;
+
+	if(GetSocketSlot(socket) < 0)
+		return 0;
+
+	size = (size < MAX_SOCKET_PACKET_SIZE ? size : MAX_SOCKET_PACKET_SIZE);
+
+	for(i=0; i<MAX_SEND_WINDOW; i++)
+	{
+		if(tableSend[i].used)
+			count++;
+		else if(entry == NULL)
+			entry = &tableSend[i];
+	}
+
+	if(count >= windowSend || entry == NULL)
+		return 0;
+
+	// next sequence not in use
+	for(j=0; j<255; j++)
+	{
+		seqSend = (seqSend % 255) + 1;
+
+		for(i=0; i<MAX_SEND_WINDOW; i++)
+		{
+			if(tableSend[i].used && tableSend[i].seq == seqSend)
+				break;
+		}
+
+		if(i == MAX_SEND_WINDOW)
+			break;
+	}
+
+	entry->used = SEND_QUEUED;
+	entry->socket = socket;
+	entry->seq = seqSend;
+	entry->size = size;
+	entry->status = SEND_STATUS_NONE;
+	entry->callback = callback;
+	entry->context = context;
+
+	sprintf(entry->cmd, "AT+NSOSD=%d,%d,", socket, size);
+	sprintf(entry->suffix, ",0x%X,%d\r", flag, entry->seq);
+
+	vec.data = data;
+	vec.size = size;
+
+	if(!QueueATReq(entry->cmd, &vec, 1, entry->suffix, NULL, 0, OnSocketSent, entry, NULL))
+	{
+		entry->used = SEND_FREE;
+		return 0;
+	}
+
+	return entry->seq;
+}
+
+
+/**
+  * @brief  Use this function to limit the number of sends by BC28_SendTcpSocket()
+  *			waiting for +NSOSTR.
+  * @param  window: 1 ~ MAX_SEND_WINDOW
+  * @retval None
+  */
+void BC28_SetSendWindow(int window)
+{
+	if(window < 1)
+		window = 1;
+	else if(window > MAX_SEND_WINDOW)
+		window = MAX_SEND_WINDOW;
+
+	windowSend = window;
+}
+
+
+/**
+  * @brief  Use this function to read data from TCP connection.
+  * @param  socket: socket index, data: pointer to data, size: number of bytes
+  * @retval number of read bytes
+  */
+int BC28_ReadTcpSocket(int socket, uint8_t *data, int size)
+{
+	int idxQ = GetSocketSlot(socket);
+	int count;
+
+	if(idxQ < 0)
+		return 0;
+
+	count = PopSocketRcvQ(idxQ, data, size);
+
+	ResumeSocketRcv(socket);
+
+	return count;
+}
+
+
+/**
+  * @brief  Use this function to read data without removing it from receive queue.
+  * @param  socket: socket index, data: pointer to data, size: number of bytes
+  * @retval number of read bytes
+  */
+int BC28_PeekTcpSocket(int socket, uint8_t *data, int size)
+{
+	int idxQ = GetSocketSlot(socket);
+
+	return (idxQ < 0) ? 0 : PeekSocketRcvQ(idxQ, data, size);
+}
+
+
+/**
+  * @brief  Use this function to remove data from receive queue without reading.
+  * @param  socket: socket index, size: number of bytes
+  * @retval number of removed bytes
+  */
+int BC28_SkipTcpSocket(int socket, int size)
+{
+	int idxQ = GetSocketSlot(socket);
+	int count;
+
+	if(idxQ < 0)
+		return 0;
+
+	count = SkipSocketRcvQ(idxQ, size);
+
+	ResumeSocketRcv(socket);
+
+	return count;
+}
+
+
+/**
+  * @brief  Use this function to get number of bytes in receive queue.
+  * @param  socket: socket index
+  * @retval number of bytes
+  */
+int BC28_AvailableTcpSocket(int socket)
+{
+	int idxQ = GetSocketSlot(socket);
+
+	return (idxQ < 0) ? 0 : CountSocketRcvQ(idxQ);
+}
+
+
+/**
+  * @brief  Use this function to get number of bytes dropped by full receive queue.
+  *			The counter is cleared after reading.
+  * @param  socket: socket index
+  * @retval number of dropped bytes, 0: no error
+  */
+int BC28_GetSocketOverflow(int socket)
+{
+	int idxQ = GetSocketSlot(socket);
+	int count;
+
+	if(idxQ < 0)
+		return 0;
+
+	BC28_Wrap_Lock();
+	count = droppedSocketRcvQ[idxQ];
+	droppedSocketRcvQ[idxQ] = 0;
+	BC28_Wrap_Unlock();
+
+	return count;
+}
+
+
+/**
+  * @brief  Use this function to decide what to do while receive queue is full.
+  *			BC28_SOCKET_OVERFLOW_BLOCK: keep data in BC28 until application reads queue,
+  *			BC28_SOCKET_OVERFLOW_DROP_NEWEST: drop received data which does not fit,
+  *			BC28_SOCKET_OVERFLOW_ERROR: drop whole received packet and report by BC28_GetSocketOverflow().
+  * @param  policy: enum BC28_SOCKET_OVERFLOW
+  * @retval None
+  */
+void BC28_SetSocketOverflowPolicy(int policy)
+{
+	policySocketOverflow = policy;
+}
+
+
+/**
+  * @brief  Use this function to choose how BC28 notifies received data.
+  *			BC28_SOCKET_NOTIFY_LENGTH: +NSONMI with length, data is read by AT+NSORF,
+  *			BC28_SOCKET_NOTIFY_DATA_ADDR: +NSONMI with address, port and data,
+  *			BC28_SOCKET_NOTIFY_DATA: +NSONMI with data only.
+  *			With data in +NSONMI, no AT+NSORF round trip is needed, but data can't be
+  *			left in BC28, so BC28_SOCKET_OVERFLOW_BLOCK drops data like DROP_NEWEST,
+  *			and packets longer than MAX_SOCKET_PACKET_SIZE are lost.
+  *			The mode is set again by BC28_Init() after reboot.
+  * @param  mode: enum BC28_SOCKET_NOTIFY
+  * @retval 1: Done, 0: no response, -1: ERROR
+  */
+int BC28_SetSocketNotifyMode(int mode)
+{
+	char szCmd[16];
+	char szRcv[32];
+	int ret;
+
+	sprintf(szCmd, "AT+NSONMI=%d\r", mode);
+	ret = BC28_SendATCmdWaitRcv(szCmd, szRcv, 32, 500);
+	if(ret == 1)
+		modeSocketNotify = mode;
+
+	return ret;
+}
+
+
+/**
+  * @brief  Use this function to close TCP connection.
+  * @param  socket: socket index
+  * @retval 1: Done, 0: no response, -1: ERROR
+  */
+int BC28_CloseTcpSocket(int socket)
+{
+	char szCmd[32], szRcv[32];
+
+	FreeSocketSlot(socket);
+	FailSocketSend(socket);
+
+	sprintf(szCmd, "AT+NSOCL=%d\r", socket);
+	return BC28_SendATCmdWaitRcv(szCmd, szRcv, 30, 5000);
+}
+
+
+/**
+  * @brief  Use this function to recover TCP connection after failure, e.g. no
+  *			response of MQTT ping. It escalates through cheaper steps first:
+  *			1. close and reopen socket, skipped if not registered,
+  *			2. detach and attach by AT+CFUN=0/1, then reopen socket,
+  *			3. reboot BC28, then reopen socket.
+  *			Failed steps in a row are delayed by exponential backoff with jitter,
+  *			so that many devices do not retry at the same time.
+  *			Counters of each step are in BC28_STATISTICS.
+  * @param  socket: socket index to close, -1 if not opened,
+  *			ip: IP address of server, port: port number of server
+  * @retval socket index, -1: Failed
+  */
+int BC28_RecoverTcpSocket(int socket, const char *ip, const char *port)
+{
+	BC28_NETWORK_STATE state;
+	char szRcv[32];
+	int step;
+
+	if(socket >= 0)
+		BC28_CloseTcpSocket(socket);
+
+	BC28_GetNetworkState(&state);
+	step = (state.reg == BC28_REG_HOME || state.reg == BC28_REG_ROAMING) ? 1 : 2;
+
+	for(; step<=3; step++)
+	{
+		WaitRecoverBackoff();
+
+		if(step == 2)
+		{
+			BC28_Wrap_Lock();
+			statBC28.recover_attach++;
+			BC28_Wrap_Unlock();
+			BC28_SendATCmdWaitRcv("AT+CFUN=0\r", szRcv, 32, 10000);
+			if(BC28_SendATCmdWaitRcv("AT+CFUN=1\r", szRcv, 32, 10000) != 1 ||
+				!BC28_WaitReady(RECOVER_ATTACH_TIMEOUT))
+			{
+				countRecoverFail++;
+				continue;
+			}
+		}
+		else if(step == 3)
+		{
+			BC28_Wrap_Lock();
+			statBC28.recover_reboot++;
+			BC28_Wrap_Unlock();
+			BC28_Reboot();
+			if(!BC28_WaitReady(RECOVER_ATTACH_TIMEOUT))
+			{
+				countRecoverFail++;
+				continue;
+			}
+		}
+		else
+		{
+			BC28_Wrap_Lock();
+			statBC28.recover_socket++;
+			BC28_Wrap_Unlock();
+		}
+
+		socket = BC28_OpenTcpSocket(ip, port);
+		if(socket >= 0)
+		{
+			countRecoverFail = 0;
+			return socket;
+		}
+
+		countRecoverFail++;
+	}
+
+	BC28_Wrap_Lock();
+	statBC28.recover_failed++;
+	BC28_Wrap_Unlock();
+
+	return -1;
+}
+
+
+/**
+  * @brief  Use this function to set listener to handle received data via socket.
+  *			First parameter is socket index, and next parameter is number of bytes to read,
+  *			-1 means socket is closed by peer.
+  *			It is used by sockets without their own listener.
+  * @param  function pointer to listener
+  * @retval None
+  */
+void BC28_SetSocketListener(BC28_TASK listener)
+{
+	BC28_Wrap_Lock();
+	taskSocketListener = listener;
+	BC28_Wrap_Unlock();
+}
+
+
+/**
+  * @brief  Use this function to set listener of one socket, set it after opening socket.
+  *			First parameter is socket index, and next parameter is number of bytes to read,
+  *			-1 means socket is closed by peer.
+  * @param  socket: socket index, listener: function pointer to listener, NULL to use common one
+  * @retval 1: Done, 0: socket is not opened
+  */
+int BC28_SetTcpSocketListener(int socket, BC28_TASK listener)
+{
+	int idxQ = GetSocketSlot(socket);
+
+	if(idxQ < 0)
+		return 0;
+
+	// read by URC handlers in the context of BC28_PushReceivedByte()
+	BC28_Wrap_Lock();
+	taskSocketListenerQ[idxQ] = listener;
+	BC28_Wrap_Unlock();
+
+	return 1;
+}
+
+
+/**
+  * @brief  To get counters of driver, e.g. UART bytes per payload byte is
+  *			(uart_tx_bytes + uart_rx_bytes) / (socket_tx_bytes + socket_rx_bytes).
+  * @param  stat: pointer to receive counters
+  * @retval None
+  */
+void BC28_GetStatistics(BC28_STATISTICS *stat)
+{
+	BC28_Wrap_Lock();
+	*stat = statBC28;
+	BC28_Wrap_Unlock();
+}
+
+
+/**
+  * @brief  To clear counters of driver.
+  * @param  None
+  * @retval None
+  */
+void BC28_ResetStatistics(void)
+{
+	BC28_Wrap_Lock();
+	memset(&statBC28, 0, sizeof(statBC28));
+	BC28_Wrap_Unlock();
+}
+
+
+/**
+  * Local functions
+  */
+static int AllocSocketSlot(int socket)
+{
+	int idxQ, i;
+
+	BC28_Wrap_Lock();
+
+	idxQ = slotSocket[socket];
+	if(idxQ < 0)
+	{
+		for(idxQ=0; idxQ<MAX_SOCKET_NUM; idxQ++)
+		{
+			for(i=0; i<SOCKET_ID_NUM; i++)
+			{
+				if(slotSocket[i] == idxQ)
+					break;
+			}
+
+			if(i == SOCKET_ID_NUM)
+				break;
+		}
+
+		if(idxQ < MAX_SOCKET_NUM)
+		{
+			InitSocketRcvQ(idxQ);
+			taskSocketListenerQ[idxQ] = NULL;
+			slotSocket[socket] = (int8_t)idxQ;
+		}
+		else
+		{
+			idxQ = -1;
+		}
+	}
+
+	BC28_Wrap_Unlock();
+
+	return idxQ;
+}
+
+static int GetSocketSlot(int socket)
+{
+	if(socket < 0 || socket >= SOCKET_ID_NUM)
+		return -1;
+
+	return slotSocket[socket];
+}
+
+static void FreeSocketSlot(int socket)
+{
+	if(socket < 0 || socket >= SOCKET_ID_NUM)
+		return;
+
+	BC28_Wrap_Lock();
+	slotSocket[socket] = -1;
+	BC28_Wrap_Unlock();
+}
+
+static int InitSocketRcvQ(int idxQ)
+{
+
+	ATOMIC_STORE_RELAXED(&queueSocketRcv[idxQ].head, 0);
+	ATOMIC_STORE_RELEASE(&queueSocketRcv[idxQ].tail, 0);
+	droppedSocketRcvQ[idxQ] = 0;
+	pendingSocketRcv[idxQ] = 0;
+	flagSocketRcvBlocked[idxQ] = 0;
+	flagSocketReading[idxQ] = 0;
+	flagSocketUdp[idxQ] = 0;
+
+	return 0;
+}
+
+static int CountSocketRcvQ(int idxQ)
+{
+	int count = ATOMIC_LOAD_ACQUIRE(&queueSocketRcv[idxQ].tail) -
+		ATOMIC_LOAD_ACQUIRE(&queueSocketRcv[idxQ].head);
+
+	return (count < 0) ? (count + SOCKET_RCV_BUF_SIZE) : count;
+}
+
+static int SpaceSocketRcvQ(int idxQ)
+{
+	return SOCKET_RCV_BUF_SIZE - 1 - CountSocketRcvQ(idxQ);
+}
+
+// Producer side, copy at most two blocks into queue, return number of bytes pushed.
+static int PushSocketRcvQ(int idxQ, const uint8_t *data, int size)
+{
+	SOCKET_RCV_Q *q = &queueSocketRcv[idxQ];
+	int tail = ATOMIC_LOAD_RELAXED(&q->tail);
+	int space = SOCKET_RCV_BUF_SIZE - 1 - (tail - ATOMIC_LOAD_ACQUIRE(&q->head));
+	int num;
+
+	if(space >= SOCKET_RCV_BUF_SIZE)
+		space -= SOCKET_RCV_BUF_SIZE;
+
+	if(size > space)
+	{
+		BC28_Wrap_Lock();
+		if(policySocketOverflow == BC28_SOCKET_OVERFLOW_ERROR)
+		{
+			droppedSocketRcvQ[idxQ] += size;
+			size = 0;
+		}
+		else
+		{
+			droppedSocketRcvQ[idxQ] += size - space;
+			size = space;
+		}
+		BC28_Wrap_Unlock();
+	}
+
+	num = SOCKET_RCV_BUF_SIZE - tail;
+	if(num > size)
+		num = size;
+
+	memcpy(&q->buf[tail], data, num);
+	if(size > num)
+		memcpy(&q->buf[0], &data[num], size - num);
+
+	tail += size;
+	if(tail >= SOCKET_RCV_BUF_SIZE)
+		tail -= SOCKET_RCV_BUF_SIZE;
+
+	// publish data to consumer
+	ATOMIC_STORE_RELEASE(&q->tail, tail);
+
+	return size;
+}
+
+// Consumer side, copy at most two blocks from queue without removing them, return number of bytes.
+static int PeekSocketRcvQ(int idxQ, uint8_t *data, int size)
+{
+	SOCKET_RCV_Q *q = &queueSocketRcv[idxQ];
+	int head = ATOMIC_LOAD_RELAXED(&q->head);
+	int count = ATOMIC_LOAD_ACQUIRE(&q->tail) - head;
+	int num;
+
+	if(count < 0)
+		count += SOCKET_RCV_BUF_SIZE;
+
+	if(size > count)
+		size = count;
+
+	num = SOCKET_RCV_BUF_SIZE - head;
+	if(num > size)
+		num = size;
+
+	memcpy(data, &q->buf[head], num);
+	if(size > num)
+		memcpy(&data[num], &q->buf[0], size - num);
+
+	return size;
+}
+
+// Consumer side, release space to producer.
+static int SkipSocketRcvQ(int idxQ, int size)
+{
+	SOCKET_RCV_Q *q = &queueSocketRcv[idxQ];
+	int head = ATOMIC_LOAD_RELAXED(&q->head);
+	int count = ATOMIC_LOAD_ACQUIRE(&q->tail) - head;
+
+	if(count < 0)
+		count += SOCKET_RCV_BUF_SIZE;
+
+	if(size > count)
+		size = count;
+
+	head += size;
+	if(head >= SOCKET_RCV_BUF_SIZE)
+		head -= SOCKET_RCV_BUF_SIZE;
+
+	ATOMIC_STORE_RELEASE(&q->head, head);
+
+	return size;
+}
+
+static int PopSocketRcvQ(int idxQ, uint8_t *data, int size)
+{
+	return SkipSocketRcvQ(idxQ, PeekSocketRcvQ(idxQ, data, size));
+}
+
+// Continue reading data left in BC28 if the queue has been paused and has space now.
+static void ResumeSocketRcv(int socket)
+{
+	int idxQ = GetSocketSlot(socket);
+	int resume = 0, pending = 0;
+
+	if(idxQ < 0)
+		return;
+
+	BC28_Wrap_Lock();
+	if(flagSocketRcvBlocked[idxQ] &&
+		SpaceSocketRcvQ(idxQ) >= (SOCKET_RCV_BUF_SIZE >> 1))
+	{
+		flagSocketRcvBlocked[idxQ] = 0;
+		pending = pendingSocketRcv[idxQ];
+		resume = 1;
+	}
+	BC28_Wrap_Unlock();
+
+	if(resume)
+		BC28_Wrap_PostTask(ReadSocketTask, socket, pending);
+}
+
+static int BC28_strlen(const char *src)
+{
+	char *p = (char*)src;
+
+	if(src == NULL)
+		return 0;
+
+	while(*p != 0) p++;
+
+	return (int)(p - src);
+}
+
+static char *BC28_strstr(const char *src, const char *tar)
+{
+	char *p = (char*)src;
+	char *p1 = (char*)tar;
+
+	if(src == NULL || tar == NULL)
+		return NULL;
+
+	while(*p != 0)
+	{
+		if(*p == *p1)
+		{
+			char *pr = p;
+
+			while((*p != 0) && (*p1 != 0))
+			{
+				if(*p != *p1)
+					break;
+
+				p++;
+				p1++;
+			}
+
+			if(*p1 == 0)
+			{
+				return pr;
+			}
+			else
+			{
+				p1 = (char*)tar;
+				continue;
+			}
+		}
+
+		p++;
+	}
+
+	return NULL;
+}
+
+// Narrow down URC candidates by the byte at offset of line.
+static void MatchURC(uint8_t b, int offset)
+{
+	uint32_t mask = maskURC;
+	int i;
+
+	for(i=0; mask != 0; i++, mask >>= 1)
+	{
+		if((mask & 1) == 0)
+			continue;
+
+		if((uint8_t)tableURC[i].prefix[offset] != b)
+		{
+			maskURC &= ~(1UL << i);
+		}
+		else if(tableURC[i].prefix[offset + 1] == 0)
+		{
+			// whole prefix matched
+			matchURC = i;
+			maskURC = 0;
+			break;
+		}
+	}
+}
+
+static void HandleUartRcvLine(void)
+{
+	char *raw = (char*)&bufUartRcv[baseUartRcvLine];
+	int raw_len = countUartRcvBuf - baseUartRcvLine;
+	char *line = (posUartRcvLine < 0) ? raw : (char*)&bufUartRcv[posUartRcvLine];
+	int len = countUartRcvBuf - (int)(line - (char*)bufUartRcv);
+	int type = URC_TYPE_NONE;
+	int result = 0;
+	int keep = 0, lost = 0;
+	unsigned int sent;
+
+	bufUartRcv[countUartRcvBuf] = 0;
+
+	// length of text excluding "\r\n"
+	while(len > 0 && (line[len-1] == '\r' || line[len-1] == '\n'))
+		len--;
+
+	if(matchURC >= 0)
+	{
+		const URC_ENTRY *entry = &tableURC[matchURC];
+
+		type = entry->type;
+		if(entry->exact && entry->prefix[len] != 0)
+			type = URC_TYPE_NONE;
+	}
+
+	BC28_Wrap_Lock();
+
+	statBC28.uart_rx_bytes += countUartRxBytes;
+	countUartRxBytes = 0;
+
+	// only commands written to UART have response, the writer is out of lock while writing
+	sent = sendATQ + (flagSendingAT ? 1 : 0);
+
+	// information response has the same prefix as its command, e.g. "+CEREG:" of "AT+CEREG?"
+	if(type == URC_TYPE_URC && headATQ != sent)
+	{
+		const char *cmd = queueATReq[headATQ % BC28_AT_QUEUE_SIZE].cmd;
+		const char *prefix = tableURC[matchURC].prefix;
+		int i = 0;
+
+		if(cmd[0] == 'A' && cmd[1] == 'T')
+		{
+			while(prefix[i] != 0 && prefix[i] != ':' && cmd[i+2] == prefix[i])
+				i++;
+
+			if(prefix[i] == ':' && (cmd[i+2] == '?' || cmd[i+2] == '=' || cmd[i+2] == '\r' || cmd[i+2] == 0))
+				type = URC_TYPE_NONE;
+		}
+	}
+
+	// "OK" after boot message completes AT+NRB only, otherwise ignore it
+	if(type == URC_TYPE_OK && flagBootOK)
+	{
+		flagBootOK = 0;
+		if(headATQ == tailATQ || strncmp(queueATReq[headATQ % BC28_AT_QUEUE_SIZE].cmd, "AT+NRB", 6) != 0)
+			type = URC_TYPE_URC;
+	}
+
+	// response kept in arena belongs to a command flushed by timeout
+	if(baseUartRcvLine > 0 &&
+		(headATQ == tailATQ || !queueATReq[headATQ % BC28_AT_QUEUE_SIZE].arena || indexArenaATQ != headATQ))
+	{
+		lost = 1;
+	}
+
+	if(type != URC_TYPE_URC && headATQ != sent)
+	{
+		AT_REQ *req = &queueATReq[headATQ % BC28_AT_QUEUE_SIZE];
+
+		if(req->arena)
+		{
+			// leave line in UART buffer, no copy
+			keep = 1;
+			indexArenaATQ = headATQ;
+			req->rcv_len += raw_len;
+		}
+		else if(req->rcv != NULL)
+		{
+			// copy as much as rcv_size allows, rcv_len counts the whole response
+			int num = req->rcv_size - 1 - req->rcv_len;
+
+			if(num > raw_len)
+				num = raw_len;
+
+			if(num > 0)
+			{
+				memcpy(&req->rcv[req->rcv_len], raw, num);
+				req->rcv[req->rcv_len + num] = 0;
+			}
+
+			req->rcv_len += raw_len;
+		}
+		else
+		{
+			req->rcv_len += raw_len;
+		}
+
+		if(type == URC_TYPE_OK)
+			result = 1;
+		else if(type == URC_TYPE_ERROR)
+			result = -1;
+	}
+
+	BC28_Wrap_Unlock();
+
+	if(type == URC_TYPE_URC)
+	{
+		if(tableURC[matchURC].handler != NULL)
+			tableURC[matchURC].handler(line, len);
+	}
+
+	if(lost)
+	{
+		if(keep)
+			memmove(bufUartRcv, raw, raw_len);
+
+		baseUartRcvLine = 0;
+		countUartRcvBuf = keep ? raw_len : 0;
+	}
+
+	if(keep)
+	{
+		// arena is limited, the rest of UART buffer is kept to receive lines
+		baseUartRcvLine = (countUartRcvBuf < RCV_ARENA_SIZE) ? countUartRcvBuf : RCV_ARENA_SIZE;
+		bufUartRcv[baseUartRcvLine] = 0;
+	}
+
+	countUartRcvBuf = baseUartRcvLine;
+	posUartRcvLine = -1;
+	matchURC = -1;
+
+	if(result != 0)
+		CompleteATReq(result);
+}
+
+// +NSONMI:<socket>,<length>
+// +NSONMI:<socket>,<remote_addr>,<remote_port>,<length>,<data>
+// +NSONMI:<socket>,<length>,<data>
+static void OnNSONMI(const char *line, int len)
+{
+	const char *p = line + 8;
+	const char *field[5];
+	int socket, idxQ, size = 0;
+	int count = 0;
+
+	socket = *p - '0';
+
+	// find start of fields after <socket>
+	while(p < line + len && count < 5)
+	{
+		if(*p == ',')
+			field[count++] = p + 1;
+		p++;
+	}
+
+	if(count == 4)
+		p = field[2];
+	else if(count >= 1)
+		p = field[0];
+	else
+		return;
+
+	while(*p >= '0' && *p <= '9')
+	{
+		size = size*10 + (*p - '0');
+		p++;
+	}
+
+	idxQ = GetSocketSlot(socket);
+	if(idxQ >= 0)
+	{
+		if(count == 1)
+		{
+			BC28_Wrap_PostTask(ReadSocketTask, socket, size);
+		}
+		else
+		{
+			const char *hex = field[count - 1];
+
+			// data is in URC, decode in place and push to queue without AT+NSORF
+			if((int)(line + len - hex) >= (size << 1))
+			{
+				PushSocketPacket(idxQ, (uint8_t*)line, hex, size, (count == 4) ? field[0] : NULL);
+			}
+			else
+			{
+				BC28_Wrap_Lock();
+				droppedSocketRcvQ[idxQ] += size;
+				BC28_Wrap_Unlock();
+			}
+		}
+
+		PostSocketListener(socket, idxQ, size);
+	}
+}
+
+// Listener of socket, or the common one
+static void PostSocketListener(int socket, int idxQ, int size)
+{
+	BC28_TASK listener;
+
+	BC28_Wrap_Lock();
+	listener = (taskSocketListenerQ[idxQ] != NULL) ? taskSocketListenerQ[idxQ] : taskSocketListener;
+	BC28_Wrap_Unlock();
+
+	if(listener != NULL)
+		BC28_Wrap_PostTask(listener, socket, size);
+}
+
+// +NSOCLI:<socket>, socket is closed by peer
+static void OnNSOCLI(const char *line, int len)
+{
+	int socket = line[8] - '0';
+	int idxQ = GetSocketSlot(socket);
+
+	if(idxQ >= 0)
+	{
+		PostSocketListener(socket, idxQ, -1);
+	}
+}
+
+// +NSOSTR:<socket>,<sequence>,<status>
+static void OnNSOSTR(const char *line, int len)
+{
+	const char *p = line + 8;
+	int socket, seq = 0, status, i;
+
+	socket = *p - '0';
+
+	p += 2;
+	while(*p >= '0' && *p <= '9')
+	{
+		seq = seq*10 + (*p - '0');
+		p++;
+	}
+
+	if(*p != ',')
+		return;
+	status = (p[1] == '1') ? 1 : 0;
+
+	BC28_Wrap_Lock();
+
+	for(i=0; i<MAX_SEND_WINDOW; i++)
+	{
+		SEND_ENTRY *entry = &tableSend[i];
+
+		if(entry->used != SEND_FREE && entry->socket == socket && entry->seq == seq)
+		{
+			// before OK of AT+NSOSD is handled, OnSocketSent() releases it
+			if(entry->used == SEND_QUEUED)
+				entry->status = status;
+			else
+				ReleaseSocketSend(entry, status);
+			break;
+		}
+	}
+
+	BC28_Wrap_Unlock();
+}
+
+// +CEREG:<stat>[,<tac>,<ci>,<AcT>[,<cause_type>,<reject_cause>[,<Active-Time>,<Periodic-TAU>]]]
+static void OnCEREG(const char *line, int len)
+{
+	ParseCEREG(line + 7);
+}
+
+// +CSCON:<mode>, 0: idle, 1: connected
+static void OnCSCON(const char *line, int len)
+{
+	int rrc = line[7] - '0';
+	int flush;
+
+	if(rrc != 0 && rrc != 1)
+		return;
+
+	BC28_Wrap_Lock();
+	if(stateNetwork.rrc == rrc)
+	{
+		BC28_Wrap_Unlock();
+		return;
+	}
+	stateNetwork.rrc = rrc;
+	// radio is awake anyway, send queued uplink in the same connection
+	flush = (rrc == 1 && countUplink > 0);
+	BC28_Wrap_Unlock();
+
+	if(flush)
+		BC28_Wrap_PostTask(FlushUplinkTask, 0, 0);
+
+	BC28_Wrap_SetEvent(BC28_EVENT_NETWORK);
+}
+
+static void FlushUplinkTask(int param1, int param2)
+{
+	BC28_FlushUplink();
+}
+
+// REBOOT_CAUSE_xxx, BC28 is booting by AT+NRB or by itself, sockets and settings are lost
+static void OnREBOOT(const char *line, int len)
+{
+	int socket;
+
+	flagBootOK = 1;
+
+	BC28_Wrap_Lock();
+	statBC28.boots++;
+	BC28_Wrap_Unlock();
+
+	for(socket=0; socket<SOCKET_ID_NUM; socket++)
+	{
+		int idxQ = GetSocketSlot(socket);
+
+		if(idxQ < 0)
+			continue;
+
+		FailSocketSend(socket);
+
+		PostSocketListener(socket, idxQ, -1);
+	}
+
+	// after FailSocketSend(), AT+NSOSD lost by reboot is called back as failed
+	FailSentATReq();
+
+	ResetNetworkState();
+	BC28_Wrap_SetEvent(BC28_EVENT_NETWORK);
+}
+
+// Result of AT+NSOSD by BC28_SendTcpSocket(), +NSOSTR follows OK.
+// AT queue doesn't refer to entry any more, so it is released here if the
+// result is already known, e.g. socket is closed while AT+NSOSD is queued.
+static void OnSocketSent(int result, char *rcv, int rcv_len, void *context)
+{
+	SEND_ENTRY *entry = (SEND_ENTRY*)context;
+
+	BC28_Wrap_Lock();
+
+	if(result == 1)
+	{
+		statBC28.socket_tx_bytes += entry->size;
+
+		if(entry->status == SEND_STATUS_NONE)
+		{
+			entry->used = SEND_ACCEPTED;
+			BC28_Wrap_Unlock();
+			return;
+		}
+
+		ReleaseSocketSend(entry, entry->status);
+	}
+	else
+	{
+		ReleaseSocketSend(entry, (entry->status == SEND_STATUS_NONE) ? -1 : entry->status);
+	}
+
+	BC28_Wrap_Unlock();
+}
+
+// Socket is closed, +NSOSTR of pending sends will never arrive.
+// Entries still in AT queue are released by OnSocketSent().
+static void FailSocketSend(int socket)
+{
+	int i;
+
+	BC28_Wrap_Lock();
+
+	for(i=0; i<MAX_SEND_WINDOW; i++)
+	{
+		SEND_ENTRY *entry = &tableSend[i];
+
+		if(entry->socket != socket)
+			continue;
+
+		if(entry->used == SEND_ACCEPTED)
+			ReleaseSocketSend(entry, 0);
+		else if(entry->used == SEND_QUEUED)
+			entry->status = 0;
+	}
+
+	BC28_Wrap_Unlock();
+}
+
+// Free entry before callback, so that callback can send again.
+// Called with lock, which is released during callback.
+static void ReleaseSocketSend(SEND_ENTRY *entry, int status)
+{
+	BC28_SEND_CALLBACK callback;
+	void *context;
+	int socket, seq;
+
+	if(entry->used == SEND_FREE)
+		return;
+
+	callback = entry->callback;
+	context = entry->context;
+	socket = entry->socket;
+	seq = entry->seq;
+	entry->used = SEND_FREE;
+
+	BC28_Wrap_Unlock();
+
+	if(callback != NULL)
+		callback(socket, seq, status, context);
+
+	BC28_Wrap_Lock();
+}
+
+// Read data left in BC28 with one AT+NSORF in flight per socket, the response is
+// decoded in UART buffer by OnSocketRead() and the next read is posted from there.
+static void ReadSocketTask(int socket, int size)
+{
+	int idxQ = GetSocketSlot(socket);
+	SOCKET_READ *read;
+	int num, count = 10000/100 + 1;
+
+	if(idxQ < 0)
+		return;
+
+	read = &readSocket[idxQ];
+
+	BC28_Wrap_Lock();
+
+	if(size > pendingSocketRcv[idxQ])
+		pendingSocketRcv[idxQ] = size;
+
+	// +NSONMI during reading, read again after the current one
+	if(flagSocketReading[idxQ])
+	{
+		if(size > 0)
+			flagSocketReading[idxQ] = 2;
+		BC28_Wrap_Unlock();
+		return;
+	}
+
+	if(pendingSocketRcv[idxQ] <= 0)
+	{
+		BC28_Wrap_Unlock();
+		return;
+	}
+
+	num = pendingSocketRcv[idxQ] > MAX_SOCKET_PACKET_SIZE ? MAX_SOCKET_PACKET_SIZE : pendingSocketRcv[idxQ];
+
+	// backpressure, leave data in BC28 until application reads queue
+	if(policySocketOverflow == BC28_SOCKET_OVERFLOW_BLOCK)
+	{
+		int space = SpaceSocketRcvQ(idxQ);
+
+		// room for datagram record header
+		if(flagSocketUdp[idxQ])
+			space = (space > DATAGRAM_HEADER_SIZE) ? space - DATAGRAM_HEADER_SIZE : 0;
+
+		if(space == 0)
+		{
+			flagSocketRcvBlocked[idxQ] = 1;
+			BC28_Wrap_Unlock();
+			return;
+		}
+
+		if(num > space)
+			num = space;
+	}
+
+	flagSocketReading[idxQ] = 1;
+
+	BC28_Wrap_Unlock();
+
+	read->socket = socket;
+	sprintf(read->cmd, "AT+NSORF=%d,%d\r", socket, num);
+
+	while(count--)
+	{
+		if(SubmitATReq(read->cmd, NULL, 0, NULL, NULL, BC28_RCV_ARENA, OnSocketRead, read, NULL))
+			return;
+
+		BC28_Wrap_WaitEvent(BC28_EVENT_AT_FREE, 100);
+	}
+
+	flagSocketReading[idxQ] = 0;
+}
+
+// +NSORF response: <socket>,<ip_addr>,<port>,<length>,<data>,<remaining_length>
+static void OnSocketRead(int result, char *rcv, int rcv_len, void *context)
+{
+	SOCKET_READ *read = (SOCKET_READ*)context;
+	int idxQ = (int)(read - readSocket);
+	int socket = read->socket;
+	int remaining = -1, again;
+
+	if(result == 1 && rcv_len < RCV_ARENA_SIZE)
+	{
+		char *p = FindField(rcv, ',', 3);
+		char *p1, *p2;
+		int len = 0;
+
+		if(p != NULL && (p1 = strchr(p, ',')) != NULL)
+		{
+			while(p < p1)
+			{
+				len = len*10 + (*p - '0');
+				p++;
+			}
+
+			p2 = strchr(p1 + 1, ',');
+			if(p2 != NULL)
+			{
+				remaining = 0;
+
+				p2++;
+				while(*p2 >= '0' && *p2 <= '9')
+				{
+					remaining = remaining*10 + (*p2 - '0');
+					p2++;
+				}
+			}
+
+			// decode in place
+			PushSocketPacket(idxQ, (uint8_t*)rcv, p1 + 1, len, FindField(rcv, ',', 1));
+		}
+	}
+
+	BC28_Wrap_Lock();
+	// without remaining_length, stop reading until next +NSONMI
+	again = (flagSocketReading[idxQ] == 2);
+	pendingSocketRcv[idxQ] = (remaining > 0) ? remaining : (again ? MAX_SOCKET_PACKET_SIZE : 0);
+	flagSocketReading[idxQ] = 0;
+	BC28_Wrap_Unlock();
+
+	// read is reused by the next AT+NSORF from here
+	if(remaining > 0 || again)
+		BC28_Wrap_PostTask(ReadSocketTask, socket, 0);
+}
+
+// Parse fields of +CEREG from <stat>, strings may be quoted, e.g. "1A2B".
+static void ParseCEREG(const char *p)
+{
+	BC28_NETWORK_STATE state;
+	int field[8];
+	int i, changed;
+
+	for(i=0; i<8; i++)
+	{
+		int value = -1;
+		int base = (i == 1 || i == 2) ? 16 : ((i >= 6) ? 2 : 10);
+
+		if(*p == '"')
+			p++;
+
+		while(1)
+		{
+			int digit = HexCodec_DigitValue(*p);
+
+			if(digit < 0 || digit >= base)
+				break;
+
+			value = ((value < 0) ? 0 : value*base) + digit;
+			p++;
+		}
+
+		field[i] = value;
+
+		while(*p != ',' && *p != '\r' && *p != '\n' && *p != 0)
+			p++;
+		if(*p != ',')
+			break;
+		p++;
+	}
+
+	for(i++; i<8; i++)
+		field[i] = -1;
+
+	if(field[0] < 0)
+		return;
+
+	BC28_Wrap_Lock();
+
+	state = stateNetwork;
+	state.reg = field[0];
+	if(field[1] >= 0)
+		state.tac = (uint32_t)field[1];
+	if(field[2] >= 0)
+		state.ci = (uint32_t)field[2];
+	state.active_time = field[6];
+	state.periodic_tau = field[7];
+
+	changed = (state.reg != stateNetwork.reg);
+	stateNetwork = state;
+
+	BC28_Wrap_Unlock();
+
+	if(changed)
+		BC28_Wrap_SetEvent(BC28_EVENT_NETWORK);
+}
+
+// Sleep (RECOVER_BACKOFF_BASE << (n - 1)) plus up to half of it as jitter after n failures.
+static int WaitRecoverBackoff(void)
+{
+	int delay;
+
+	if(countRecoverFail == 0)
+		return 0;
+
+	// seed differs per device, IMEI is unique
+	if(seedRecover == 0)
+	{
+		const char *p = IMEI;
+
+		seedRecover = 2166136261u;
+		while(*p != 0)
+			seedRecover = (seedRecover ^ (uint8_t)*p++) * 16777619u;
+	}
+
+	delay = (countRecoverFail > 7) ? RECOVER_BACKOFF_MAX : (RECOVER_BACKOFF_BASE << (countRecoverFail - 1));
+	if(delay > RECOVER_BACKOFF_MAX)
+		delay = RECOVER_BACKOFF_MAX;
+
+	seedRecover = seedRecover * 1103515245u + 12345u;
+	delay += (int)((seedRecover >> 16) % (uint32_t)((delay >> 1) + 1));
+
+	BC28_Wrap_Sleep(delay);
+
+	return delay;
+}
+
+static void ResetNetworkState(void)
+{
+	BC28_Wrap_Lock();
+	stateNetwork.reg = -1;
+	stateNetwork.rrc = -1;
+	stateNetwork.active_time = -1;
+	stateNetwork.periodic_tau = -1;
+	flagNetworkURC = 0;
+	BC28_Wrap_Unlock();
+}
+
+// AT+NSOCR=<type>,<protocol>,<listen_port>,1 and allocate receive queue
+static int CreateSocket(const char *type)
+{
+	int count = 3;
+	int socket = -1;
+	char szCmd[64];
+	char szRcv[32];
+
+	while(count--)
 	{
-		return 0;
+		// each socket binds its own local port
+		sprintf(szCmd, "AT+NSOCR=%s,%d,1\r", type, LOCAL_PORT_BASE + (countLocalPort++ % LOCAL_PORT_NUM));
+
+		if(BC28_SendATCmdWaitRcv(szCmd, szRcv, 30, 1000) == 1)
+		{
+			char *p = szRcv;
+			while(*p != 0 && *p < '+') p++;
+			socket = (*p - '0');
+			break;
+		}
+
+		BC28_Wrap_Sleep(1000);
 	}
 
-	while(count < size)
+	if(socket >= 0 && (socket >= SOCKET_ID_NUM || AllocSocketSlot(socket) < 0))
+	{
+		// no free receive queue
+		sprintf(szCmd, "AT+NSOCL=%d\r", socket);
+		BC28_SendATCmdWaitRcv(szCmd, szRcv, 30, 5000);
+		socket = -1;
+	}
+
+	return socket;
+}
+
+// Decode hex into buf and push to queue, buf may be the same memory as hex.
+// For UDP, addr points to "<ip>,<port>" and the record header is put before data.
+static void PushSocketPacket(int idxQ, uint8_t *buf, const char *hex, int len, const char *addr)
+{
+	int offset = flagSocketUdp[idxQ] ? DATAGRAM_HEADER_SIZE : 0;
+	uint8_t header[DATAGRAM_HEADER_SIZE] = {0};
+	int pushed;
+
+	if(offset > 0)
 	{
-		data[count++] = bufSocketRcvQ[idxQ][headSocketRcvQ[idxQ]++];
-		if(headSocketRcvQ[idxQ] >= SOCKET_RCV_BUF_SIZE)
-			headSocketRcvQ[idxQ] = 0;
-		if(tailSocketRcvQ[idxQ] == headSocketRcvQ[idxQ])
+		int i, value, port = 0;
+
+		// IPv4 address and port, parsed before decoding overwrites them
+		for(i=0; addr != NULL && i<4; i++)
 		{
-			//headSocketRcvQ[idxQ] = tailSocketRcvQ[idxQ] = 0;
-			break;
+			value = 0;
+			while(*addr >= '0' && *addr <= '9')
+				value = value*10 + (*addr++ - '0');
+			header[i] = (uint8_t)value;
+			if(*addr != '.' && *addr != ',')
+				break;
+			addr++;
+		}
+
+		if(addr != NULL && i == 4)
+		{
+			while(*addr >= '0' && *addr <= '9')
+				port = port*10 + (*addr++ - '0');
+		}
+
+		header[4] = (uint8_t)(port >> 8);
+		header[5] = (uint8_t)port;
+		header[6] = (uint8_t)(len >> 8);
+		header[7] = (uint8_t)len;
+	}
+
+	// datagram is never split
+	if(len <= 0 || len > MAX_SOCKET_PACKET_SIZE || (offset > 0 && SpaceSocketRcvQ(idxQ) < offset + len) ||
+		HexCodec_Decode(buf + offset, hex, len << 1) != len)
+	{
+		BC28_Wrap_Lock();
+		droppedSocketRcvQ[idxQ] += (len > 0) ? len : 0;
+		BC28_Wrap_Unlock();
+		return;
+	}
+
+	memcpy(buf, header, offset);
+	pushed = PushSocketRcvQ(idxQ, buf, offset + len) - offset;
+	if(pushed > 0)
+	{
+		BC28_Wrap_Lock();
+		statBC28.socket_rx_bytes += pushed;
+		BC28_Wrap_Unlock();
+	}
+}
+
+static char* FindField(const char *str, char separator, int index)
+{
+	char *p = (char *)str;
+	int i;
+
+	for(i=0; i<index; i++)
+	{
+		char *p1 = strchr(p, separator);
+		if(p1 != NULL)
+		{
+			p = p1 + 1;
 		}
+		else
+		{
+			return NULL;
+		}
+	}
+
+	return p;
+}
+
+static int BC28_SendATCmd(const char *cmd)
+{
+	int size = strlen(cmd);
+
+	BC28_Wrap_Lock();
+	statBC28.uart_tx_bytes += size;
+	BC28_Wrap_Unlock();
+
+	return BC28_Wrap_Send((uint8_t*)cmd, size);
+}
+
+// Encode data to hex string chunk by chunk and write to UART directly.
+static int BC28_SendHex(const uint8_t *data, int size)
+{
+	char szHex[HEX_CHUNK_SIZE << 1];
+	int count = 0;
+
+	while(count < size)
+	{
+		int num = (size - count) > HEX_CHUNK_SIZE ? HEX_CHUNK_SIZE : (size - count);
+
+		BC28_Wrap_Send((uint8_t*)szHex, HexCodec_Encode(szHex, &data[count], num));
+		count += num;
 	}
 
+	BC28_Wrap_Lock();
+	statBC28.uart_tx_bytes += size << 1;
+	BC28_Wrap_Unlock();
+
 	return count;
 }
 
-static int BC28_strlen(const char *src)
+// index: returns index of queued command for blocking waiter, NULL for asynchronous call
+static int SubmitATReq(const char *cmd, const BC28_IOVEC *data, int data_num, const char *suffix,
+					   char *rcv, int rcv_size,
+					   BC28_AT_CALLBACK callback, void *context, unsigned int *index)
 {
-	char *p = (char*)src;
+	int ret;
 
-	if(src == NULL)
+	BC28_Wrap_Lock();
+	ret = QueueATReq(cmd, data, data_num, suffix, rcv, rcv_size, callback, context, index);
+	BC28_Wrap_Unlock();
+
+	if(ret)
+		SendQueuedATReq();
+
+	return ret;
+}
+
+// Called with lock held, the command is written to UART by SendQueuedATReq() after unlocking.
+static int QueueATReq(const char *cmd, const BC28_IOVEC *data, int data_num, const char *suffix,
+					  char *rcv, int rcv_size,
+					  BC28_AT_CALLBACK callback, void *context, unsigned int *index)
+{
+	AT_REQ *req;
+	unsigned int tail;
+
+	tail = tailATQ;
+	req = &queueATReq[tail % BC28_AT_QUEUE_SIZE];
+	if(tail - headATQ >= BC28_AT_QUEUE_SIZE || req->held)
 		return 0;
 
-	while(*p != 0) p++;
+	if(data_num > BC28_MAX_IOVEC)
+		data_num = BC28_MAX_IOVEC;
+
+	req->cmd = cmd;
+	req->data_num = (data != NULL) ? data_num : 0;
+	if(req->data_num > 0)
+		memcpy(req->data, data, req->data_num * sizeof(BC28_IOVEC));
+	req->suffix = suffix;
+	req->rcv = rcv;
+	req->rcv_size = rcv_size;
+	req->rcv_len = 0;
+	req->arena = (rcv == NULL && rcv_size == BC28_RCV_ARENA) ? 1 : 0;
+	req->callback = callback;
+	req->context = context;
+	req->held = (index != NULL) ? 1 : 0;
+	req->timedout = 0;
+	req->elapsed = 0;
+	if(rcv != NULL && rcv_size > 0)
+		*rcv = 0;
+	else if(rcv_size <= 0)
+		req->rcv = NULL;
+
+	if(index != NULL)
+	{
+		AT_WAIT *wait = (AT_WAIT*)context;
 
-	return (int)(p - src);
+		wait->event = BC28_EVENT_AT_DONE + (tail % BC28_AT_QUEUE_SIZE);
+
+		// clear event left by late response of previous command
+		while(BC28_Wrap_WaitEvent(wait->event, 0));
+
+		*index = tail;
+	}
+
+	tailATQ = tail + 1;
+	statBC28.at_cmds++;
+
+	return 1;
 }
 
-static char *BC28_strstr(const char *src, const char *tar)
+// Only one thread writes UART at a time, others just leave their commands in queue.
+static void SendQueuedATReq(void)
 {
-	char *p = (char*)src;
-	char *p1 = (char*)tar;
+	int watch = 0;
 
-	if(src == NULL || tar == NULL)
-		return NULL;
+	BC28_Wrap_Lock();
 
-	while(*p != 0)
+	if(flagSendingAT)
 	{
-		if(*p == *p1)
+		BC28_Wrap_Unlock();
+		return;
+	}
+
+	flagSendingAT = 1;
+
+	// paused until late responses of timed-out commands are drained
+	while(sendATQ != tailATQ && !flagResyncAT)
+	{
+		AT_REQ *req = &queueATReq[sendATQ % BC28_AT_QUEUE_SIZE];
+		const char *cmd = req->cmd;
+		BC28_IOVEC data[BC28_MAX_IOVEC];
+		int data_num = req->data_num;
+		const char *suffix = req->suffix;
+		// cmd may be reused as soon as the response is received, so check it before sending
+		int terminated = (strchr(cmd, '\r') != NULL);
+		int i;
+
+		// blocking caller has its own timeout, others are watched from now on
+		if(!req->held && !flagWatchingAT)
 		{
-			char *pr = p;
+			flagWatchingAT = 1;
+			watch = 1;
+		}
 
-			while((*p != 0) && (*p1 != 0))
-			{
-				if(*p != *p1)
-					break;
+		memcpy(data, req->data, data_num * sizeof(BC28_IOVEC));
 
-				p++;
-				p1++;
-			}
+		BC28_Wrap_Unlock();
 
-			if(*p1 == 0)
-			{
-				return pr;
-			}
-			else
-			{
-				p1 = (char*)tar;
+		BC28_SendATCmd(cmd);
+		for(i=0; i<data_num; i++)
+			BC28_SendHex(data[i].data, data[i].size);
+		if(suffix != NULL)
+			BC28_SendATCmd(suffix);
+		else if(!terminated)
+			BC28_SendATCmd("\r");
+
+		BC28_Wrap_Lock();
+		sendATQ++;
+	}
+
+	flagSendingAT = 0;
+
+	BC28_Wrap_Unlock();
+
+	if(watch)
+		BC28_Wrap_PostTask(WatchATTask, 0, 0);
+}
+
+static void CompleteATReq(int result)
+{
+	AT_REQ *req;
+	BC28_AT_CALLBACK callback;
+	void *context;
+	char *rcv;
+	int rcv_len, arena, event, resume = 0;
+
+	BC28_Wrap_Lock();
+
+	if(headATQ == tailATQ)
+	{
+		BC28_Wrap_Unlock();
+		return;
+	}
+
+	req = &queueATReq[headATQ % BC28_AT_QUEUE_SIZE];
+	event = FinishATWait(req, result);
+	callback = req->callback;
+	context = req->context;
+	arena = req->arena;
+	rcv = arena ? (char*)bufUartRcv : req->rcv;
+	rcv_len = req->rcv_len;
+	headATQ++;
+	if(result < 0)
+		statBC28.at_errors++;
+
+	// the last timed-out command is answered, queue is in step with UART again
+	if(flagResyncAT && headATQ == indexResyncATQ)
+	{
+		flagResyncAT = 0;
+		resume = 1;
+	}
+
+	BC28_Wrap_Unlock();
+
+	if(event >= 0)
+		BC28_Wrap_SetEvent(event);
+	else if(callback != NULL)
+		callback(result, rcv, rcv_len, context);
+
+	// arena is valid in callback only
+	if(arena)
+	{
+		baseUartRcvLine = 0;
+		countUartRcvBuf = 0;
+	}
+
+	BC28_Wrap_SetEvent(BC28_EVENT_AT_FREE);
+
+	// not in the context of BC28_PushReceivedByte(), it may be ISR
+	if(resume)
+		BC28_Wrap_PostTask(SendQueuedATTask, 0, 0);
+}
+
+// No response in time. Commands sent before this one are timeout as well.
+// wait is NULL for asynchronous command expired by WatchATTask().
+// Their callers get result 0, but the slots are kept to take the late final
+// result codes, see the comment of queueATReq.
+static void TimeoutATReq(unsigned int index, AT_WAIT *wait)
+{
+	BC28_AT_CALLBACK callback[BC28_AT_QUEUE_SIZE];
+	void *context[BC28_AT_QUEUE_SIZE];
+	int event[BC28_AT_QUEUE_SIZE];
+	unsigned int i;
+	int count = 0, resync = 0;
+
+	BC28_Wrap_Lock();
+
+	// wait until the command is written to UART completely
+	while(flagSendingAT && sendATQ == index)
+	{
+		BC28_Wrap_Unlock();
+		BC28_Wrap_Sleep(10);
+		BC28_Wrap_Lock();
+	}
+
+	if((wait != NULL && wait->done) || index - headATQ >= BC28_AT_QUEUE_SIZE)
+	{
+		BC28_Wrap_Unlock();
+		return;
+	}
+
+	if(index - headATQ < sendATQ - headATQ)
+	{
+		for(i=headATQ; i!=index + 1; i++)
+		{
+			AT_REQ *req = &queueATReq[i % BC28_AT_QUEUE_SIZE];
+
+			// already timed out and waiting for late response
+			if(req->timedout)
 				continue;
-			}
+
+			event[count] = FinishATWait(req, 0);
+			callback[count] = req->callback;
+			context[count] = req->context;
+			count++;
+			statBC28.at_timeouts++;
+
+			// caller may release cmd and rcv once it gets the result
+			req->timedout = 1;
+			req->cmd = "AT\r";
+			req->data_num = 0;
+			req->suffix = NULL;
+			req->rcv = NULL;
+			req->arena = 0;
+			req->callback = NULL;
 		}
 
-		p++;
+		if(!flagResyncAT)
+		{
+			flagResyncAT = 1;
+			resync = 1;
+			indexResyncATQ = index + 1;
+		}
+		else if(index + 1 - headATQ > indexResyncATQ - headATQ)
+		{
+			indexResyncATQ = index + 1;
+		}
+	}
+	else
+	{
+		// not sent yet, replace it with harmless command and ignore response
+		AT_REQ *req = &queueATReq[index % BC28_AT_QUEUE_SIZE];
+
+		req->cmd = "AT\r";
+		req->data_num = 0;
+		req->suffix = NULL;
+		req->rcv = NULL;
+		req->arena = 0;
+		req->callback = NULL;
 	}
 
-	return NULL;
+	BC28_Wrap_Unlock();
+
+	for(i=0; i<(unsigned int)count; i++)
+	{
+		if(event[i] >= 0)
+			BC28_Wrap_SetEvent(event[i]);
+		else if(callback[i] != NULL)
+			callback[i](0, NULL, 0, context[i]);
+	}
+
+	if(resync)
+		BC28_Wrap_PostTask(ResyncATTask, 0, 0);
 }
 
-static void ReadSocketTask(int socket, int size)
+// Guard of draining, timed-out commands without response in AT_RESYNC_GUARD_TIME are lost.
+// The guard time restarts if another command times out meanwhile.
+static void ResyncATTask(int param1, int param2)
 {
-	char szCmd[32];
-	int times = size/MAX_SOCKET_PACKET_SIZE + 1;
-	int i, count = 0;
-	char *szRcv = (char*)BC28_Wrap_Memory_Alloc(UART_RCV_BUF_SIZE);
+	unsigned int end;
+	int elapsed = 0, count = 0;
 
-	for(i=0; i<times; i++)
+	BC28_Wrap_Lock();
+
+	end = indexResyncATQ;
+	while(flagResyncAT && elapsed < AT_RESYNC_GUARD_TIME)
 	{
-		int num = (size - count) > MAX_SOCKET_PACKET_SIZE ? MAX_SOCKET_PACKET_SIZE : (size - count);
-		if(num > 0)
+		BC28_Wrap_Unlock();
+		BC28_Wrap_Sleep(AT_RESYNC_POLL_TIME);
+		elapsed += AT_RESYNC_POLL_TIME;
+		BC28_Wrap_Lock();
+
+		if(end != indexResyncATQ)
 		{
-			sprintf(szCmd, "AT+NSORF=%d,%d\r", socket, num);
-			if(BC28_SendATCmdWaitRcv(szCmd, szRcv, UART_RCV_BUF_SIZE, 5000) == 1)
-			{
-				char *p = FindField(szRcv, ',', 3);
-				if(p != NULL)
-				{
-					char *p1 = strchr(p, ',');
-					if(p1 != NULL)
-					{
-						int digits;
-
-						num = 0;
-						digits = p1 - p;
-						for(i=0; i<digits; i++)
-						{
-							num = num*10 + (*p - '0');
-							p++;
-						}
-
-						if(num > 0)
-						{
-							p1++;
-
-							for(i=0; i<num; i++)
-							{
-								uint8_t val = 0;
-								int j;
-
-								for(j=0; j<2; j++)
-								{
-									uint8_t a;
-
-									if(*p1 < 'A')
-										a = *p1 - '0';
-									else
-										a = *p1 - 'A' + 10;
-
-									val = (val << 4) + a;
-
-									p1++;
-								}
-
-								PushSocketRcvQ(socket, &val, 1);
-							}
-						}
-					}
-				}
-			}
-			else
-			{
-				break;
-			}
+			end = indexResyncATQ;
+			elapsed = 0;
+		}
+	}
+
+	if(flagResyncAT)
+	{
+		while(headATQ != indexResyncATQ)
+		{
+			headATQ++;
+			count++;
 		}
+		flagResyncAT = 0;
 	}
 
-	BC28_Wrap_Memory_Free(szRcv);
+	BC28_Wrap_Unlock();
+
+	if(count > 0)
+		BC28_Wrap_SetEvent(BC28_EVENT_AT_FREE);
+
+	SendQueuedATReq();
 }
 
-static char* FindField(const char *str, char separator, int index)
+static void SendQueuedATTask(int param1, int param2)
 {
-	char *p = (char *)str;
-	int i;
+	SendQueuedATReq();
+}
 
-	for(i=0; i<index; i++)
+// Deadline of asynchronous commands, AT_ASYNC_TIMEOUT after each is written to UART.
+// It runs while such commands are in queue, blocking callers time out by themselves.
+static void WatchATTask(int param1, int param2)
+{
+	BC28_Wrap_Lock();
+
+	while(1)
 	{
-		char *p1 = strchr(p, separator);
-		if(p1 != NULL)
+		unsigned int i, expired = 0;
+		int pending = 0, found = 0;
+
+		for(i=headATQ; i!=tailATQ && !pending; i++)
 		{
-			p = p1 + 1;
+			AT_REQ *req = &queueATReq[i % BC28_AT_QUEUE_SIZE];
+
+			pending = (!req->held && !req->timedout);
 		}
-		else
+
+		if(!pending)
 		{
-			return NULL;
+			flagWatchingAT = 0;
+			break;
+		}
+
+		BC28_Wrap_Unlock();
+		BC28_Wrap_Sleep(AT_RESYNC_POLL_TIME);
+		BC28_Wrap_Lock();
+
+		for(i=headATQ; i!=sendATQ; i++)
+		{
+			AT_REQ *req = &queueATReq[i % BC28_AT_QUEUE_SIZE];
+
+			if(req->held || req->timedout)
+				continue;
+
+			req->elapsed += AT_RESYNC_POLL_TIME;
+			if(req->elapsed >= AT_ASYNC_TIMEOUT)
+			{
+				expired = i;
+				found = 1;
+			}
+		}
+
+		// the commands before it are timed out together
+		if(found)
+		{
+			BC28_Wrap_Unlock();
+			TimeoutATReq(expired, NULL);
+			BC28_Wrap_Lock();
 		}
 	}
 
-	return p;
+	BC28_Wrap_Unlock();
 }
 
-static int BC28_SendATCmd(const char *cmd)
+// Commands written to UART before reboot are never answered, except AT+NRB which
+// is completed by "OK" after boot message. They are completed with result 0.
+static void FailSentATReq(void)
+{
+	BC28_AT_CALLBACK callback[BC28_AT_QUEUE_SIZE];
+	void *context[BC28_AT_QUEUE_SIZE];
+	int event[BC28_AT_QUEUE_SIZE];
+	int i, count = 0, resume = 0;
+
+	BC28_Wrap_Lock();
+
+	while(headATQ != sendATQ)
+	{
+		AT_REQ *req = &queueATReq[headATQ % BC28_AT_QUEUE_SIZE];
+
+		if(strncmp(req->cmd, "AT+NRB", 6) == 0)
+			break;
+
+		if(!req->timedout)
+		{
+			event[count] = FinishATWait(req, 0);
+			callback[count] = req->callback;
+			context[count] = req->context;
+			count++;
+			statBC28.at_timeouts++;
+		}
+
+		headATQ++;
+	}
+
+	// late responses of timed-out commands won't come either
+	if(flagResyncAT && (int)(headATQ - indexResyncATQ) >= 0)
+	{
+		flagResyncAT = 0;
+		resume = 1;
+	}
+
+	BC28_Wrap_Unlock();
+
+	for(i=0; i<count; i++)
+	{
+		if(event[i] >= 0)
+			BC28_Wrap_SetEvent(event[i]);
+		else if(callback[i] != NULL)
+			callback[i](0, NULL, 0, context[i]);
+	}
+
+	if(count > 0 || resume)
+		BC28_Wrap_SetEvent(BC28_EVENT_AT_FREE);
+
+	// not in the context of BC28_PushReceivedByte(), it may be ISR
+	if(resume)
+		BC28_Wrap_PostTask(SendQueuedATTask, 0, 0);
+}
+
+// Callback of blocking waiter, it marks the request only, see FinishATWait().
+static void DoneATWait(int result, char *rcv, int rcv_len, void *context)
+{
+}
+
+// Blocking caller returns as soon as done is set, so the result is given under lock
+// in the same step as the request leaves the queue, and only its event is set after
+// unlocking. Called with lock, returns event, -1: not blocking.
+static int FinishATWait(AT_REQ *req, int result)
 {
-	return BC28_Wrap_Send((uint8_t*)cmd, strlen(cmd));
+	AT_WAIT *wait;
+
+	if(req->callback != DoneATWait)
+		return -1;
+
+	wait = (AT_WAIT*)req->context;
+	wait->result = result;
+	wait->done = 1;
+	req->callback = NULL;
+
+	return wait->event;
 }
@@ -23,6 +23,112 @@ typedef void (*BC28_TASK)(int,int);
 #define NULL (0)
 #endif
 
+#define BC28_AT_QUEUE_SIZE		4		//max number of AT commands in flight
+
+/**
+ * Events used with BC28_Wrap_WaitEvent() and BC28_Wrap_SetEvent().
+ **/
+#define BC28_EVENT_AT_DONE		0		//one event per AT queue slot
+#define BC28_EVENT_AT_FREE		(BC28_EVENT_AT_DONE + BC28_AT_QUEUE_SIZE)
+#define BC28_EVENT_NETWORK		(BC28_EVENT_AT_FREE + 1)	//registration or RRC connection changed
+#define BC28_EVENT_NUM			(BC28_EVENT_NETWORK + 1)
+
+/**
+ * Policy while socket receive queue is full, see BC28_SetSocketOverflowPolicy().
+ **/
+enum {
+	BC28_SOCKET_OVERFLOW_BLOCK,
+	BC28_SOCKET_OVERFLOW_DROP_NEWEST,
+	BC28_SOCKET_OVERFLOW_ERROR
+};
+
+/**
+ * How BC28 notifies received data, value of AT+NSONMI, see BC28_SetSocketNotifyMode().
+ **/
+enum {
+	BC28_SOCKET_NOTIFY_LENGTH = 1,
+	BC28_SOCKET_NOTIFY_DATA_ADDR = 2,
+	BC28_SOCKET_NOTIFY_DATA = 3
+};
+
+/**
+ * Release Assistance Indication, <flag> of AT+NSOSD.
+ **/
+enum {
+	BC28_RAI_NONE = 0,
+	BC28_RAI_UL = 0x200,		//release after this uplink
+	BC28_RAI_DL = 0x400			//release after the first downlink reply
+};
+
+/**
+ * Registration status of +CEREG.
+ **/
+enum {
+	BC28_REG_NONE = 0,
+	BC28_REG_HOME = 1,
+	BC28_REG_SEARCHING = 2,
+	BC28_REG_DENIED = 3,
+	BC28_REG_UNKNOWN = 4,
+	BC28_REG_ROAMING = 5
+};
+
+/**
+ * Network state cached from URC, see BC28_GetNetworkState(). -1 means unknown.
+ **/
+typedef struct {
+	int			reg;			//registration status, enum BC28_REG
+	int			rrc;			//RRC connection, 0: idle, 1: connected
+	uint32_t	tac;			//tracking area code
+	uint32_t	ci;				//cell ID
+	int			active_time;	//T3324 as 8-bit value of +CEREG, needs AT+CEREG=5
+	int			periodic_tau;	//T3412 as 8-bit value of +CEREG, needs AT+CEREG=5
+} BC28_NETWORK_STATE;
+
+/**
+ * Counters of driver, see BC28_GetStatistics().
+ **/
+typedef struct {
+	uint32_t	uart_tx_bytes;		//bytes written to UART
+	uint32_t	uart_rx_bytes;		//bytes pushed by BC28_PushReceivedByte(s), added per line
+	uint32_t	socket_tx_bytes;	//payload accepted by BC28
+	uint32_t	socket_rx_bytes;	//payload put into socket receive queues
+	uint32_t	at_cmds;			//AT commands queued
+	uint32_t	at_errors;			//AT commands completed with ERROR
+	uint32_t	at_timeouts;		//AT commands without response in time
+	uint32_t	boots;				//boot messages of BC28, including AT+NRB
+	uint32_t	recover_socket;		//steps of BC28_RecoverTcpSocket(), reopen socket
+	uint32_t	recover_attach;		//AT+CFUN=0/1 and reopen socket
+	uint32_t	recover_reboot;		//reboot and reopen socket
+	uint32_t	recover_failed;		//all steps failed
+} BC28_STATISTICS;
+
+#define BC28_RCV_ARENA			(-1)	//rcv_size of BC28_SubmitATCmd() to get response without copy
+
+#define BC28_MAX_IOVEC			4		//max number of buffers of BC28_WriteTcpSocketV()
+
+/**
+ * Buffer of data written by BC28_WriteTcpSocketV().
+ **/
+typedef struct {
+	const uint8_t	*data;
+	int				size;
+} BC28_IOVEC;
+
+/**
+ * Callback of AT command, result 1: OK, -1: ERROR, 0: timeout
+ **/
+typedef void (*BC28_AT_CALLBACK)(int result, char *rcv, int rcv_len, void *context);
+
+/**
+ * Callback of BC28_SendTcpSocket(), status 1: sent, 0: failed, -1: rejected or no response
+ **/
+typedef void (*BC28_SEND_CALLBACK)(int socket, int seq, int status, void *context);
+
+/**
+ * Handler of URC, line: start of URC, len: number of bytes excluding "\r\n"
+ **/
+typedef void (*BC28_URC_HANDLER)(const char *line, int len);
+
 /**
  * MUST implement wrapper functions.
  **/
@@ -62,6 +168,38 @@ void *BC28_Wrap_Memory_Alloc(uint32_t size);
   */
 void BC28_Wrap_Memory_Free(void *ptr);
 
+/**
+  * @brief  Wrapper function to wait for an event set by BC28_Wrap_SetEvent().
+  *			Event should be auto-reset, i.e. cleared when the waiter wakes up.
+  * @param  event: event index (0 ~ BC28_EVENT_NUM-1), ms: timeout in miliseconds
+  * @retval 1: event is set, 0: timeout
+  */
+int BC28_Wrap_WaitEvent(int event, int ms);
+
+/**
+  * @brief  Wrapper function to set an event and wake up the waiter.
+  *			It is called in the same context as BC28_PushReceivedByte(), maybe ISR.
+  * @param  event: event index (0 ~ BC28_EVENT_NUM-1)
+  * @retval None
+  */
+void BC28_Wrap_SetEvent(int event);
+
+/**
+  * @brief  Wrapper function to protect driver data shared with BC28_PushReceivedByte().
+  *			Hold for a short time only. If BC28_PushReceivedByte() is called in ISR,
+  *			disable UART interrupt, otherwise use a recursive mutex.
+  * @param  None
+  * @retval None
+  */
+void BC28_Wrap_Lock(void);
+
+/**
+  * @brief  Wrapper function to release the protection of BC28_Wrap_Lock().
+  * @param  None
+  * @retval None
+  */
+void BC28_Wrap_Unlock(void);
+
 
 /**
  * Public functions.
@@ -69,14 +207,41 @@ void BC28_Wrap_Memory_Free(void *ptr);
 int BC28_Init(void);
 const char* BC28_GetIMSI(void);
 const char* BC28_GetIMEI(void);
+void BC28_SetIdentity(const char *imsi, const char *imei);
 void BC28_Reboot(void);
 void BC28_PushReceivedByte(uint8_t b);
+void BC28_PushReceivedBytes(const uint8_t *data, int size);
+int BC28_RegisterURCHandler(const char *prefix, BC28_URC_HANDLER handler);
 int BC28_WaitReady(int timeout);
+void BC28_GetNetworkState(BC28_NETWORK_STATE *state);
+int BC28_WaitNetworkChange(int timeout);
 int BC28_SendATCmdWaitRcv(const char* cmd, char *rcv, int rcv_size, int timeout);
+int BC28_SubmitATCmd(const char *cmd, char *rcv, int rcv_size, BC28_AT_CALLBACK callback, void *context);
 int BC28_OpenTcpSocket(const char *ip, const char *port);
 int BC28_WriteTcpSocket(int socket, uint8_t *data, int size);
+int BC28_WriteTcpSocketV(int socket, const BC28_IOVEC *iov, int iov_num);
+int BC28_SendTcpSocket(int socket, const uint8_t *data, int size, BC28_SEND_CALLBACK callback, void *context);
+void BC28_SetSendWindow(int window);
+int BC28_QueueUplink(int socket, const uint8_t *data, int size, int reply, BC28_SEND_CALLBACK callback, void *context);
+int BC28_FlushUplink(void);
+int BC28_SetPowerSaving(const char *tau, const char *active);
+int BC28_SetEDRX(const char *ptw, const char *edrx);
 int BC28_ReadTcpSocket(int socket, uint8_t *data, int size);
+int BC28_PeekTcpSocket(int socket, uint8_t *data, int size);
+int BC28_SkipTcpSocket(int socket, int size);
+int BC28_AvailableTcpSocket(int socket);
+int BC28_GetSocketOverflow(int socket);
+void BC28_SetSocketOverflowPolicy(int policy);
+int BC28_SetSocketNotifyMode(int mode);
 int BC28_CloseTcpSocket(int socket);
+int BC28_OpenUdpSocket(void);
+int BC28_SendUdpSocket(int socket, const char *ip, const char *port, const uint8_t *data, int size);
+int BC28_ReadUdpSocket(int socket, uint8_t *data, int size, char *ip, int *port);
+int BC28_CloseUdpSocket(int socket);
+int BC28_RecoverTcpSocket(int socket, const char *ip, const char *port);
 void BC28_SetSocketListener(BC28_TASK listener);
+int BC28_SetTcpSocketListener(int socket, BC28_TASK listener);
+void BC28_GetStatistics(BC28_STATISTICS *stat);
+void BC28_ResetStatistics(void);
 
 #endif
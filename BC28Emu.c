@@ -0,0 +1,1116 @@
+/**
+  *********************************************************
+  * @file	BC28Emu.c
+  * @brief  Quectel BC28 modem emulator for Linux host
+  * @ver	0.01
+  *********************************************************
+  ***************** Application Notes *********************
+  *********************************************************
+  * 1. It implements AT commands used by BC28 driver: AT, AT+CIMI, AT+CGSN,
+  *    AT+CEREG, AT+CSCON, AT+CFUN, AT+NSOCR, AT+NSOCO, AT+NSOSD, AT+NSOST,
+  *    AT+NSORF, AT+NSOCL, AT+NSONMI and AT+NRB.
+  *    Other AT commands are answered with OK.
+  * 2. In-process, call BC28Emu_Input() in BC28_Wrap_Send() and push output
+  *    to BC28_PushReceivedBytes() in the output function of BC28Emu_Init().
+  * 3. Or call BC28Emu_OpenPty() and open the returned device as serial port.
+  * 4. Sockets are real TCP/UDP sockets of host, BC28Emu_SetEndpoint()
+  *    redirects all of them to a local server, e.g. MQTT broker.
+  *    UDP socket keeps one datagram at a time until it is read.
+  * 5. BC28Emu_SetLatency() delays responses of commands to simulate the radio.
+  * 6. BC28Emu_Reboot() reboots "by itself", commands not answered yet are lost.
+  * 7. POSIX only, link with -lpthread.
+  *********************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		//posix_openpt(), cfmakeraw()
+#endif
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <termios.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "BC28Emu.h"
+
+#define EMU_LINE_SIZE			4096	//AT+NSOSD carries 1024 bytes as hex
+#define EMU_LINE_NUM			16		//commands waiting for execution
+#define EMU_SOCKET_NUM			7
+#define EMU_SOCKET_BUF_SIZE		4096	//data kept in "modem" until AT+NSORF
+#define EMU_MAX_READ_SIZE		1358	//max length of AT+NSORF
+#define EMU_SEGMENT_SIZE		512		//max length of data in +NSONMI
+#define EMU_LATENCY_NUM			16
+#define EMU_BOOT_TIME			500		//miliseconds from REBOOTING to boot message
+#define EMU_REBOOT_LINE			"\001REBOOT"	//queued by BC28Emu_Reboot(), not a command
+
+#define EMU_IMSI				"460001234567890"
+#define EMU_IMEI				"861234567890123"
+
+typedef struct {
+	int					used;
+	int					fd;
+	int					closing;	// closed by AT+NSOCL, reader thread frees the slot
+	int					connected;	// TCP connected or UDP reader started
+	int					udp;
+	char				ip[16];
+	int					port;
+	uint8_t				buf[EMU_SOCKET_BUF_SIZE];
+	int					count;
+} EMU_SOCKET;
+
+typedef struct {
+	char				prefix[16];
+	int					ms;
+} EMU_LATENCY;
+
+static BC28EMU_OUTPUT	funcOutput = NULL;
+static pthread_mutex_t	lockOutput = PTHREAD_MUTEX_INITIALIZER;	//one response or URC at a time
+static pthread_mutex_t	lockEmu = PTHREAD_MUTEX_INITIALIZER;		//command queue, sockets, settings
+static pthread_cond_t	condLine = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	condSocket = PTHREAD_COND_INITIALIZER;
+static pthread_t		threadCmd;
+static pthread_t		threadPty;
+static int				flagRunning = 0;
+static int				fdPty = -1;
+
+static char			bufInputLine[EMU_LINE_SIZE];
+static int			countInputLine = 0;
+static char			queueLine[EMU_LINE_NUM][EMU_LINE_SIZE];
+static unsigned int	headLine = 0, tailLine = 0;
+static unsigned int	countBoot = 0;		//command of previous boot is not answered
+
+static EMU_SOCKET	tableSocket[EMU_SOCKET_NUM];
+static EMU_LATENCY	tableLatency[EMU_LATENCY_NUM];
+static int			countLatency = 0;
+static char			szEndpointIP[16] = {0};
+static int			portEndpoint = 0;
+static int			modeNotify = 1;		//AT+NSONMI
+static int			modeCEREG = 0;		//AT+CEREG=<n>
+static int			modeCSCON = 0;		//AT+CSCON=<n>
+static int			stateReg = 1;
+static int			stateRRC = 0;
+
+static void* CmdThread(void *arg);
+static void* SocketThread(void *arg);
+static void* PtyThread(void *arg);
+static void ExecuteCmd(char *line);
+static void Output(const char *str, int len);
+static void OutputPty(const uint8_t *data, int size);
+static int GetLatency(const char *line);
+static void CloseAllSockets(void);
+
+static const char tableHex[16] = {
+	'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+
+/**
+  * @brief  To start emulator.
+  * @param  output: function to receive bytes sent by emulated BC28,
+  *			NULL if BC28Emu_OpenPty() is used
+  * @retval 1: OK, 0: failed
+  */
+int BC28Emu_Init(BC28EMU_OUTPUT output)
+{
+	int i;
+
+	if(flagRunning)
+		return 0;
+
+	funcOutput = output;
+	countInputLine = 0;
+	headLine = tailLine = 0;
+
+	for(i=0; i<EMU_SOCKET_NUM; i++)
+	{
+		tableSocket[i].used = 0;
+		tableSocket[i].fd = -1;
+	}
+
+	flagRunning = 1;
+	if(pthread_create(&threadCmd, NULL, CmdThread, NULL) != 0)
+	{
+		flagRunning = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/**
+  * @brief  To stop emulator and close all sockets.
+  * @param  None
+  * @retval None
+  */
+void BC28Emu_Close(void)
+{
+	if(!flagRunning)
+		return;
+
+	pthread_mutex_lock(&lockEmu);
+	flagRunning = 0;
+	pthread_cond_broadcast(&condLine);
+	pthread_mutex_unlock(&lockEmu);
+
+	pthread_join(threadCmd, NULL);
+
+	if(fdPty >= 0)
+	{
+		pthread_join(threadPty, NULL);
+		close(fdPty);
+		fdPty = -1;
+	}
+
+	CloseAllSockets();
+}
+
+
+/**
+  * @brief  Call this function with bytes sent to BC28, e.g. in BC28_Wrap_Send().
+  *			Commands are executed in emulator thread, so it never blocks.
+  * @param  data: pointer to data, size: number of bytes
+  * @retval None
+  */
+void BC28Emu_Input(const uint8_t *data, int size)
+{
+	int i;
+
+	pthread_mutex_lock(&lockEmu);
+
+	for(i=0; i<size; i++)
+	{
+		uint8_t b = data[i];
+
+		if(b == '\n')
+			continue;
+
+		if(b != '\r')
+		{
+			if(countInputLine < EMU_LINE_SIZE - 1)
+				bufInputLine[countInputLine++] = (char)b;
+			continue;
+		}
+
+		// command is dropped like UART overrun if the queue is full
+		if(countInputLine > 0 && tailLine - headLine < EMU_LINE_NUM)
+		{
+			char *line = queueLine[tailLine % EMU_LINE_NUM];
+
+			memcpy(line, bufInputLine, countInputLine);
+			line[countInputLine] = 0;
+			tailLine++;
+			pthread_cond_signal(&condLine);
+		}
+
+		countInputLine = 0;
+	}
+
+	pthread_mutex_unlock(&lockEmu);
+}
+
+
+/**
+  * @brief  To emulate BC28 on a pseudo terminal, so that the driver or other
+  *			tools can open it as serial port. Call after BC28Emu_Init(NULL).
+  * @param  None
+  * @retval name of slave device, e.g. "/dev/pts/3", NULL means error.
+  */
+const char* BC28Emu_OpenPty(void)
+{
+	struct termios tio;
+	const char *name;
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(fd < 0)
+		return NULL;
+
+	if(grantpt(fd) != 0 || unlockpt(fd) != 0 || (name = ptsname(fd)) == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	// raw mode, no echo and no CR/LF translation
+	if(tcgetattr(fd, &tio) == 0)
+	{
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+	fdPty = fd;
+	funcOutput = OutputPty;
+
+	if(pthread_create(&threadPty, NULL, PtyThread, NULL) != 0)
+	{
+		close(fd);
+		fdPty = -1;
+		return NULL;
+	}
+
+	return name;
+}
+
+
+/**
+  * @brief  To delay response of commands, e.g. ("AT+NSOSD", 300).
+  *			The longest matched prefix is used, "" sets the default.
+  * @param  prefix: start of command, ms: miliseconds
+  * @retval 1: OK, 0: table is full
+  */
+int BC28Emu_SetLatency(const char *prefix, int ms)
+{
+	int i, ret = 0;
+
+	pthread_mutex_lock(&lockEmu);
+
+	for(i=0; i<countLatency; i++)
+	{
+		if(strcmp(tableLatency[i].prefix, prefix) == 0)
+			break;
+	}
+
+	if(i < countLatency || countLatency < EMU_LATENCY_NUM)
+	{
+		strncpy(tableLatency[i].prefix, prefix, sizeof(tableLatency[i].prefix) - 1);
+		tableLatency[i].prefix[sizeof(tableLatency[i].prefix) - 1] = 0;
+		tableLatency[i].ms = ms;
+		if(i == countLatency)
+			countLatency++;
+		ret = 1;
+	}
+
+	pthread_mutex_unlock(&lockEmu);
+
+	return ret;
+}
+
+
+/**
+  * @brief  To connect all sockets to a local server instead of the address in AT+NSOCO.
+  * @param  ip: e.g. "127.0.0.1", NULL to use address in AT+NSOCO, port: TCP port
+  * @retval None
+  */
+void BC28Emu_SetEndpoint(const char *ip, int port)
+{
+	pthread_mutex_lock(&lockEmu);
+
+	if(ip != NULL)
+	{
+		strncpy(szEndpointIP, ip, sizeof(szEndpointIP) - 1);
+		portEndpoint = port;
+	}
+	else
+	{
+		szEndpointIP[0] = 0;
+	}
+
+	pthread_mutex_unlock(&lockEmu);
+}
+
+
+/**
+  * @brief  To send URC to driver, e.g. "+CEREG:0" or "+CSCON:1".
+  * @param  urc: line without "\r\n"
+  * @retval None
+  */
+void BC28Emu_SendURC(const char *urc)
+{
+	char buf[128];
+	int len = snprintf(buf, sizeof(buf), "\r\n%s\r\n", urc);
+
+	Output(buf, len);
+}
+
+
+/**
+  * @brief  To reboot like by watchdog or power, not by AT+NRB. Commands waiting or
+  *			being executed are not answered, sockets and URC settings are lost.
+  * @param  None
+  * @retval None
+  */
+void BC28Emu_Reboot(void)
+{
+	pthread_mutex_lock(&lockEmu);
+
+	// the only command left is the reboot itself, executed by emulator thread
+	countBoot++;
+	headLine = tailLine;
+	strcpy(queueLine[tailLine % EMU_LINE_NUM], EMU_REBOOT_LINE);
+	tailLine++;
+	pthread_cond_signal(&condLine);
+
+	pthread_mutex_unlock(&lockEmu);
+}
+
+
+/**
+  * @brief  To change registration status, +CEREG is sent if enabled by AT+CEREG.
+  * @param  stat: 0: not registered, 1: home, 2: searching, 3: denied, 5: roaming
+  * @retval None
+  */
+void BC28Emu_SetRegistration(int stat)
+{
+	char urc[64];
+
+	stateReg = stat;
+
+	if(modeCEREG >= 2)
+		sprintf(urc, "+CEREG:%d,\"1A2B\",\"0123ABCD\",7", stat);
+	else
+		sprintf(urc, "+CEREG:%d", stat);
+
+	if(modeCEREG > 0)
+		BC28Emu_SendURC(urc);
+}
+
+
+/**
+  * @brief  To change RRC connection, +CSCON is sent if enabled by AT+CSCON.
+  * @param  mode: 0: idle, 1: connected
+  * @retval None
+  */
+void BC28Emu_SetConnection(int mode)
+{
+	char urc[16];
+
+	stateRRC = mode;
+
+	sprintf(urc, "+CSCON:%d", mode);
+	if(modeCSCON)
+		BC28Emu_SendURC(urc);
+}
+
+
+static void Output(const char *str, int len)
+{
+	pthread_mutex_lock(&lockOutput);
+	if(funcOutput != NULL)
+		funcOutput((const uint8_t*)str, len);
+	pthread_mutex_unlock(&lockOutput);
+}
+
+static void OutputPty(const uint8_t *data, int size)
+{
+	while(size > 0)
+	{
+		int num = (int)write(fdPty, data, size);
+
+		if(num <= 0)
+			break;
+
+		data += num;
+		size -= num;
+	}
+}
+
+static void* PtyThread(void *arg)
+{
+	uint8_t buf[256];
+	int num;
+
+	(void)arg;
+
+	// poll so that BC28Emu_Close() can stop it, closing fd does not break read()
+	while(flagRunning)
+	{
+		struct pollfd pfd;
+
+		pfd.fd = fdPty;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		num = (int)read(fdPty, buf, sizeof(buf));
+		if(num <= 0)
+			break;
+
+		BC28Emu_Input(buf, num);
+	}
+
+	return NULL;
+}
+
+static void* CmdThread(void *arg)
+{
+	char line[EMU_LINE_SIZE];
+
+	(void)arg;
+
+	pthread_mutex_lock(&lockEmu);
+
+	while(flagRunning)
+	{
+		unsigned int boot;
+		int ms, lost;
+
+		if(headLine == tailLine)
+		{
+			pthread_cond_wait(&condLine, &lockEmu);
+			continue;
+		}
+
+		strcpy(line, queueLine[headLine % EMU_LINE_NUM]);
+		headLine++;
+		ms = GetLatency(line);
+		boot = countBoot;
+
+		// latency is broken by BC28Emu_Reboot()
+		if(ms > 0)
+		{
+			struct timespec ts;
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += ms / 1000;
+			ts.tv_nsec += (ms % 1000) * 1000000L;
+			if(ts.tv_nsec >= 1000000000L)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+
+			while(boot == countBoot && pthread_cond_timedwait(&condLine, &lockEmu, &ts) != ETIMEDOUT);
+		}
+		lost = (boot != countBoot);
+
+		pthread_mutex_unlock(&lockEmu);
+
+		if(!lost)
+			ExecuteCmd(line);
+
+		pthread_mutex_lock(&lockEmu);
+	}
+
+	pthread_mutex_unlock(&lockEmu);
+
+	return NULL;
+}
+
+// called with lockEmu held
+static int GetLatency(const char *line)
+{
+	int i, ms = 0, best = -1;
+
+	for(i=0; i<countLatency; i++)
+	{
+		int len = (int)strlen(tableLatency[i].prefix);
+
+		if(len > best && strncmp(line, tableLatency[i].prefix, len) == 0)
+		{
+			best = len;
+			ms = tableLatency[i].ms;
+		}
+	}
+
+	return ms;
+}
+
+static EMU_SOCKET* GetSocket(int socket)
+{
+	if(socket < 0 || socket >= EMU_SOCKET_NUM || !tableSocket[socket].used || tableSocket[socket].closing)
+		return NULL;
+
+	return &tableSocket[socket];
+}
+
+// AT+NSOCR=STREAM,6,<port>,<receive_control> or AT+NSOCR=DGRAM,17,<port>,<receive_control>
+static int CreateSocket(const char *param, char *rsp)
+{
+	int udp = (strncmp(param, "DGRAM,", 6) == 0);
+	pthread_t thread;
+	int i;
+
+	pthread_mutex_lock(&lockEmu);
+
+	for(i=0; i<EMU_SOCKET_NUM; i++)
+	{
+		if(!tableSocket[i].used)
+			break;
+	}
+
+	if(i < EMU_SOCKET_NUM)
+	{
+		tableSocket[i].fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+		if(tableSocket[i].fd >= 0)
+		{
+			tableSocket[i].used = 1;
+			tableSocket[i].closing = 0;
+			tableSocket[i].connected = 0;
+			tableSocket[i].udp = udp;
+			tableSocket[i].count = 0;
+			tableSocket[i].ip[0] = 0;
+			tableSocket[i].port = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&lockEmu);
+
+	if(i == EMU_SOCKET_NUM || !tableSocket[i].used)
+		return 0;
+
+	// UDP receives without connection, local port is chosen by host
+	if(udp)
+	{
+		struct sockaddr_in addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		if(bind(tableSocket[i].fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+			pthread_create(&thread, NULL, SocketThread, &tableSocket[i]) != 0)
+		{
+			pthread_mutex_lock(&lockEmu);
+			close(tableSocket[i].fd);
+			tableSocket[i].fd = -1;
+			tableSocket[i].used = 0;
+			pthread_mutex_unlock(&lockEmu);
+			return 0;
+		}
+
+		tableSocket[i].connected = 1;
+		pthread_detach(thread);
+	}
+
+	return sprintf(rsp, "\r\n%d\r\n\r\nOK\r\n", i);
+}
+
+// AT+NSOCO=<socket>,<remote_addr>,<remote_port>
+static int ConnectSocket(const char *param, char *rsp)
+{
+	struct sockaddr_in addr;
+	EMU_SOCKET *s;
+	pthread_t thread;
+	char ip[16];
+	int socket, port, fd, one = 1;
+
+	if(sscanf(param, "%d,%15[^,],%d", &socket, ip, &port) != 3)
+		return 0;
+
+	pthread_mutex_lock(&lockEmu);
+	s = GetSocket(socket);
+	if(s == NULL || s->connected || s->udp)
+	{
+		pthread_mutex_unlock(&lockEmu);
+		return 0;
+	}
+
+	strcpy(s->ip, ip);
+	s->port = port;
+	if(szEndpointIP[0] != 0)
+	{
+		strcpy(ip, szEndpointIP);
+		port = portEndpoint;
+	}
+	fd = s->fd;
+	pthread_mutex_unlock(&lockEmu);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	if(inet_pton(AF_INET, ip, &addr.sin_addr) != 1 ||
+		connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		return 0;
+	}
+
+	// each AT+NSOSD goes out at once, like a radio packet, not delayed by Nagle
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	s->connected = 1;
+	if(pthread_create(&thread, NULL, SocketThread, s) != 0)
+		return 0;
+	pthread_detach(thread);
+
+	return sprintf(rsp, "\r\nOK\r\n");
+}
+
+// AT+NSOSD=<socket>,<length>,<data>[,<flag>[,<sequence>]]
+static int SendSocket(const char *param, char *rsp)
+{
+	uint8_t data[EMU_LINE_SIZE / 2];
+	const char *p;
+	EMU_SOCKET *s;
+	int socket, length, i, len, fd = -1;
+	unsigned int flag;
+	int seq;
+
+	if(sscanf(param, "%d,%d,", &socket, &length) != 2 || length < 0 || length > (int)sizeof(data))
+		return 0;
+
+	p = strchr(param, ',');
+	p = (p != NULL) ? strchr(p + 1, ',') : NULL;
+	if(p == NULL || (int)strlen(p + 1) < (length << 1))
+		return 0;
+	p++;
+
+	for(i=0; i<length; i++)
+	{
+		unsigned int v;
+
+		if(sscanf(p + (i << 1), "%2x", &v) != 1)
+			return 0;
+		data[i] = (uint8_t)v;
+	}
+
+	pthread_mutex_lock(&lockEmu);
+	s = GetSocket(socket);
+	if(s != NULL && s->connected && !s->udp)
+		fd = s->fd;
+	pthread_mutex_unlock(&lockEmu);
+
+	if(fd < 0 || send(fd, data, length, MSG_NOSIGNAL) != length)
+		return 0;
+
+	// radio enters connected mode to send
+	if(!stateRRC)
+		BC28Emu_SetConnection(1);
+
+	len = sprintf(rsp, "\r\n%d,%d\r\n\r\nOK\r\n", socket, length);
+
+	// +NSOSTR reports sequence number after data is sent
+	p += length << 1;
+	flag = 0;
+	if(sscanf(p, ",%x,%d", &flag, &seq) == 2 && seq > 0)
+		len += sprintf(&rsp[len], "\r\n+NSOSTR:%d,%d,1\r\n", socket, seq);
+
+	// release assistance, back to idle after this uplink
+	if(flag & 0x200)
+	{
+		stateRRC = 0;
+		if(modeCSCON)
+			len += sprintf(&rsp[len], "\r\n+CSCON:0\r\n");
+	}
+
+	return len;
+}
+
+// AT+NSOST=<socket>,<remote_addr>,<remote_port>,<length>,<data>[,<sequence>]
+static int SendToSocket(const char *param, char *rsp)
+{
+	uint8_t data[EMU_LINE_SIZE / 2];
+	struct sockaddr_in addr;
+	const char *p;
+	EMU_SOCKET *s;
+	char ip[16];
+	int socket, port, length, i, len, seq, fd = -1;
+
+	if(sscanf(param, "%d,%15[^,],%d,%d,", &socket, ip, &port, &length) != 4 ||
+		length < 0 || length > (int)sizeof(data))
+		return 0;
+
+	p = param;
+	for(i=0; i<4 && p != NULL; i++)
+		p = strchr(p + 1, ',');
+	if(p == NULL || (int)strlen(p + 1) < (length << 1))
+		return 0;
+	p++;
+
+	for(i=0; i<length; i++)
+	{
+		unsigned int v;
+
+		if(sscanf(p + (i << 1), "%2x", &v) != 1)
+			return 0;
+		data[i] = (uint8_t)v;
+	}
+
+	pthread_mutex_lock(&lockEmu);
+	s = GetSocket(socket);
+	if(s != NULL && s->udp)
+	{
+		fd = s->fd;
+
+		// datagrams from endpoint are reported as from the last destination
+		if(szEndpointIP[0] != 0)
+		{
+			strcpy(s->ip, ip);
+			s->port = port;
+			strcpy(ip, szEndpointIP);
+			port = portEndpoint;
+		}
+	}
+	pthread_mutex_unlock(&lockEmu);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	if(fd < 0 || inet_pton(AF_INET, ip, &addr.sin_addr) != 1 ||
+		sendto(fd, data, length, 0, (struct sockaddr*)&addr, sizeof(addr)) != length)
+	{
+		return 0;
+	}
+
+	if(!stateRRC)
+		BC28Emu_SetConnection(1);
+
+	len = sprintf(rsp, "\r\n%d,%d\r\n\r\nOK\r\n", socket, length);
+
+	p += length << 1;
+	if(sscanf(p, ",%d", &seq) == 1 && seq > 0)
+		len += sprintf(&rsp[len], "\r\n+NSOSTR:%d,%d,1\r\n", socket, seq);
+
+	return len;
+}
+
+// AT+NSORF=<socket>,<req_length>
+// response: <socket>,<ip_addr>,<port>,<length>,<data>,<remaining_length>
+static int ReadSocket(const char *param, char *rsp)
+{
+	EMU_SOCKET *s;
+	int socket, length, i, len;
+
+	if(sscanf(param, "%d,%d", &socket, &length) != 2 || length < 0)
+		return 0;
+
+	if(length > EMU_MAX_READ_SIZE)
+		length = EMU_MAX_READ_SIZE;
+
+	pthread_mutex_lock(&lockEmu);
+
+	s = GetSocket(socket);
+	if(s == NULL)
+	{
+		pthread_mutex_unlock(&lockEmu);
+		return 0;
+	}
+
+	if(length > s->count)
+		length = s->count;
+
+	if(length == 0)
+	{
+		pthread_mutex_unlock(&lockEmu);
+		return sprintf(rsp, "\r\nOK\r\n");
+	}
+
+	len = sprintf(rsp, "\r\n%d,%s,%d,%d,", socket, s->ip, s->port, length);
+	for(i=0; i<length; i++)
+	{
+		rsp[len++] = tableHex[s->buf[i] >> 4];
+		rsp[len++] = tableHex[s->buf[i] & 0x0F];
+	}
+
+	s->count -= length;
+	memmove(s->buf, &s->buf[length], s->count);
+	len += sprintf(&rsp[len], ",%d\r\n\r\nOK\r\n", s->count);
+	pthread_cond_broadcast(&condSocket);
+
+	pthread_mutex_unlock(&lockEmu);
+
+	return len;
+}
+
+// AT+NSOCL=<socket>
+static int CloseSocket(const char *param, char *rsp)
+{
+	EMU_SOCKET *s;
+	int socket;
+
+	if(sscanf(param, "%d", &socket) != 1)
+		return 0;
+
+	pthread_mutex_lock(&lockEmu);
+
+	s = GetSocket(socket);
+	if(s == NULL)
+	{
+		pthread_mutex_unlock(&lockEmu);
+		return 0;
+	}
+
+	if(s->connected)
+	{
+		// reader thread closes fd and frees the slot
+		s->closing = 1;
+		shutdown(s->fd, SHUT_RDWR);
+		pthread_cond_broadcast(&condSocket);
+	}
+	else
+	{
+		close(s->fd);
+		s->fd = -1;
+		s->used = 0;
+	}
+
+	pthread_mutex_unlock(&lockEmu);
+
+	return sprintf(rsp, "\r\nOK\r\n");
+}
+
+static void CloseAllSockets(void)
+{
+	char rsp[16];
+	char param[4];
+	int i;
+
+	for(i=0; i<EMU_SOCKET_NUM; i++)
+	{
+		sprintf(param, "%d", i);
+		CloseSocket(param, rsp);
+	}
+}
+
+// AT+NSONMI=2: +NSONMI:<socket>,<remote_addr>,<remote_port>,<length>,<data>
+// AT+NSONMI=3: +NSONMI:<socket>,<length>,<data>
+static void NotifySocketData(EMU_SOCKET *s)
+{
+	char urc[(EMU_SEGMENT_SIZE << 1) + 64];
+	int socket = (int)(s - tableSocket);
+
+	while(1)
+	{
+		int i, len, num;
+
+		pthread_mutex_lock(&lockEmu);
+
+		num = (s->count > EMU_SEGMENT_SIZE) ? EMU_SEGMENT_SIZE : s->count;
+		if(num == 0)
+		{
+			pthread_mutex_unlock(&lockEmu);
+			break;
+		}
+
+		if(modeNotify == 2)
+			len = sprintf(urc, "\r\n+NSONMI:%d,%s,%d,%d,", socket, s->ip, s->port, num);
+		else
+			len = sprintf(urc, "\r\n+NSONMI:%d,%d,", socket, num);
+
+		for(i=0; i<num; i++)
+		{
+			urc[len++] = tableHex[s->buf[i] >> 4];
+			urc[len++] = tableHex[s->buf[i] & 0x0F];
+		}
+		urc[len++] = '\r';
+		urc[len++] = '\n';
+
+		s->count -= num;
+		memmove(s->buf, &s->buf[num], s->count);
+		pthread_cond_broadcast(&condSocket);
+
+		pthread_mutex_unlock(&lockEmu);
+
+		Output(urc, len);
+	}
+}
+
+// Keep received data like BC28 does, and notify the driver with +NSONMI.
+static void* SocketThread(void *arg)
+{
+	EMU_SOCKET *s = (EMU_SOCKET*)arg;
+	int socket = (int)(s - tableSocket);
+	uint8_t buf[EMU_SOCKET_BUF_SIZE];
+	char urc[32];
+	int num;
+
+	while(1)
+	{
+		int space = 0, len = 0, closing, mode;
+
+		pthread_mutex_lock(&lockEmu);
+		while(!s->closing && ((space = EMU_SOCKET_BUF_SIZE - s->count) == 0 || (s->udp && s->count > 0)))
+			pthread_cond_wait(&condSocket, &lockEmu);
+		closing = s->closing;
+		pthread_mutex_unlock(&lockEmu);
+
+		if(closing)
+			break;
+
+		if(s->udp)
+		{
+			struct sockaddr_in addr;
+			socklen_t size = sizeof(addr);
+
+			num = (int)recvfrom(s->fd, buf, space, 0, (struct sockaddr*)&addr, &size);
+
+			pthread_mutex_lock(&lockEmu);
+			closing = s->closing;
+			if(num >= 0 && !closing && szEndpointIP[0] == 0)
+			{
+				inet_ntop(AF_INET, &addr.sin_addr, s->ip, sizeof(s->ip));
+				s->port = ntohs(addr.sin_port);
+			}
+			pthread_mutex_unlock(&lockEmu);
+
+			if(num < 0 || closing)
+				break;
+
+			if(num == 0)
+				continue;
+		}
+		else
+		{
+			num = (int)recv(s->fd, buf, space, 0);
+			if(num <= 0)
+				break;
+		}
+
+		pthread_mutex_lock(&lockEmu);
+		memcpy(&s->buf[s->count], buf, num);
+		s->count += num;
+		len = s->count;
+		mode = modeNotify;
+		pthread_mutex_unlock(&lockEmu);
+
+		if(mode == 1)
+		{
+			sprintf(urc, "+NSONMI:%d,%d", socket, len);
+			BC28Emu_SendURC(urc);
+		}
+		else
+		{
+			NotifySocketData(s);
+		}
+	}
+
+	pthread_mutex_lock(&lockEmu);
+	if(!s->closing)
+	{
+		sprintf(urc, "+NSOCLI:%d", socket);
+		s->closing = 1;
+	}
+	else
+	{
+		urc[0] = 0;
+	}
+	close(s->fd);
+	s->fd = -1;
+	s->connected = 0;
+	s->used = 0;
+	pthread_mutex_unlock(&lockEmu);
+
+	if(urc[0] != 0)
+		BC28Emu_SendURC(urc);
+
+	return NULL;
+}
+
+static void ExecuteCmd(char *line)
+{
+	static char rsp[EMU_LINE_SIZE];
+	int len = 0;
+
+	if(strcmp(line, "AT") == 0)
+	{
+		len = sprintf(rsp, "\r\nOK\r\n");
+	}
+	else if(strcmp(line, "AT+CIMI") == 0)
+	{
+		len = sprintf(rsp, "\r\n%s\r\n\r\nOK\r\n", EMU_IMSI);
+	}
+	else if(strcmp(line, "AT+CGSN=1") == 0)
+	{
+		len = sprintf(rsp, "\r\n+CGSN:%s\r\n\r\nOK\r\n", EMU_IMEI);
+	}
+	else if(strcmp(line, "AT+CEREG?") == 0)
+	{
+		if(modeCEREG >= 2)
+			len = sprintf(rsp, "\r\n+CEREG:%d,%d,\"1A2B\",\"0123ABCD\",7\r\n\r\nOK\r\n", modeCEREG, stateReg);
+		else
+			len = sprintf(rsp, "\r\n+CEREG:%d,%d\r\n\r\nOK\r\n", modeCEREG, stateReg);
+	}
+	else if(strncmp(line, "AT+CEREG=", 9) == 0)
+	{
+		int mode = atoi(line + 9);
+
+		if(mode >= 0 && mode <= 5)
+		{
+			modeCEREG = mode;
+			len = sprintf(rsp, "\r\nOK\r\n");
+		}
+	}
+	else if(strcmp(line, "AT+CSCON?") == 0)
+	{
+		len = sprintf(rsp, "\r\n+CSCON:%d,%d\r\n\r\nOK\r\n", modeCSCON, stateRRC);
+	}
+	else if(strncmp(line, "AT+CSCON=", 9) == 0)
+	{
+		modeCSCON = atoi(line + 9) ? 1 : 0;
+		len = sprintf(rsp, "\r\nOK\r\n");
+	}
+	else if(strncmp(line, "AT+NSOCR=", 9) == 0)
+	{
+		len = CreateSocket(line + 9, rsp);
+	}
+	else if(strncmp(line, "AT+NSOCO=", 9) == 0)
+	{
+		len = ConnectSocket(line + 9, rsp);
+	}
+	else if(strncmp(line, "AT+NSOSD=", 9) == 0)
+	{
+		len = SendSocket(line + 9, rsp);
+	}
+	else if(strncmp(line, "AT+NSOST=", 9) == 0)
+	{
+		len = SendToSocket(line + 9, rsp);
+	}
+	else if(strncmp(line, "AT+NSORF=", 9) == 0)
+	{
+		len = ReadSocket(line + 9, rsp);
+	}
+	else if(strncmp(line, "AT+NSOCL=", 9) == 0)
+	{
+		len = CloseSocket(line + 9, rsp);
+	}
+	else if(strncmp(line, "AT+CFUN=", 8) == 0)
+	{
+		// radio off detaches and drops sockets, radio on attaches again
+		int fun = atoi(line + 8);
+
+		if(fun == 0)
+			CloseAllSockets();
+
+		Output("\r\nOK\r\n", 6);
+		BC28Emu_SetRegistration(fun ? 1 : 0);
+		return;
+	}
+	else if(strncmp(line, "AT+NSONMI=", 10) == 0)
+	{
+		int mode = atoi(line + 10);
+
+		if(mode >= 0 && mode <= 3)
+		{
+			pthread_mutex_lock(&lockEmu);
+			modeNotify = (mode == 0) ? 1 : mode;
+			pthread_mutex_unlock(&lockEmu);
+			len = sprintf(rsp, "\r\nOK\r\n");
+		}
+	}
+	else if(strcmp(line, EMU_REBOOT_LINE) == 0)
+	{
+		CloseAllSockets();
+		pthread_mutex_lock(&lockEmu);
+		modeNotify = 1;
+		pthread_mutex_unlock(&lockEmu);
+		modeCEREG = 0;
+		modeCSCON = 0;
+		len = sprintf(rsp, "\r\nREBOOT_CAUSE_SECURITY_RESET_PIN\r\nNeul \r\nOK\r\n");
+	}
+	else if(strcmp(line, "AT+NRB") == 0)
+	{
+		Output("\r\nREBOOTING\r\n", 13);
+		CloseAllSockets();
+		pthread_mutex_lock(&lockEmu);
+		modeNotify = 1;
+		pthread_mutex_unlock(&lockEmu);
+		modeCEREG = 0;
+		modeCSCON = 0;
+		usleep(EMU_BOOT_TIME * 1000);
+		len = sprintf(rsp, "\r\nREBOOT_CAUSE_APPLICATION_AT\r\nNeul \r\nOK\r\n");
+	}
+	else if(strncmp(line, "AT", 2) == 0)
+	{
+		len = sprintf(rsp, "\r\nOK\r\n");
+	}
+
+	if(len == 0)
+		len = sprintf(rsp, "\r\nERROR\r\n");
+
+	Output(rsp, len);
+}
@@ -0,0 +1,36 @@
+/**
+  *********************************************************
+  * @file	BC28Emu.h
+  * @brief  BC28 modem emulator include file
+  * @ver	0.01
+  *********************************************************
+  *
+  */
+
+#ifndef _BC28EMU_H_
+#define _BC28EMU_H_
+
+#include "BC28.h"
+
+/**
+ * Output of emulator, i.e. bytes BC28 sends via UART.
+ * In-process, call BC28_PushReceivedBytes() in it.
+ **/
+typedef void (*BC28EMU_OUTPUT)(const uint8_t *data, int size);
+
+
+/**
+ * Public functions.
+ **/
+int BC28Emu_Init(BC28EMU_OUTPUT output);
+void BC28Emu_Close(void);
+void BC28Emu_Input(const uint8_t *data, int size);
+const char* BC28Emu_OpenPty(void);
+int BC28Emu_SetLatency(const char *prefix, int ms);
+void BC28Emu_SetEndpoint(const char *ip, int port);
+void BC28Emu_SendURC(const char *urc);
+void BC28Emu_SetRegistration(int stat);
+void BC28Emu_SetConnection(int mode);
+void BC28Emu_Reboot(void);
+
+#endif
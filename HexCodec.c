@@ -0,0 +1,226 @@
+/**
+  *********************************************************
+  * @file	HexCodec.c
+  * @brief  Hex string codec of AT+NSOSD, AT+NSOST, AT+NSORF and +NSONMI
+  * @ver	0.01
+  *********************************************************
+  ***************** Application Notes *********************
+  *********************************************************
+  * 1. Encoder writes upper case digits, decoder accepts both upper and lower case.
+  * 2. The kernel is chosen at compile time. SSE2 is used on x86 hosts, e.g. Linux
+  *    gateway, 16 bytes at a time. Define HEXCODEC_NO_SIMD to use the scalar
+  *    kernel only. MCU builds always use the scalar kernel. There is no AVX2
+  *    or NEON kernel, see HexCodec.h.
+  * 3. HexCodec_EncodeScalar() and HexCodec_DecodeScalar() are the scalar kernel,
+  *    the reference of the SIMD kernel in tests and benchmark.
+  *********************************************************/
+
+#include "HexCodec.h"
+
+#if !defined(HEXCODEC_NO_SIMD) && \
+	(defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define HEXCODEC_SSE2
+#include <emmintrin.h>
+#endif
+
+static const char tableHexChar[16] = {
+	'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+// hex digit to value, 0xFF: invalid digit
+static const unsigned char tableHexDigit[256] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+#ifdef HEXCODEC_SSE2
+// 16 nibbles to digits, nibble + '0', plus 7 for 'A' ~ 'F'
+static __m128i NibbleToHex(__m128i n)
+{
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8(7));
+
+	return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), alpha);
+}
+
+// 16 digits to nibbles, valid receives 0xFF for each valid digit.
+// Bytes above 0x7F are negative in signed compare, so they are never valid.
+static __m128i HexToNibble(__m128i c, __m128i *valid)
+{
+	__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+		_mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+		_mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+	*valid = _mm_or_si128(digit, alpha);
+
+	return _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+		_mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+}
+
+// 16 nibbles, high one first, to 8 bytes in 16-bit lanes
+static __m128i JoinNibbles(__m128i n)
+{
+	return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00FF)), 4),
+		_mm_srli_epi16(n, 8));
+}
+#endif
+
+
+/**
+  * @brief  To encode data to upper case hex string, not NULL-terminated.
+  * @param  dst: buffer of (size << 1) characters, src: pointer to data, size: number of bytes
+  * @retval number of characters
+  */
+int HexCodec_Encode(char *dst, const unsigned char *src, int size)
+{
+	int count = 0;
+
+#ifdef HEXCODEC_SSE2
+	for(; count + 16 <= size; count += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)&src[count]);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+		__m128i lo = _mm_and_si128(v, _mm_set1_epi8(0x0F));
+
+		_mm_storeu_si128((__m128i*)&dst[count << 1], NibbleToHex(_mm_unpacklo_epi8(hi, lo)));
+		_mm_storeu_si128((__m128i*)&dst[(count << 1) + 16], NibbleToHex(_mm_unpackhi_epi8(hi, lo)));
+	}
+#endif
+
+	HexCodec_EncodeScalar(&dst[count << 1], &src[count], size - count);
+
+	return size << 1;
+}
+
+
+/**
+  * @brief  To decode hex string, both upper and lower case are accepted.
+  *			dst can be the same as src to decode in place.
+  * @param  dst: buffer of (len >> 1) bytes, src: pointer to hex string, len: number of characters
+  * @retval number of bytes, -1: odd length or invalid digit, dst may be partly written
+  */
+int HexCodec_Decode(unsigned char *dst, const char *src, int len)
+{
+	int count = 0, size;
+
+	if(len < 0 || (len & 1))
+		return -1;
+
+	size = len >> 1;
+
+#ifdef HEXCODEC_SSE2
+	for(; count + 16 <= size; count += 16)
+	{
+		__m128i valid0, valid1;
+		__m128i n0 = HexToNibble(_mm_loadu_si128((const __m128i*)&src[count << 1]), &valid0);
+		__m128i n1 = HexToNibble(_mm_loadu_si128((const __m128i*)&src[(count << 1) + 16]), &valid1);
+
+		if(_mm_movemask_epi8(_mm_and_si128(valid0, valid1)) != 0xFFFF)
+			return -1;
+
+		// both loads are done before store, so decoding in place is safe
+		_mm_storeu_si128((__m128i*)&dst[count], _mm_packus_epi16(JoinNibbles(n0), JoinNibbles(n1)));
+	}
+#endif
+
+	if(HexCodec_DecodeScalar(&dst[count], &src[count << 1], (size - count) << 1) < 0)
+		return -1;
+
+	return size;
+}
+
+
+/**
+  * @brief  Scalar kernel of HexCodec_Encode(), one table lookup per digit.
+  * @param  see HexCodec_Encode()
+  * @retval number of characters
+  */
+int HexCodec_EncodeScalar(char *dst, const unsigned char *src, int size)
+{
+	const unsigned char *end = src + size;
+
+	while(src < end)
+	{
+		unsigned char val = *src++;
+
+		dst[0] = tableHexChar[val >> 4];
+		dst[1] = tableHexChar[val & 0x0F];
+		dst += 2;
+	}
+
+	return size << 1;
+}
+
+
+/**
+  * @brief  Scalar kernel of HexCodec_Decode(), one table lookup per digit.
+  * @param  see HexCodec_Decode()
+  * @retval number of bytes, -1: odd length or invalid digit
+  */
+int HexCodec_DecodeScalar(unsigned char *dst, const char *src, int len)
+{
+	const unsigned char *p = (const unsigned char*)src;
+	int i, size;
+
+	if(len < 0 || (len & 1))
+		return -1;
+
+	size = len >> 1;
+
+	for(i=0; i<size; i++)
+	{
+		unsigned char hi = tableHexDigit[p[0]];
+		unsigned char lo = tableHexDigit[p[1]];
+
+		if((hi | lo) & 0xF0)
+			return -1;
+
+		dst[i] = (unsigned char)((hi << 4) | lo);
+		p += 2;
+	}
+
+	return size;
+}
+
+
+/**
+  * @brief  To get value of one hex digit, e.g. fields of +CEREG.
+  * @param  c: character
+  * @retval 0 ~ 15, -1: not hex digit
+  */
+int HexCodec_DigitValue(char c)
+{
+	unsigned char val = tableHexDigit[(unsigned char)c];
+
+	return (val == 0xFF) ? -1 : val;
+}
+
+
+/**
+  * @brief  To get name of kernel chosen at compile time.
+  * @param  None
+  * @retval "sse2" or "scalar"
+  */
+const char* HexCodec_GetKernel(void)
+{
+#ifdef HEXCODEC_SSE2
+	return "sse2";
+#else
+	return "scalar";
+#endif
+}
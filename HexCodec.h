@@ -0,0 +1,29 @@
+/**
+  *********************************************************
+  * @file	HexCodec.h
+  * @brief  Hex string codec include file
+  * @ver	0.01
+  *********************************************************
+  * Kernels: scalar everywhere, SSE2 on x86 chosen at compile time.
+  * AVX2 and NEON kernels with runtime dispatch are left out on purpose.
+  * HexCodecBench measures about 7 GB/s for SSE2 and 1 GB/s for scalar,
+  * so one 1024-byte AT+NSOSD is encoded in about 1 us at worst, while
+  * writing its 2048 digits at 115200 baud takes about 180 ms. A wider
+  * kernel can't shorten that, and dispatch would add CPUID code to a
+  * file built by MCU and MSVC projects as well.
+  */
+
+#ifndef _HEXCODEC_H_
+#define _HEXCODEC_H_
+
+/**
+ * Public functions.
+ **/
+int HexCodec_Encode(char *dst, const unsigned char *src, int size);
+int HexCodec_Decode(unsigned char *dst, const char *src, int len);
+int HexCodec_EncodeScalar(char *dst, const unsigned char *src, int size);
+int HexCodec_DecodeScalar(unsigned char *dst, const char *src, int len);
+int HexCodec_DigitValue(char c);
+const char* HexCodec_GetKernel(void);
+
+#endif
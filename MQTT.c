@@ -10,6 +10,22 @@
 #include <string.h>
 #include "MQTT.h"
 
+// states of MQTT_DECODER
+enum {
+	DECODER_STATE_TYPE,
+	DECODER_STATE_LENGTH,
+	DECODER_STATE_BODY,
+	DECODER_STATE_SKIP
+};
+
+// states of MQTT_INFLIGHT_ENTRY
+enum {
+	INFLIGHT_STATE_FREE,
+	INFLIGHT_STATE_PUBACK,		//QoS 1 PUBLISH sent
+	INFLIGHT_STATE_PUBREC,		//QoS 2 PUBLISH sent
+	INFLIGHT_STATE_PUBCOMP		//PUBREL sent
+};
+
 static unsigned char ComposeHeaderFlags(int msg_type, int dup_flag, int qos_level, int retain)
 {
 	return (unsigned char)(((msg_type & 0xF) << 4) | ((dup_flag & 1) << 3) |
@@ -24,6 +40,170 @@ static unsigned char ComposeConnectFlags(int usr_name, int usr_pw, int will_reta
 		((will_flag & 1) << 2) | ((clean_session & 1) << 1));
 }
 
+// number of bytes of remaining length, 0: too long
+static int SizeRemainingLength(size_t len)
+{
+	if(len < 128)
+		return 1;
+	if(len < 16384)
+		return 2;
+	if(len < 2097152)
+		return 3;
+	if(len <= MQTT_MAX_REMAINING_LENGTH)
+		return 4;
+
+	return 0;
+}
+
+// 7 bits per byte, least significant first, bit 7 means more bytes follow
+static int EncodeRemainingLength(unsigned char *msg, size_t len)
+{
+	int count = 0;
+
+	do
+	{
+		msg[count] = (unsigned char)(len & 0x7F);
+		len >>= 7;
+		if(len > 0)
+			msg[count] |= 0x80;
+		count++;
+	}
+	while(len > 0 && count < 4);
+
+	return count;
+}
+
+// fixed header with remaining length known in advance, 0: not enough space
+static int ComposeFixedHeader(unsigned char *msg, int size, unsigned char flags, size_t len)
+{
+	int count = SizeRemainingLength(len);
+
+	if(count == 0 || (size_t)size < 1 + count + len)
+		return 0;
+
+	msg[0] = flags;
+	return 1 + EncodeRemainingLength(&msg[1], len);
+}
+
+static int ComposeString(unsigned char *msg, const char *str, int len)
+{
+	msg[0] = (len >> 8);
+	msg[1] = (len & 0xFF);
+	memcpy(&msg[2], str, len);
+
+	return 2 + len;
+}
+
+// fixed header, topic and message ID of PUBLISH, payload follows in msg if with_payload
+static int ComposePublishHeader(unsigned char *msg, int size, int dup, int qos, int retain,
+								const char* topic, size_t payload_len, int msg_id, int with_payload)
+{
+	int count, len, rem_size;
+	size_t rem;
+
+	if(msg == NULL || topic == NULL || topic[0] == 0)
+		return 0;
+
+	len = strlen(topic);
+	rem = 2 + len + ((qos != MQTT_QOS_AT_MOST_ONCE) ? 2 : 0) + payload_len;
+
+	// header buffer needs no room for payload
+	rem_size = SizeRemainingLength(rem);
+	if(rem_size == 0 || (size_t)size < 1 + rem_size + rem - (with_payload ? 0 : payload_len))
+		return 0;
+
+	//Header Flags and message length
+	msg[0] = ComposeHeaderFlags(MQTT_MSG_TYPE_PUBLISH, dup, qos, retain);
+	count = 1 + EncodeRemainingLength(&msg[1], rem);
+
+	//topic
+	count += ComposeString(&msg[count], topic, len);
+
+	//message ID
+	if(qos != MQTT_QOS_AT_MOST_ONCE)
+	{
+		msg[count++] = ((msg_id >> 8) & 0xFF);
+		msg[count++] = (msg_id & 0xFF);
+	}
+
+	return count;
+}
+
+// PUBACK, PUBREC, PUBREL and PUBCOMP carry packet ID only
+static int ComposeAck(unsigned char *msg, int size, int msg_type, int msg_id)
+{
+	if(msg == NULL || size < MQTT_MSG_SIZE_PUBACK)
+		return 0;
+
+	//PUBREL has reserved flags 0010
+	msg[0] = ComposeHeaderFlags(msg_type, 0, (msg_type == MQTT_MSG_TYPE_PUBREL) ? 1 : 0, 0);
+	msg[1] = 2;
+	msg[2] = ((msg_id >> 8) & 0xFF);
+	msg[3] = (msg_id & 0xFF);
+
+	return MQTT_MSG_SIZE_PUBACK;
+}
+
+// next free packet ID in bitmap, 0: none
+static int AllocPacketId(MQTT_INFLIGHT *inf)
+{
+	int i, id = inf->last_id;
+
+	for(i=1; i<MQTT_PACKET_ID_NUM; i++)
+	{
+		id = (id % (MQTT_PACKET_ID_NUM - 1)) + 1;
+		if(!(inf->bitmap[id >> 3] & (1 << (id & 7))))
+		{
+			inf->bitmap[id >> 3] |= (1 << (id & 7));
+			inf->last_id = id;
+			return id;
+		}
+	}
+
+	return 0;
+}
+
+static void FreeInflight(MQTT_INFLIGHT *inf, MQTT_INFLIGHT_ENTRY *entry, int status)
+{
+	int id = entry->msg_id;
+
+	inf->bitmap[id >> 3] &= ~(1 << (id & 7));
+	entry->state = INFLIGHT_STATE_FREE;
+	inf->count--;
+
+	if(inf->callback)
+		inf->callback(id, status, entry->user);
+}
+
+// PUBLISH with DUP after the first time, or PUBREL
+static int SendInflight(MQTT_INFLIGHT *inf, MQTT_INFLIGHT_ENTRY *entry, unsigned long now)
+{
+	MQTT_IOVEC iov[2];
+	unsigned char rel[MQTT_MSG_SIZE_PUBACK];
+	int num = 1;
+
+	if(entry->state == INFLIGHT_STATE_PUBCOMP)
+	{
+		iov[0].data = rel;
+		iov[0].size = ComposeAck(rel, sizeof(rel), MQTT_MSG_TYPE_PUBREL, entry->msg_id);
+	}
+	else
+	{
+		iov[0].data = entry->header;
+		iov[0].size = entry->header_len;
+		if(entry->payload_len > 0)
+		{
+			iov[1].data = entry->payload;
+			iov[1].size = entry->payload_len;
+			num = 2;
+		}
+	}
+
+	entry->sent_tick = now;
+
+	return inf->send ? inf->send(iov, num, inf->context) : 0;
+}
+
 
 /**
   * @brief  To get message type from message.
@@ -51,17 +231,32 @@ int MQTT_ConnectMessage(unsigned char *msg, int size, const char *IP, const char
 				   const char *Client_ID, const char *usr_name, const char *passwd,
 				   int con_timeout, int keep_alive, int clean_session)
 {
-	int count = 0, len;
-	int flag_usr_name = 0, flag_passwd = 0;
+	int count, len;
+	int len_client_id = 0, len_usr_name = 0, len_passwd = 0;
 
-	if(msg == NULL || size < 2)
+	if(msg == NULL)
 		return 0;
 
-	//Header Flags
-	msg[count++] = ComposeHeaderFlags(MQTT_MSG_TYPE_CONNECT, 0, 0, 0);
-
-	//set message length later
-	msg[count++] = 0;
+	if(Client_ID)
+		len_client_id = strlen(Client_ID);
+	if(usr_name)
+		len_usr_name = strlen(usr_name);
+	if(passwd)
+		len_passwd = strlen(passwd);
+
+	//variable header, then client ID, user name and password with 2-byte length
+	len = 10;
+	if(Client_ID)
+		len += 2 + len_client_id;
+	if(len_usr_name > 0)
+		len += 2 + len_usr_name;
+	if(len_passwd > 0)
+		len += 2 + len_passwd;
+
+	//Header Flags and message length
+	count = ComposeFixedHeader(msg, size, ComposeHeaderFlags(MQTT_MSG_TYPE_CONNECT, 0, 0, 0), len);
+	if(count == 0)
+		return 0;
 
 	//set protocol name
 	msg[count++] = 0;
@@ -74,8 +269,8 @@ int MQTT_ConnectMessage(unsigned char *msg, int size, const char *IP, const char
 
 	//Connect flags
 	msg[count++] = ComposeConnectFlags(
-		(usr_name != NULL && usr_name[0] != 0) ? 1 : 0, 
-		(passwd != NULL && passwd[0] != 0) ? 1 : 0, 
+		(len_usr_name > 0) ? 1 : 0, 
+		(len_passwd > 0) ? 1 : 0, 
 		0, 0, 0, (clean_session & 1));
 
 	//keep-alive
@@ -92,47 +287,17 @@ int MQTT_ConnectMessage(unsigned char *msg, int size, const char *IP, const char
 
 	//Client ID
 	if(Client_ID)
-	{
-		len = strlen(Client_ID);
-		if(count + len > size)
-			return 0;
-
-		msg[count++] = (len >> 8);
-		msg[count++] = (len & 0xFF);
-		memcpy(&msg[count], (unsigned char*)Client_ID, len);
-		count += len;
-	}
+		count += ComposeString(&msg[count], Client_ID, len_client_id);
 
 	//skip will message
 
 	//user name
-	if(usr_name && usr_name[0] != 0)
-	{
-		len = strlen(usr_name);
-		if(count + len > size)
-			return 0;
-
-		msg[count++] = (len >> 8);
-		msg[count++] = (len & 0xFF);
-		memcpy(&msg[count], (unsigned char*)usr_name, len);
-		count += len;
-	}
+	if(len_usr_name > 0)
+		count += ComposeString(&msg[count], usr_name, len_usr_name);
 
 	//password
-	if(passwd && passwd[0] != 0)
-	{
-		len = strlen(passwd);
-		if(count + len > size)
-			return 0;
-
-		msg[count++] = (len >> 8);
-		msg[count++] = (len & 0xFF);
-		memcpy(&msg[count], (unsigned char*)passwd, len);
-		count += len;
-	}
-
-	//set message length
-	msg[1] = count - 2;
+	if(len_passwd > 0)
+		count += ComposeString(&msg[count], passwd, len_passwd);
 
 	return count;
 }
@@ -161,69 +326,88 @@ int MQTT_DisconnectMessage(unsigned char *msg, int size)
   *			dup: flag of re-deliver, qos: enum MQTT_QOS,
   *			retain: flag of RETAIN,
   *			topic: pointer to topic, message: pointer to message,
-  *			msg_id: if qos is greater than 0, should give message id starts with 0.
+  *			msg_id: if qos is greater than 0, should give message id starts with 1.
   * @retval number of bytes
   */
 int MQTT_PublishMessage(unsigned char *msg, int size, int dup, int qos, int retain,
 						const char* topic, const char* message, int msg_id)
 {
-	int count = 0, len;
-
-	if(msg == NULL || size < 4 || 
-		topic == NULL || message == NULL || 
-		topic[0] == 0 || message[0] == 0)
+	if(message == NULL || message[0] == 0)
 		return 0;
 
-	len = 2 + strlen(topic) + strlen(message);
-	if(qos != MQTT_QOS_AT_MOST_ONCE)
-		len += 2;
+	return MQTT_PublishBinaryMessage(msg, size, dup, qos, retain, topic,
+		(const unsigned char*)message, strlen(message), msg_id);
+}
 
-	//Header Flags
-	msg[count++] = ComposeHeaderFlags(MQTT_MSG_TYPE_PUBLISH, dup, qos, retain);
 
-	//set message length later
-	msg[count++] = 0;
-	if(len > 127)
-		msg[count++] = 0;
+/**
+  * @brief  To compose publish message with binary payload.
+  * @param  msg: pointer to message, size: max number of bytes, 
+  *			dup: flag of re-deliver, qos: enum MQTT_QOS,
+  *			retain: flag of RETAIN, topic: pointer to topic,
+  *			payload: pointer to payload, NULL if payload_len is 0,
+  *			payload_len: number of bytes of payload, 0 is allowed,
+  *			msg_id: if qos is greater than 0, 16-bit message id starts with 1.
+  * @retval number of bytes
+  */
+int MQTT_PublishBinaryMessage(unsigned char *msg, int size, int dup, int qos, int retain,
+							  const char* topic, const unsigned char* payload, size_t payload_len,
+							  int msg_id)
+{
+	int count;
 
-	//topic
-	if(topic)
-	{
-		len = strlen(topic);
-		if(count + len > size)
-			return 0;
+	if(payload == NULL && payload_len > 0)
+		return 0;
 
-		msg[count++] = (len >> 8);
-		msg[count++] = (len & 0xFF);
-		memcpy(&msg[count], (unsigned char*)topic, len);
-		count += len;
+	count = ComposePublishHeader(msg, size, dup, qos, retain, topic, payload_len, msg_id, 1);
+	if(count == 0)
+		return 0;
+
+	//payload
+	if(payload_len > 0)
+	{
+		memcpy(&msg[count], payload, payload_len);
+		count += (int)payload_len;
 	}
 
-	//message ID
-	if(qos != MQTT_QOS_AT_MOST_ONCE)
-		msg[count++] = msg_id;
+	return count;
+}
 
-	//message
-	if(message)
-	{
-		len = strlen(message);
-		if(count + len > size)
-			return 0;
 
-		memcpy(&msg[count], (unsigned char*)message, len);
-		count += len;
-	}
+/**
+  * @brief  To compose publish message without copying payload, only fixed header, topic
+  *			and message ID are written to header buffer. Send the buffers in order.
+  * @param  iov: to receive 2 buffers, header and payload,
+  *			header: pointer to header buffer, size: max number of bytes, topic length + 9 is enough,
+  *			dup: flag of re-deliver, qos: enum MQTT_QOS,
+  *			retain: flag of RETAIN, topic: pointer to topic,
+  *			payload: pointer to payload, must be valid until sent,
+  *			payload_len: number of bytes of payload, 0 is allowed,
+  *			msg_id: if qos is greater than 0, 16-bit message id starts with 1.
+  * @retval number of buffers in iov, 0: failed
+  */
+int MQTT_PublishVector(MQTT_IOVEC *iov, unsigned char *header, int size, int dup, int qos, int retain,
+					   const char* topic, const unsigned char* payload, size_t payload_len,
+					   int msg_id)
+{
+	int count;
 
-	//set message length
-	len = count - 2;
-	msg[1] = (len & 0x7F);
-	if(len > 127)
-	{
-		msg[1] |= 0x80;
-		msg[2] = ((len - (len & 0x7F)) >> 7);
-	}
+	if(iov == NULL || (payload == NULL && payload_len > 0))
+		return 0;
 
-	return count;
+	count = ComposePublishHeader(header, size, dup, qos, retain, topic, payload_len, msg_id, 0);
+	if(count == 0)
+		return 0;
+
+	iov[0].data = header;
+	iov[0].size = count;
+	if(payload_len == 0)
+		return 1;
+
+	iov[1].data = payload;
+	iov[1].size = (int)payload_len;
+
+	return 2;
 }
 
 
@@ -235,16 +419,19 @@ int MQTT_PublishMessage(unsigned char *msg, int size, int dup, int qos, int reta
   */
 int MQTT_SubscribeMessage(unsigned char *msg, int size, const char* topic)
 {
-	int count = 0, len;
+	int count, len = 0;
 
-	if(msg == NULL || size < 2)
+	if(msg == NULL)
 		return 0;
 
-	//Header Flags
-	msg[count++] = ComposeHeaderFlags(MQTT_MSG_TYPE_SUBSCRIBE, 0, 1, 0);
+	if(topic)
+		len = strlen(topic);
 
-	//set message length later
-	msg[count++] = 0;
+	//Header Flags and message length
+	count = ComposeFixedHeader(msg, size, ComposeHeaderFlags(MQTT_MSG_TYPE_SUBSCRIBE, 0, 1, 0),
+		2 + (topic ? 2 + len : 0) + 1);
+	if(count == 0)
+		return 0;
 
 	//message identifier
 	msg[count++] = 0;
@@ -252,23 +439,11 @@ int MQTT_SubscribeMessage(unsigned char *msg, int size, const char* topic)
 
 	//topic
 	if(topic)
-	{
-		len = strlen(topic);
-		if(count + len > size)
-			return 0;
-
-		msg[count++] = (len >> 8);
-		msg[count++] = (len & 0xFF);
-		memcpy(&msg[count], (unsigned char*)topic, len);
-		count += len;
-	}
+		count += ComposeString(&msg[count], topic, len);
 
 	//qos
 	msg[count++] = 0;
 
-	//set message length
-	msg[1] = count - 2;
-
 	return count;
 }
 
@@ -296,48 +471,164 @@ int MQTT_PingRequestMessage(unsigned char *msg, int size)
 
 
 /**
-  * @brief  To parse publish message received.
-  * @param  msg: pointer to message, size: max number of bytes,
-  *			topic: pointer to topic, message: pointer to message
-  * @retval 1: OK, 0: not publish message
+  * @brief  To compose PUBACK message for received QoS 1 PUBLISH.
+  * @param  msg: pointer to message, size: max number of bytes, msg_id: message id of PUBLISH
+  * @retval number of bytes
+  */
+int MQTT_PubAckMessage(unsigned char *msg, int size, int msg_id)
+{
+	return ComposeAck(msg, size, MQTT_MSG_TYPE_PUBACK, msg_id);
+}
+
+
+/**
+  * @brief  To compose PUBREC message for received QoS 2 PUBLISH.
+  * @param  msg: pointer to message, size: max number of bytes, msg_id: message id of PUBLISH
+  * @retval number of bytes
+  */
+int MQTT_PubRecMessage(unsigned char *msg, int size, int msg_id)
+{
+	return ComposeAck(msg, size, MQTT_MSG_TYPE_PUBREC, msg_id);
+}
+
+
+/**
+  * @brief  To compose PUBREL message for received PUBREC.
+  * @param  msg: pointer to message, size: max number of bytes, msg_id: message id of PUBREC
+  * @retval number of bytes
+  */
+int MQTT_PubRelMessage(unsigned char *msg, int size, int msg_id)
+{
+	return ComposeAck(msg, size, MQTT_MSG_TYPE_PUBREL, msg_id);
+}
+
+
+/**
+  * @brief  To compose PUBCOMP message for received PUBREL.
+  * @param  msg: pointer to message, size: max number of bytes, msg_id: message id of PUBREL
+  * @retval number of bytes
+  */
+int MQTT_PubCompMessage(unsigned char *msg, int size, int msg_id)
+{
+	return ComposeAck(msg, size, MQTT_MSG_TYPE_PUBCOMP, msg_id);
+}
+
+
+/**
+  * @brief  To parse PUBACK, PUBREC, PUBREL or PUBCOMP message.
+  * @param  msg: pointer to message, size: number of bytes of message,
+  *			msg_id: to receive message id
+  * @retval enum MQTT_MSG_TYPE, -1: not one of them
+  */
+int MQTT_ParseAck(const unsigned char *msg, int size, int *msg_id)
+{
+	int type;
+
+	if(msg == NULL || size < MQTT_MSG_SIZE_PUBACK || msg[1] != 2)
+		return -1;
+
+	type = MQTT_GetMessageType((unsigned char*)msg);
+	if(type < MQTT_MSG_TYPE_PUBACK || type > MQTT_MSG_TYPE_PUBCOMP)
+		return -1;
+
+	if(msg_id)
+		*msg_id = ((int)msg[2] << 8) + msg[3];
+
+	return type;
+}
+
+
+/**
+  * @brief  To parse publish message received, topic and message are copied and NULL-terminated.
+  * @param  msg: pointer to message, size: number of bytes of message,
+  *			topic: pointer to topic, message: pointer to message,
+  *			both should be larger than size
+  * @retval 1: OK, 0: not publish message or malformed
   */
 int MQTT_ParsePublishMessage(unsigned char *msg, int size, char *topic, char *message)
 {
-	if(MQTT_GetMessageType((unsigned char*)msg) == MQTT_MSG_TYPE_PUBLISH)
-	{
-		unsigned char *p = &msg[1];
-		int msg_len = (msg[1] & 0x7F);
-		int factor = 1;
+	MQTT_PUBLISH_VIEW view;
 
-		while(p[0] & 0x80)
-		{
-			p++;
-			factor *= 128;
-			msg_len += ((p[0] & 0x7F) * factor);
-		}
+	if(!MQTT_ParsePublishView(msg, size, &view))
+		return 0;
 
-		p++;
+	memcpy(topic, view.topic, view.topic_len);
+	topic[view.topic_len] = 0;
 
-		//get topic
-		int topic_len = ((int)p[0] << 8) + p[1];
+	memcpy(message, view.payload, view.payload_len);
+	message[view.payload_len] = 0;
 
-		p += 2;
+	return 1;
+}
 
-		memcpy(topic, p, topic_len);
-		topic[topic_len] = 0;
 
-		p += topic_len;
+/**
+  * @brief  To parse publish message received without copy, fields point into msg.
+  * @param  msg: pointer to message, size: number of bytes of message,
+  *			view: to receive fields
+  * @retval 1: OK, 0: not publish message or malformed
+  */
+int MQTT_ParsePublishView(const unsigned char *msg, int size, MQTT_PUBLISH_VIEW *view)
+{
+	size_t len = 0;
+	int count = 1, shift = 0;
 
-		//get message
-		int message_len = msg_len - topic_len - 2;
+	if(msg == NULL || view == NULL || size < 2 ||
+		MQTT_GetMessageType((unsigned char*)msg) != MQTT_MSG_TYPE_PUBLISH)
+		return 0;
 
-		memcpy(message, p, message_len);
-		message[message_len] = 0;
+	view->dup = (msg[0] >> 3) & 1;
+	view->qos = (msg[0] >> 1) & 3;
+	view->retain = msg[0] & 1;
+	if(view->qos == MQTT_QOS_RESERVED)
+		return 0;
 
-		return 1;
+	//remaining length
+	do
+	{
+		if(count >= size || shift >= 28)
+			return 0;
+
+		len |= (size_t)(msg[count] & 0x7F) << shift;
+		shift += 7;
 	}
+	while(msg[count++] & 0x80);
 
-	return 0;
+	if(len > (size_t)(size - count))
+		return 0;
+	size = count + (int)len;
+
+	//topic
+	if(count + 2 > size)
+		return 0;
+
+	view->topic_len = ((int)msg[count] << 8) + msg[count + 1];
+	count += 2;
+	if(count + view->topic_len > size)
+		return 0;
+
+	view->topic = &msg[count];
+	count += view->topic_len;
+
+	//message ID
+	view->msg_id = 0;
+	if(view->qos != MQTT_QOS_AT_MOST_ONCE)
+	{
+		if(count + 2 > size)
+			return 0;
+
+		//packet identifier must be non-zero
+		view->msg_id = ((int)msg[count] << 8) + msg[count + 1];
+		if(view->msg_id == 0)
+			return 0;
+		count += 2;
+	}
+
+	//payload
+	view->payload = &msg[count];
+	view->payload_len = size - count;
+
+	return 1;
 }
 
 
@@ -356,3 +647,351 @@ int MQTT_CheckConnectAck(const unsigned char* msg)
 	return -1;
 }
 
+
+/**
+  * @brief  To initialize streaming decoder, which assembles packets from TCP data
+  *			in chunks of any size, e.g. from BC28_ReadTcpSocket().
+  * @param  dec: pointer to decoder, buf: buffer of one packet, size: max packet size,
+  *			callback: called for each complete packet, context: user pointer passed to callback
+  * @retval None
+  */
+void MQTT_DecoderInit(MQTT_DECODER *dec, unsigned char *buf, int size,
+					  MQTT_PACKET_CALLBACK callback, void *context)
+{
+	dec->buf = buf;
+	dec->buf_size = size;
+	dec->callback = callback;
+	dec->context = context;
+	dec->dropped = 0;
+
+	MQTT_DecoderReset(dec);
+}
+
+
+/**
+  * @brief  To discard partial packet, e.g. after reconnection.
+  * @param  dec: pointer to decoder
+  * @retval None
+  */
+void MQTT_DecoderReset(MQTT_DECODER *dec)
+{
+	dec->count = 0;
+	dec->state = DECODER_STATE_TYPE;
+	dec->remaining = 0;
+	dec->shift = 0;
+	dec->skip = 0;
+}
+
+
+/**
+  * @brief  To feed received data to decoder, packets may be split or coalesced in any way.
+  *			A packet longer than buffer is skipped and counted in dropped.
+  * @param  dec: pointer to decoder, data: pointer to data, size: number of bytes
+  * @retval number of complete packets, -1: malformed remaining length, decoder is reset
+  */
+int MQTT_DecoderFeed(MQTT_DECODER *dec, const unsigned char *data, int size)
+{
+	const unsigned char *end = data + size;
+	int packets = 0;
+
+	while(data < end)
+	{
+		switch(dec->state)
+		{
+		case DECODER_STATE_TYPE:
+		{
+			// whole packet in data, pass it without copy
+			// packet longer than buf is skipped by the states below, as if it were split
+			size_t len = 0;
+			int i;
+
+			for(i=1; i<=4 && data + i < end; i++)
+			{
+				len |= (size_t)(data[i] & 0x7F) << (7 * (i - 1));
+				if(!(data[i] & 0x80))
+					break;
+			}
+
+			if(i <= 4 && data + i < end && (size_t)(end - data) > i + len &&
+				1 + i + len <= (size_t)dec->buf_size)
+			{
+				packets++;
+				if(dec->callback)
+					dec->callback(data, (int)(1 + i + len), dec->context);
+				data += 1 + i + len;
+				break;
+			}
+		}
+			dec->count = 0;
+			dec->remaining = 0;
+			dec->shift = 0;
+			if(dec->buf_size > 0)
+				dec->buf[dec->count++] = *data;
+			data++;
+			dec->state = DECODER_STATE_LENGTH;
+			break;
+
+		case DECODER_STATE_LENGTH:
+		{
+			unsigned char b = *data++;
+
+			if(dec->count < dec->buf_size)
+				dec->buf[dec->count++] = b;
+
+			dec->remaining |= (size_t)(b & 0x7F) << dec->shift;
+			dec->shift += 7;
+
+			if(b & 0x80)
+			{
+				// at most 4 bytes of remaining length
+				if(dec->shift >= 28)
+				{
+					MQTT_DecoderReset(dec);
+					return -1;
+				}
+				break;
+			}
+
+			// type and length bytes are in buf only if it is large enough
+			if(1 + dec->shift / 7 + dec->remaining > (size_t)dec->buf_size)
+			{
+				dec->skip = dec->remaining;
+				dec->dropped++;
+				dec->state = (dec->skip > 0) ? DECODER_STATE_SKIP : DECODER_STATE_TYPE;
+				break;
+			}
+
+			dec->state = DECODER_STATE_BODY;
+			if(dec->remaining > 0)
+				break;
+		}
+			//no body, e.g. PINGRESP
+			//fall through
+
+		case DECODER_STATE_BODY:
+		{
+			size_t num = (size_t)(end - data);
+
+			if(num > dec->remaining)
+				num = dec->remaining;
+
+			memcpy(&dec->buf[dec->count], data, num);
+			dec->count += (int)num;
+			dec->remaining -= num;
+			data += num;
+
+			if(dec->remaining == 0)
+			{
+				dec->state = DECODER_STATE_TYPE;
+				packets++;
+				if(dec->callback)
+					dec->callback(dec->buf, dec->count, dec->context);
+			}
+			break;
+		}
+
+		case DECODER_STATE_SKIP:
+		{
+			size_t num = (size_t)(end - data);
+
+			if(num > dec->skip)
+				num = dec->skip;
+
+			dec->skip -= num;
+			data += num;
+
+			if(dec->skip == 0)
+				dec->state = DECODER_STATE_TYPE;
+			break;
+		}
+		}
+	}
+
+	return packets;
+}
+
+
+/**
+  * @brief  To initialize in-flight engine of outbound QoS 1/2 messages.
+  *			It is not thread-safe, protect all calls with the same lock.
+  * @param  inf: pointer to engine, window: max number of unacknowledged messages,
+  *			up to MQTT_MAX_INFLIGHT, timeout: miliseconds to retransmit,
+  *			max_retries: retransmissions before giving up, 0: never give up,
+  *			send: function to send packet, callback: called when message is done,
+  *			context: user pointer passed to send
+  * @retval None
+  */
+void MQTT_InflightInit(MQTT_INFLIGHT *inf, int window, int timeout, int max_retries,
+					   MQTT_SEND_FUNC send, MQTT_INFLIGHT_CALLBACK callback, void *context)
+{
+	memset(inf, 0, sizeof(MQTT_INFLIGHT));
+
+	inf->window = (window > 0 && window < MQTT_MAX_INFLIGHT) ? window : MQTT_MAX_INFLIGHT;
+	inf->timeout = (unsigned long)timeout;
+	inf->max_retries = max_retries;
+	inf->send = send;
+	inf->callback = callback;
+	inf->context = context;
+}
+
+
+/**
+  * @brief  To publish QoS 1/2 message, it is kept until acknowledged.
+  * @param  inf: pointer to engine, qos: MQTT_QOS_AT_LEAST_ONCE or MQTT_QOS_EXACTLY_ONCE,
+  *			retain: flag of RETAIN, topic: pointer to topic,
+  *			payload: pointer to payload, must be valid until callback,
+  *			payload_len: number of bytes of payload,
+  *			user: user pointer passed to callback, now: current time in miliseconds
+  * @retval message id, also if failed to send, it is retransmitted by MQTT_InflightPoll(),
+  *			0: window is full or invalid parameters, message is not kept
+  */
+int MQTT_InflightPublish(MQTT_INFLIGHT *inf, int qos, int retain, const char *topic,
+						 const unsigned char *payload, int payload_len, void *user, unsigned long now)
+{
+	MQTT_INFLIGHT_ENTRY *entry = NULL;
+	int i;
+
+	if((qos != MQTT_QOS_AT_LEAST_ONCE && qos != MQTT_QOS_EXACTLY_ONCE) ||
+		payload_len < 0 || inf->count >= inf->window)
+		return 0;
+
+	for(i=0; i<MQTT_MAX_INFLIGHT; i++)
+	{
+		if(inf->table[i].state == INFLIGHT_STATE_FREE)
+		{
+			entry = &inf->table[i];
+			break;
+		}
+	}
+
+	if(entry == NULL || (entry->msg_id = AllocPacketId(inf)) == 0)
+		return 0;
+
+	entry->header_len = ComposePublishHeader(entry->header, sizeof(entry->header), 0, qos, retain,
+		topic, payload_len, entry->msg_id, 0);
+	if(entry->header_len == 0 || (payload == NULL && payload_len > 0))
+	{
+		inf->bitmap[entry->msg_id >> 3] &= ~(1 << (entry->msg_id & 7));
+		return 0;
+	}
+
+	entry->payload = payload;
+	entry->payload_len = payload_len;
+	entry->retries = 0;
+	entry->user = user;
+	entry->state = (qos == MQTT_QOS_AT_LEAST_ONCE) ? INFLIGHT_STATE_PUBACK : INFLIGHT_STATE_PUBREC;
+	inf->count++;
+
+	// failed to send is retransmitted by timeout
+	SendInflight(inf, entry, now);
+
+	// DUP for retransmission
+	entry->header[0] |= 0x08;
+
+	return entry->msg_id;
+}
+
+
+/**
+  * @brief  To handle PUBACK, PUBREC or PUBCOMP received, PUBREL is sent for PUBREC.
+  * @param  inf: pointer to engine, msg: pointer to message, size: number of bytes of message,
+  *			now: current time in miliseconds
+  * @retval 1: handled, 0: not for in-flight messages
+  */
+int MQTT_InflightHandleAck(MQTT_INFLIGHT *inf, const unsigned char *msg, int size, unsigned long now)
+{
+	int i, msg_id, type = MQTT_ParseAck(msg, size, &msg_id);
+
+	if(type < 0 || type == MQTT_MSG_TYPE_PUBREL)
+		return 0;
+
+	for(i=0; i<MQTT_MAX_INFLIGHT; i++)
+	{
+		MQTT_INFLIGHT_ENTRY *entry = &inf->table[i];
+
+		if(entry->state == INFLIGHT_STATE_FREE || entry->msg_id != msg_id)
+			continue;
+
+		if((type == MQTT_MSG_TYPE_PUBACK && entry->state == INFLIGHT_STATE_PUBACK) ||
+			(type == MQTT_MSG_TYPE_PUBCOMP && entry->state == INFLIGHT_STATE_PUBCOMP))
+		{
+			FreeInflight(inf, entry, 1);
+		}
+		else if(type == MQTT_MSG_TYPE_PUBREC &&
+			(entry->state == INFLIGHT_STATE_PUBREC || entry->state == INFLIGHT_STATE_PUBCOMP))
+		{
+			// payload is no longer needed, PUBREL until PUBCOMP
+			entry->state = INFLIGHT_STATE_PUBCOMP;
+			entry->retries = 0;
+			SendInflight(inf, entry, now);
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/**
+  * @brief  To retransmit messages not acknowledged in time, call it periodically.
+  * @param  inf: pointer to engine, now: current time in miliseconds
+  * @retval number of retransmitted messages
+  */
+int MQTT_InflightPoll(MQTT_INFLIGHT *inf, unsigned long now)
+{
+	int i, count = 0;
+
+	for(i=0; i<MQTT_MAX_INFLIGHT; i++)
+	{
+		MQTT_INFLIGHT_ENTRY *entry = &inf->table[i];
+
+		if(entry->state == INFLIGHT_STATE_FREE || now - entry->sent_tick < inf->timeout)
+			continue;
+
+		if(inf->max_retries > 0 && entry->retries >= inf->max_retries)
+		{
+			FreeInflight(inf, entry, 0);
+			continue;
+		}
+
+		entry->retries++;
+		SendInflight(inf, entry, now);
+		count++;
+	}
+
+	return count;
+}
+
+
+/**
+  * @brief  To retransmit all unacknowledged messages after reconnection with clean session 0.
+  * @param  inf: pointer to engine, now: current time in miliseconds
+  * @retval number of retransmitted messages
+  */
+int MQTT_InflightResend(MQTT_INFLIGHT *inf, unsigned long now)
+{
+	int i, count = 0;
+
+	for(i=0; i<MQTT_MAX_INFLIGHT; i++)
+	{
+		if(inf->table[i].state != INFLIGHT_STATE_FREE)
+		{
+			SendInflight(inf, &inf->table[i], now);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+
+/**
+  * @brief  To get number of unacknowledged messages.
+  * @param  inf: pointer to engine
+  * @retval number of messages
+  */
+int MQTT_InflightCount(const MQTT_INFLIGHT *inf)
+{
+	return inf->count;
+}
@@ -10,6 +10,8 @@
 #ifndef _MQTT_H_
 #define _MQTT_H_
 
+#include <stddef.h>
+
 #define MQTT_BROKER_IP_FET			"150.117.126.25"
 #define MQTT_USER_NAME_FET			"fet/fet"
 #define MQTT_PASSWD_FET				"fet@1234"
@@ -25,8 +27,108 @@
 #define DEFAULT_MQTT_PUBLISH_MSG	"test"
 #define DEFAULT_MQTT_SUBSCRIBE_TOPIC	"HLX-IoT/pub"
 
+#define MQTT_MAX_REMAINING_LENGTH	268435455	//4 bytes of remaining length
+
 #define MQTT_MSG_SIZE_CONNACK		4
 #define MQTT_MSG_SIZE_SUBACK		5
+#define MQTT_MSG_SIZE_PUBACK		4		//also PUBREC, PUBREL and PUBCOMP
+#define MQTT_MAX_FIXED_HEADER_SIZE	5		//type and 4 bytes of remaining length
+
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT			8		//max number of unacknowledged QoS 1/2 messages
+#endif
+#ifndef MQTT_PACKET_ID_NUM
+#define MQTT_PACKET_ID_NUM			1024	//packet IDs 1 ~ (MQTT_PACKET_ID_NUM-1) are used, up to 65536
+#endif
+#ifndef MQTT_INFLIGHT_HEADER_SIZE
+#define MQTT_INFLIGHT_HEADER_SIZE	64		//fixed header, topic and packet ID kept for retransmission
+#endif
+
+/**
+ * Buffer of message composed without copy, see MQTT_PublishVector().
+ **/
+typedef struct {
+	const unsigned char	*data;
+	int					size;
+} MQTT_IOVEC;
+
+/**
+ * Fields of received PUBLISH, pointing into the message, see MQTT_ParsePublishView().
+ * topic is not NULL-terminated.
+ **/
+typedef struct {
+	int						dup;
+	int						qos;
+	int						retain;
+	const unsigned char		*topic;
+	int						topic_len;
+	int						msg_id;		//0 for QoS 0
+	const unsigned char		*payload;
+	int						payload_len;
+} MQTT_PUBLISH_VIEW;
+
+/**
+ * Send function of in-flight engine, e.g. BC28_WriteTcpSocketV(), returns 1 if sent.
+ **/
+typedef int (*MQTT_SEND_FUNC)(const MQTT_IOVEC *iov, int iov_num, void *context);
+
+/**
+ * Callback of in-flight message, status 1: delivered, 0: given up after retries.
+ **/
+typedef void (*MQTT_INFLIGHT_CALLBACK)(int msg_id, int status, void *user);
+
+/**
+ * Unacknowledged message of in-flight engine.
+ **/
+typedef struct {
+	int						state;		//0: free, others: waiting for PUBACK, PUBREC or PUBCOMP
+	int						msg_id;
+	unsigned char			header[MQTT_INFLIGHT_HEADER_SIZE];
+	int						header_len;
+	const unsigned char		*payload;	//must be valid until callback
+	int						payload_len;
+	unsigned long			sent_tick;
+	int						retries;
+	void					*user;
+} MQTT_INFLIGHT_ENTRY;
+
+/**
+ * Outbound QoS 1/2 window, see MQTT_InflightInit().
+ **/
+typedef struct {
+	MQTT_INFLIGHT_ENTRY		table[MQTT_MAX_INFLIGHT];
+	unsigned char			bitmap[MQTT_PACKET_ID_NUM / 8];	//packet IDs in use
+	int						last_id;
+	int						window;
+	int						count;
+	unsigned long			timeout;
+	int						max_retries;
+	MQTT_SEND_FUNC			send;
+	MQTT_INFLIGHT_CALLBACK	callback;
+	void					*context;
+} MQTT_INFLIGHT;
+
+/**
+ * Callback of MQTT_DecoderFeed() for each complete packet, including fixed header.
+ * packet is valid in callback only.
+ **/
+typedef void (*MQTT_PACKET_CALLBACK)(const unsigned char *packet, int size, void *context);
+
+/**
+ * State of streaming decoder, see MQTT_DecoderInit().
+ **/
+typedef struct {
+	unsigned char			*buf;		//packet being assembled
+	int						buf_size;
+	int						count;		//number of bytes in buf
+	int						state;
+	size_t					remaining;	//remaining length decoded so far, then bytes to come
+	int						shift;
+	size_t					skip;		//bytes left of packet longer than buf
+	unsigned long			dropped;	//packets longer than buf
+	MQTT_PACKET_CALLBACK	callback;
+	void					*context;
+} MQTT_DECODER;
 
 enum {
 	MQTT_MSG_TYPE_RESERVED,
@@ -73,13 +175,54 @@ int MQTT_DisconnectMessage(unsigned char *msg, int size);
 int MQTT_PublishMessage(unsigned char *msg, int size, int dup, int qos, int retain,
 						const char* topic, const char* message, int msg_id);
 
+int MQTT_PublishBinaryMessage(unsigned char *msg, int size, int dup, int qos, int retain,
+							  const char* topic, const unsigned char* payload, size_t payload_len,
+							  int msg_id);
+
+int MQTT_PublishVector(MQTT_IOVEC *iov, unsigned char *header, int size, int dup, int qos, int retain,
+					   const char* topic, const unsigned char* payload, size_t payload_len,
+					   int msg_id);
+
 int MQTT_SubscribeMessage(unsigned char *msg, int size, const char* topic);
 
 int MQTT_PingRequestMessage(unsigned char *msg, int size);
 
+int MQTT_PubAckMessage(unsigned char *msg, int size, int msg_id);
+
+int MQTT_PubRecMessage(unsigned char *msg, int size, int msg_id);
+
+int MQTT_PubRelMessage(unsigned char *msg, int size, int msg_id);
+
+int MQTT_PubCompMessage(unsigned char *msg, int size, int msg_id);
+
+int MQTT_ParseAck(const unsigned char *msg, int size, int *msg_id);
+
 int MQTT_ParsePublishMessage(unsigned char *msg, int size, char *topic, char *message);
 
+int MQTT_ParsePublishView(const unsigned char *msg, int size, MQTT_PUBLISH_VIEW *view);
+
 //-1 means not CONNACK, 0 means OK, else means FAILED
 int MQTT_CheckConnectAck(const unsigned char* msg);
 
+void MQTT_DecoderInit(MQTT_DECODER *dec, unsigned char *buf, int size,
+					  MQTT_PACKET_CALLBACK callback, void *context);
+
+void MQTT_DecoderReset(MQTT_DECODER *dec);
+
+int MQTT_DecoderFeed(MQTT_DECODER *dec, const unsigned char *data, int size);
+
+void MQTT_InflightInit(MQTT_INFLIGHT *inf, int window, int timeout, int max_retries,
+					   MQTT_SEND_FUNC send, MQTT_INFLIGHT_CALLBACK callback, void *context);
+
+int MQTT_InflightPublish(MQTT_INFLIGHT *inf, int qos, int retain, const char *topic,
+						 const unsigned char *payload, int payload_len, void *user, unsigned long now);
+
+int MQTT_InflightHandleAck(MQTT_INFLIGHT *inf, const unsigned char *msg, int size, unsigned long now);
+
+int MQTT_InflightPoll(MQTT_INFLIGHT *inf, unsigned long now);
+
+int MQTT_InflightResend(MQTT_INFLIGHT *inf, unsigned long now);
+
+int MQTT_InflightCount(const MQTT_INFLIGHT *inf);
+
 #endif
@@ -0,0 +1,512 @@
+/**
+  *********************************************************
+  * @file	MQTTSN.c
+  * @brief  MQTT-SN v1.2 message composer
+  * @ver	0.01
+  *********************************************************
+  ***************** Application Notes *********************
+  *********************************************************
+  * 1. Messages are sent over UDP, e.g. BC28_SendUdpSocket(), one message per datagram.
+  * 2. PUBLISH carries a 2-byte topic ID instead of topic name. Get it by REGISTER
+  *    and REGACK, or by SUBSCRIBE and SUBACK, or use predefined and short topics.
+  * 3. Gateway may send REGISTER for topics matched by wildcard subscription,
+  *    answer it by MQTTSN_RegAckMessage().
+  * 4. Sleeping client: MQTTSN_DisconnectMessage() with duration, then wake up by
+  *    MQTTSN_PingRequestMessage() with client ID to get buffered messages until
+  *    PINGRESP.
+  *********************************************************/
+
+#include <string.h>
+#include "MQTTSN.h"
+
+static unsigned char ComposeFlags(int dup_flag, int qos_level, int retain, int will,
+								  int clean_session, int topic_type)
+{
+	// QoS -1 is publish without connection
+	if(qos_level < 0)
+		qos_level = 3;
+
+	return (unsigned char)(((dup_flag & 1) << 7) | ((qos_level & 3) << 5) |
+		((retain & 1) << 4) | ((will & 1) << 3) | ((clean_session & 1) << 2) |
+		(topic_type & 3));
+}
+
+// Length is 1 byte, or 0x01 and 2 bytes if message is longer than 255 bytes.
+// Length is known before composing, so header is written once.
+static int ComposeHeader(unsigned char *msg, int size, int msg_type, int body_len)
+{
+	int len = body_len + 2;
+
+	if(len > 255)
+	{
+		len += 2;
+		if(len > 0xFFFF || len > size)
+			return 0;
+
+		msg[0] = 0x01;
+		msg[1] = (len >> 8);
+		msg[2] = (len & 0xFF);
+		msg[3] = (unsigned char)msg_type;
+		return 4;
+	}
+
+	if(len > size)
+		return 0;
+
+	msg[0] = (unsigned char)len;
+	msg[1] = (unsigned char)msg_type;
+	return 2;
+}
+
+// returns offset of body and message length, 0: invalid
+static int ParseHeader(const unsigned char *msg, int size, int *msg_len)
+{
+	int offset = 1, len;
+
+	if(msg == NULL || size < 2)
+		return 0;
+
+	len = msg[0];
+	if(len == 0x01)
+	{
+		if(size < 4)
+			return 0;
+
+		len = ((int)msg[1] << 8) + msg[2];
+		offset = 3;
+	}
+
+	if(len < offset + 1 || len > size)
+		return 0;
+
+	*msg_len = len;
+	return offset + 1;
+}
+
+static int ParseAck(const unsigned char *msg, int size, int msg_type, int *topic_id, int *msg_id)
+{
+	int len, offset = ParseHeader(msg, size, &len);
+
+	if(offset == 0 || msg[offset - 1] != msg_type || len < offset + 5)
+		return -1;
+
+	if(topic_id)
+		*topic_id = ((int)msg[offset] << 8) + msg[offset + 1];
+	if(msg_id)
+		*msg_id = ((int)msg[offset + 2] << 8) + msg[offset + 3];
+
+	return msg[offset + 4];
+}
+
+
+/**
+  * @brief  To get message type from message.
+  * @param  msg: pointer to message, size: number of received bytes
+  * @retval enum MQTTSN_MSG_TYPE, -1: invalid message
+  */
+int MQTTSN_GetMessageType(const unsigned char *msg, int size)
+{
+	int len, offset = ParseHeader(msg, size, &len);
+
+	if(offset == 0)
+		return -1;
+
+	return msg[offset - 1];
+}
+
+
+/**
+  * @brief  To get length of message, including length field.
+  * @param  msg: pointer to message, size: number of received bytes
+  * @retval number of bytes, 0: invalid message
+  */
+int MQTTSN_GetMessageLength(const unsigned char *msg, int size)
+{
+	int len = 0;
+
+	if(ParseHeader(msg, size, &len) == 0)
+		return 0;
+
+	return len;
+}
+
+
+/**
+  * @brief  To compose connect message, will is not supported.
+  * @param  msg: pointer to message, size: max number of bytes,
+  *			Client_ID: pointer to client ID, 1 ~ 23 characters,
+  *			keep_alive: keep alive period in seconds,
+  *			clean_session: 0 for disable, 1 for enable
+  * @retval number of bytes
+  */
+int MQTTSN_ConnectMessage(unsigned char *msg, int size, const char *Client_ID,
+						  int keep_alive, int clean_session)
+{
+	int count, len;
+
+	if(msg == NULL || Client_ID == NULL || Client_ID[0] == 0)
+		return 0;
+
+	len = strlen(Client_ID);
+	count = ComposeHeader(msg, size, MQTTSN_MSG_TYPE_CONNECT, 4 + len);
+	if(count == 0)
+		return 0;
+
+	msg[count++] = ComposeFlags(0, 0, 0, 0, clean_session, 0);
+
+	//protocol ID
+	msg[count++] = 0x01;
+
+	//duration
+	msg[count++] = (keep_alive >> 8);
+	msg[count++] = (keep_alive & 0xFF);
+
+	memcpy(&msg[count], Client_ID, len);
+	count += len;
+
+	return count;
+}
+
+
+/**
+  * @brief  To compose register message, get topic ID of topic name by REGACK.
+  * @param  msg: pointer to message, size: max number of bytes,
+  *			msg_id: message ID to match REGACK, topic: pointer to topic name
+  * @retval number of bytes
+  */
+int MQTTSN_RegisterMessage(unsigned char *msg, int size, int msg_id, const char *topic)
+{
+	int count, len;
+
+	if(msg == NULL || topic == NULL || topic[0] == 0)
+		return 0;
+
+	len = strlen(topic);
+	count = ComposeHeader(msg, size, MQTTSN_MSG_TYPE_REGISTER, 4 + len);
+	if(count == 0)
+		return 0;
+
+	//topic ID is 0 when sent by client
+	msg[count++] = 0;
+	msg[count++] = 0;
+
+	msg[count++] = (msg_id >> 8);
+	msg[count++] = (msg_id & 0xFF);
+
+	memcpy(&msg[count], topic, len);
+	count += len;
+
+	return count;
+}
+
+
+/**
+  * @brief  To compose REGACK message to answer REGISTER of gateway.
+  * @param  msg: pointer to message, size: max number of bytes,
+  *			topic_id, msg_id: from REGISTER, return_code: enum MQTTSN_RC
+  * @retval number of bytes
+  */
+int MQTTSN_RegAckMessage(unsigned char *msg, int size, int topic_id, int msg_id, int return_code)
+{
+	int count;
+
+	if(msg == NULL || (count = ComposeHeader(msg, size, MQTTSN_MSG_TYPE_REGACK, 5)) == 0)
+		return 0;
+
+	msg[count++] = (topic_id >> 8);
+	msg[count++] = (topic_id & 0xFF);
+	msg[count++] = (msg_id >> 8);
+	msg[count++] = (msg_id & 0xFF);
+	msg[count++] = (unsigned char)return_code;
+
+	return count;
+}
+
+
+/**
+  * @brief  To compose publish message.
+  * @param  msg: pointer to message, size: max number of bytes,
+  *			dup: flag of re-deliver, qos: enum MQTT_QOS or -1 without connection,
+  *			retain: flag of RETAIN, topic_type: enum MQTTSN_TOPIC_TYPE,
+  *			topic_id: topic ID, or 2 characters of short topic, e.g. ('a' << 8) | 'b',
+  *			msg_id: message ID for QoS 1 and 2, otherwise 0,
+  *			data: pointer to data, data_len: number of bytes, binary is allowed
+  * @retval number of bytes
+  */
+int MQTTSN_PublishMessage(unsigned char *msg, int size, int dup, int qos, int retain,
+						  int topic_type, int topic_id, int msg_id,
+						  const unsigned char *data, int data_len)
+{
+	int count;
+
+	if(msg == NULL || data_len < 0 || (data == NULL && data_len > 0))
+		return 0;
+
+	count = ComposeHeader(msg, size, MQTTSN_MSG_TYPE_PUBLISH, 5 + data_len);
+	if(count == 0)
+		return 0;
+
+	msg[count++] = ComposeFlags(dup, qos, retain, 0, 0, topic_type);
+
+	msg[count++] = (topic_id >> 8);
+	msg[count++] = (topic_id & 0xFF);
+
+	if(qos <= 0)
+		msg_id = 0;
+	msg[count++] = (msg_id >> 8);
+	msg[count++] = (msg_id & 0xFF);
+
+	if(data_len > 0)
+	{
+		memcpy(&msg[count], data, data_len);
+		count += data_len;
+	}
+
+	return count;
+}
+
+
+/**
+  * @brief  To compose PUBACK message for received QoS 1 PUBLISH, or to reject it.
+  * @param  msg: pointer to message, size: max number of bytes,
+  *			topic_id, msg_id: from PUBLISH, return_code: enum MQTTSN_RC
+  * @retval number of bytes
+  */
+int MQTTSN_PubAckMessage(unsigned char *msg, int size, int topic_id, int msg_id, int return_code)
+{
+	int count;
+
+	if(msg == NULL || (count = ComposeHeader(msg, size, MQTTSN_MSG_TYPE_PUBACK, 5)) == 0)
+		return 0;
+
+	msg[count++] = (topic_id >> 8);
+	msg[count++] = (topic_id & 0xFF);
+	msg[count++] = (msg_id >> 8);
+	msg[count++] = (msg_id & 0xFF);
+	msg[count++] = (unsigned char)return_code;
+
+	return count;
+}
+
+
+/**
+  * @brief  To compose subscribe message by topic name, topic ID is given by SUBACK.
+  * @param  msg: pointer to message, size: max number of bytes,
+  *			qos: enum MQTT_QOS, msg_id: message ID to match SUBACK,
+  *			topic: pointer to topic name, wildcards are allowed
+  * @retval number of bytes
+  */
+int MQTTSN_SubscribeMessage(unsigned char *msg, int size, int qos, int msg_id, const char *topic)
+{
+	int count, len;
+
+	if(msg == NULL || topic == NULL || topic[0] == 0)
+		return 0;
+
+	len = strlen(topic);
+	count = ComposeHeader(msg, size, MQTTSN_MSG_TYPE_SUBSCRIBE, 3 + len);
+	if(count == 0)
+		return 0;
+
+	// topic of 2 characters is short topic
+	msg[count++] = ComposeFlags(0, qos, 0, 0, 0,
+		(len == 2) ? MQTTSN_TOPIC_TYPE_SHORT : MQTTSN_TOPIC_TYPE_NORMAL);
+
+	msg[count++] = (msg_id >> 8);
+	msg[count++] = (msg_id & 0xFF);
+
+	memcpy(&msg[count], topic, len);
+	count += len;
+
+	return count;
+}
+
+
+/**
+  * @brief  To compose ping request message.
+  * @param  msg: pointer to message, size: max number of bytes,
+  *			Client_ID: NULL for keep alive, client ID to wake up sleeping client
+  * @retval number of bytes
+  */
+int MQTTSN_PingRequestMessage(unsigned char *msg, int size, const char *Client_ID)
+{
+	int count, len = 0;
+
+	if(msg == NULL)
+		return 0;
+
+	if(Client_ID != NULL)
+		len = strlen(Client_ID);
+
+	count = ComposeHeader(msg, size, MQTTSN_MSG_TYPE_PINGREQ, len);
+	if(count == 0)
+		return 0;
+
+	if(len > 0)
+	{
+		memcpy(&msg[count], Client_ID, len);
+		count += len;
+	}
+
+	return count;
+}
+
+
+/**
+  * @brief  To compose disconnect message.
+  * @param  msg: pointer to message, size: max number of bytes,
+  *			duration: 0 to disconnect, sleeping time in seconds to enter sleep state
+  * @retval number of bytes
+  */
+int MQTTSN_DisconnectMessage(unsigned char *msg, int size, int duration)
+{
+	int count;
+
+	if(msg == NULL)
+		return 0;
+
+	count = ComposeHeader(msg, size, MQTTSN_MSG_TYPE_DISCONNECT, (duration > 0) ? 2 : 0);
+	if(count == 0)
+		return 0;
+
+	if(duration > 0)
+	{
+		msg[count++] = (duration >> 8);
+		msg[count++] = (duration & 0xFF);
+	}
+
+	return count;
+}
+
+
+/**
+  * @brief  To check CONNACK message.
+  * @param  msg: pointer to message, size: number of received bytes
+  * @retval -1: not CONNACK, others: enum MQTTSN_RC
+  */
+int MQTTSN_CheckConnectAck(const unsigned char *msg, int size)
+{
+	int len, offset = ParseHeader(msg, size, &len);
+
+	if(offset == 0 || msg[offset - 1] != MQTTSN_MSG_TYPE_CONNACK || len < offset + 1)
+		return -1;
+
+	return msg[offset];
+}
+
+
+/**
+  * @brief  To parse REGACK message.
+  * @param  msg: pointer to message, size: number of received bytes,
+  *			topic_id: to receive topic ID, msg_id: to receive message ID
+  * @retval -1: not REGACK, others: enum MQTTSN_RC
+  */
+int MQTTSN_ParseRegAck(const unsigned char *msg, int size, int *topic_id, int *msg_id)
+{
+	return ParseAck(msg, size, MQTTSN_MSG_TYPE_REGACK, topic_id, msg_id);
+}
+
+
+/**
+  * @brief  To parse REGISTER message of gateway.
+  * @param  msg: pointer to message, size: number of received bytes,
+  *			topic_id: to receive topic ID, msg_id: to receive message ID,
+  *			topic: buffer of topic name, NULL to ignore, topic_size: size of buffer
+  * @retval 1: OK, 0: not REGISTER or topic is too long
+  */
+int MQTTSN_ParseRegister(const unsigned char *msg, int size, int *topic_id, int *msg_id,
+						 char *topic, int topic_size)
+{
+	int len, offset = ParseHeader(msg, size, &len);
+
+	if(offset == 0 || msg[offset - 1] != MQTTSN_MSG_TYPE_REGISTER || len < offset + 4)
+		return 0;
+
+	if(topic != NULL)
+	{
+		int topic_len = len - offset - 4;
+
+		if(topic_len >= topic_size)
+			return 0;
+
+		memcpy(topic, &msg[offset + 4], topic_len);
+		topic[topic_len] = 0;
+	}
+
+	if(topic_id)
+		*topic_id = ((int)msg[offset] << 8) + msg[offset + 1];
+	if(msg_id)
+		*msg_id = ((int)msg[offset + 2] << 8) + msg[offset + 3];
+
+	return 1;
+}
+
+
+/**
+  * @brief  To parse publish message received, data is not copied.
+  * @param  msg: pointer to message, size: number of received bytes,
+  *			qos: to receive QoS, topic_type: to receive enum MQTTSN_TOPIC_TYPE,
+  *			topic_id: to receive topic ID, msg_id: to receive message ID,
+  *			data: to receive pointer to data in msg
+  * @retval number of bytes of data, -1: not publish message
+  */
+int MQTTSN_ParsePublishMessage(const unsigned char *msg, int size, int *qos, int *topic_type,
+							   int *topic_id, int *msg_id, const unsigned char **data)
+{
+	int len, offset = ParseHeader(msg, size, &len);
+	unsigned char flags;
+
+	if(offset == 0 || msg[offset - 1] != MQTTSN_MSG_TYPE_PUBLISH || len < offset + 5)
+		return -1;
+
+	flags = msg[offset];
+	if(qos)
+		*qos = ((flags >> 5) & 3) == 3 ? -1 : ((flags >> 5) & 3);
+	if(topic_type)
+		*topic_type = (flags & 3);
+	if(topic_id)
+		*topic_id = ((int)msg[offset + 1] << 8) + msg[offset + 2];
+	if(msg_id)
+		*msg_id = ((int)msg[offset + 3] << 8) + msg[offset + 4];
+	if(data)
+		*data = &msg[offset + 5];
+
+	return len - offset - 5;
+}
+
+
+/**
+  * @brief  To parse PUBACK message.
+  * @param  msg: pointer to message, size: number of received bytes,
+  *			topic_id: to receive topic ID, msg_id: to receive message ID
+  * @retval -1: not PUBACK, others: enum MQTTSN_RC
+  */
+int MQTTSN_ParsePubAck(const unsigned char *msg, int size, int *topic_id, int *msg_id)
+{
+	return ParseAck(msg, size, MQTTSN_MSG_TYPE_PUBACK, topic_id, msg_id);
+}
+
+
+/**
+  * @brief  To parse SUBACK message.
+  * @param  msg: pointer to message, size: number of received bytes,
+  *			qos: to receive granted QoS, topic_id: to receive topic ID,
+  *			msg_id: to receive message ID
+  * @retval -1: not SUBACK, others: enum MQTTSN_RC
+  */
+int MQTTSN_ParseSubAck(const unsigned char *msg, int size, int *qos, int *topic_id, int *msg_id)
+{
+	int len, offset = ParseHeader(msg, size, &len);
+
+	if(offset == 0 || msg[offset - 1] != MQTTSN_MSG_TYPE_SUBACK || len < offset + 6)
+		return -1;
+
+	if(qos)
+		*qos = ((msg[offset] >> 5) & 3);
+	if(topic_id)
+		*topic_id = ((int)msg[offset + 1] << 8) + msg[offset + 2];
+	if(msg_id)
+		*msg_id = ((int)msg[offset + 3] << 8) + msg[offset + 4];
+
+	return msg[offset + 5];
+}
@@ -0,0 +1,102 @@
+/**
+  *********************************************************
+  * @file	MQTTSN.h
+  * @brief  MQTT-SN v1.2 message composer include file
+  * @ver	0.01
+  *********************************************************
+  *
+  */
+
+#ifndef _MQTTSN_H_
+#define _MQTTSN_H_
+
+#define DEFAULT_MQTTSN_GATEWAY_PORT	"1884"
+
+#define MQTTSN_MSG_SIZE_CONNACK		3
+#define MQTTSN_MSG_SIZE_REGACK		7
+#define MQTTSN_MSG_SIZE_PUBACK		7
+#define MQTTSN_MSG_SIZE_SUBACK		8
+#define MQTTSN_MSG_SIZE_PINGRESP	2
+#define MQTTSN_MAX_HEADER_SIZE		7		//length, type, flags, topic ID, message ID of PUBLISH
+
+enum {
+	MQTTSN_MSG_TYPE_ADVERTISE = 0x00,
+	MQTTSN_MSG_TYPE_SEARCHGW = 0x01,
+	MQTTSN_MSG_TYPE_GWINFO = 0x02,
+	MQTTSN_MSG_TYPE_CONNECT = 0x04,
+	MQTTSN_MSG_TYPE_CONNACK = 0x05,
+	MQTTSN_MSG_TYPE_WILLTOPICREQ = 0x06,
+	MQTTSN_MSG_TYPE_WILLTOPIC = 0x07,
+	MQTTSN_MSG_TYPE_WILLMSGREQ = 0x08,
+	MQTTSN_MSG_TYPE_WILLMSG = 0x09,
+	MQTTSN_MSG_TYPE_REGISTER = 0x0A,
+	MQTTSN_MSG_TYPE_REGACK = 0x0B,
+	MQTTSN_MSG_TYPE_PUBLISH = 0x0C,
+	MQTTSN_MSG_TYPE_PUBACK = 0x0D,
+	MQTTSN_MSG_TYPE_PUBCOMP = 0x0E,
+	MQTTSN_MSG_TYPE_PUBREC = 0x0F,
+	MQTTSN_MSG_TYPE_PUBREL = 0x10,
+	MQTTSN_MSG_TYPE_SUBSCRIBE = 0x12,
+	MQTTSN_MSG_TYPE_SUBACK = 0x13,
+	MQTTSN_MSG_TYPE_UNSUBSCRIBE = 0x14,
+	MQTTSN_MSG_TYPE_UNSUBACK = 0x15,
+	MQTTSN_MSG_TYPE_PINGREQ = 0x16,
+	MQTTSN_MSG_TYPE_PINGRESP = 0x17,
+	MQTTSN_MSG_TYPE_DISCONNECT = 0x18
+};
+
+/**
+ * TopicIdType of flags.
+ **/
+enum {
+	MQTTSN_TOPIC_TYPE_NORMAL,		//topic ID given by REGISTER/REGACK or SUBACK
+	MQTTSN_TOPIC_TYPE_PREDEFINED,	//topic ID known by client and gateway
+	MQTTSN_TOPIC_TYPE_SHORT			//topic name of 2 characters in topic ID
+};
+
+enum {
+	MQTTSN_RC_ACCEPTED,
+	MQTTSN_RC_REJECTED_CONGESTION,
+	MQTTSN_RC_REJECTED_INVALID_TOPIC_ID,
+	MQTTSN_RC_REJECTED_NOT_SUPPORTED
+};
+
+int MQTTSN_GetMessageType(const unsigned char *msg, int size);
+
+int MQTTSN_GetMessageLength(const unsigned char *msg, int size);
+
+int MQTTSN_ConnectMessage(unsigned char *msg, int size, const char *Client_ID,
+						  int keep_alive, int clean_session);
+
+int MQTTSN_RegisterMessage(unsigned char *msg, int size, int msg_id, const char *topic);
+
+int MQTTSN_RegAckMessage(unsigned char *msg, int size, int topic_id, int msg_id, int return_code);
+
+int MQTTSN_PublishMessage(unsigned char *msg, int size, int dup, int qos, int retain,
+						  int topic_type, int topic_id, int msg_id,
+						  const unsigned char *data, int data_len);
+
+int MQTTSN_PubAckMessage(unsigned char *msg, int size, int topic_id, int msg_id, int return_code);
+
+int MQTTSN_SubscribeMessage(unsigned char *msg, int size, int qos, int msg_id, const char *topic);
+
+int MQTTSN_PingRequestMessage(unsigned char *msg, int size, const char *Client_ID);
+
+int MQTTSN_DisconnectMessage(unsigned char *msg, int size, int duration);
+
+//-1 means not CONNACK, others are enum MQTTSN_RC
+int MQTTSN_CheckConnectAck(const unsigned char *msg, int size);
+
+int MQTTSN_ParseRegAck(const unsigned char *msg, int size, int *topic_id, int *msg_id);
+
+int MQTTSN_ParseRegister(const unsigned char *msg, int size, int *topic_id, int *msg_id,
+						 char *topic, int topic_size);
+
+int MQTTSN_ParsePublishMessage(const unsigned char *msg, int size, int *qos, int *topic_type,
+							   int *topic_id, int *msg_id, const unsigned char **data);
+
+int MQTTSN_ParsePubAck(const unsigned char *msg, int size, int *topic_id, int *msg_id);
+
+int MQTTSN_ParseSubAck(const unsigned char *msg, int size, int *qos, int *topic_id, int *msg_id);
+
+#endif
@@ -1,12 +1,17 @@
 /******** Notes for sample code **************
  * 1. MUST implement BC28 wrapper functions.
- * 2. Call BC28_PushReceivedByte() in ReceiveThread() to handle received data via UART.
+ * 2. Call BC28_PushReceivedBytes() in ReceiveThread() to handle received data via UART.
  * 3. Call BC28_Init() in OnBnClickedButtonOpen() after UART is ready.
  * 4. Sample code to send AT command in OnBnClickedButtonSendAt().
  * 5. Sample code to connect MQTT broker in OnBnClickedButtonConnectMqtt().
  * 6. Sample code to publish message in OnBnClickedButtonPublish().
  * 7. Sample code to subscribe topic in OnBnClickedButtonSubscribe().
- * 8. Need to call BC28_SetSocketListener() after subscribing successfully to handle incoming messages.
+ * 8. MqttSocketListener() feeds received data to MQTT decoder, which passes complete packets
+ *    to OnMqttPacket() no matter how they are split or merged by TCP.
+ * 9. Messages are published with QoS 1 by MQTT in-flight engine, which retransmits them
+ *    until PUBACK in KeepAliveThread().
+ * 10. Packets composed under g_csMqtt are queued in outbox and sent by FlushMqttOutbox()
+ *    after the lock is released, BC28_WriteTcpSocket() may block for seconds.
  *********************************************/
 
 #include "stdafx.h"
@@ -19,8 +24,43 @@
 #define new DEBUG_NEW
 #endif
 
+#define MQTT_OUTBOX_NUM		8		//packets waiting to be sent
+#define MQTT_OUTBOX_SIZE	1024	//max bytes of one packet
+
 CSimWRL8500Dlg *g_pInstDlg = NULL;
 
+// kept to connect MQTT again after recovery
+static BYTE g_connectMsg[1024];
+static int g_connectMsgSize = 0;
+
+// received packets are assembled by decoder, acknowledgements are passed to waiter
+static MQTT_DECODER g_mqttDecoder;
+static BYTE g_mqttPacket[1024];
+static CRITICAL_SECTION g_csMqtt;
+static HANDLE g_hMqttAck = NULL;
+static BYTE g_mqttAck[8];
+
+// unacknowledged QoS 1/2 messages, protected by g_csMqtt
+static MQTT_INFLIGHT g_mqttInflight;
+
+// packets to send, protected by g_csMqtt, only one thread sends at a time
+typedef struct {
+	BYTE	data[MQTT_OUTBOX_SIZE];
+	int		size;
+} MQTT_OUTBOX_PACKET;
+
+static MQTT_OUTBOX_PACKET g_mqttOutbox[MQTT_OUTBOX_NUM];
+static int g_mqttOutboxHead = 0;
+static int g_mqttOutboxCount = 0;
+static BOOL g_flagMqttSending = FALSE;
+
+static void OnMqttPacket(const unsigned char *packet, int size, void *context);
+static int SendMqttPacket(const MQTT_IOVEC *iov, int iov_num, void *context);
+static void FlushMqttOutbox(void);
+static void OnMqttDelivered(int msg_id, int status, void *user);
+static void MqttSocketListener(int socket, int size);
+static int WaitMqttAck(int type, int timeout);
+
 /**
   * BC28 wrapper functions
   */
@@ -81,6 +121,29 @@ void BC28_Wrap_PostTask(BC28_TASK task, int param1, int param2)
 	::AfxBeginThread((AFX_THREADPROC)BC28TaskThread, paramBC28Task);
 }
 
+static HANDLE hBC28Event[BC28_EVENT_NUM] = {NULL};
+static CRITICAL_SECTION csBC28;
+
+int BC28_Wrap_WaitEvent(int event, int ms)
+{
+	return (::WaitForSingleObject(hBC28Event[event], ms) == WAIT_OBJECT_0) ? 1 : 0;
+}
+
+void BC28_Wrap_SetEvent(int event)
+{
+	::SetEvent(hBC28Event[event]);
+}
+
+void BC28_Wrap_Lock(void)
+{
+	::EnterCriticalSection(&csBC28);
+}
+
+void BC28_Wrap_Unlock(void)
+{
+	::LeaveCriticalSection(&csBC28);
+}
+
 
 
 // CAboutDlg dialog used for App About
@@ -239,6 +302,18 @@ BOOL CSimWRL8500Dlg::OnInitDialog()
 	// TODO: Add extra initialization here
 	g_pInstDlg = this;
 
+	::InitializeCriticalSection(&csBC28);
+	::InitializeCriticalSection(&g_csMqtt);
+	g_hMqttAck = ::CreateEvent(NULL, FALSE, FALSE, NULL);	//auto-reset
+	MQTT_DecoderInit(&g_mqttDecoder, g_mqttPacket, sizeof(g_mqttPacket), OnMqttPacket, NULL);
+	MQTT_InflightInit(&g_mqttInflight, 4, 10000, 3, SendMqttPacket, OnMqttDelivered, NULL);
+
+	for(int i=0; i<BC28_EVENT_NUM; i++)
+	{
+		if(hBC28Event[i] == NULL)
+			hBC28Event[i] = ::CreateEvent(NULL, FALSE, FALSE, NULL);	//auto-reset
+	}
+
 	DetectCOMPort();
 
 	m_hComm = INVALID_HANDLE_VALUE;
@@ -375,12 +450,12 @@ UINT ReceiveThread(PVOID arg)
 
 	while(pDlg->m_flagConnectComm)
 	{
-		BYTE b;
+		BYTE buf[4096];
 		DWORD num = 0;
 
-		while(pDlg->m_flagConnectComm && ReadFile(pDlg->m_hComm, &b, 1, &num, NULL) && num > 0)
+		while(pDlg->m_flagConnectComm && ReadFile(pDlg->m_hComm, buf, sizeof(buf), &num, NULL) && num > 0)
 		{
-			pDlg->PushReceivedByte(b);
+			BC28_PushReceivedBytes(buf, (int)num);
 		}
 
 		Sleep(10);
@@ -602,27 +677,46 @@ UINT KeepAliveThread(PVOID arg)
 		{
 			BYTE buf[64];
 			int len = MQTT_PingRequestMessage(buf, 64);
+			int alive = 0;
+
 			if(BC28_WriteTcpSocket(pDlg->m_hSocket, buf, len) > 0)
 			{
 				pDlg->m_lastConnectTick = ::GetTickCount();
 
 				//wait ack
-				int times = 5000/500;
-				int count = 0;
-				while(count < 2 && times--)
-				{
-					::Sleep(500);
-					count += BC28_ReadTcpSocket(pDlg->m_hSocket, &buf[count], 2 - count);
-				}
+				alive = WaitMqttAck(MQTT_MSG_TYPE_PINGRESP, 5000);
+			}
 
-				if(!(count > 0 && MQTT_GetMessageType(buf) == MQTT_MSG_TYPE_PINGRESP))
+			if(!alive)
+			{
+				//no response, recover connection and connect MQTT again
+				pDlg->m_hSocket = BC28_RecoverTcpSocket(pDlg->m_hSocket, pDlg->m_serverIP, pDlg->m_serverPort);
+				if(pDlg->m_hSocket != -1)
 				{
-					//no response, need to reconnect
-
+					::EnterCriticalSection(&g_csMqtt);
+					MQTT_DecoderReset(&g_mqttDecoder);
+					::LeaveCriticalSection(&g_csMqtt);
+
+					BC28_SetTcpSocketListener(pDlg->m_hSocket, MqttSocketListener);
+					BC28_WriteTcpSocket(pDlg->m_hSocket, g_connectMsg, g_connectMsgSize);
+
+					//messages not acknowledged by the lost connection, session is kept by broker
+					::EnterCriticalSection(&g_csMqtt);
+					MQTT_InflightResend(&g_mqttInflight, ::GetTickCount());
+					::LeaveCriticalSection(&g_csMqtt);
+					FlushMqttOutbox();
 				}
+
+				pDlg->m_lastConnectTick = ::GetTickCount();
 			}
 		}
 
+		//retransmit QoS 1/2 messages without acknowledgement
+		::EnterCriticalSection(&g_csMqtt);
+		MQTT_InflightPoll(&g_mqttInflight, ::GetTickCount());
+		::LeaveCriticalSection(&g_csMqtt);
+		FlushMqttOutbox();
+
 		::Sleep(500);
 	}
 
@@ -820,30 +914,29 @@ UINT ConnectMqttThread(PVOID arg)
 	strcpy(pDlg->m_serverIP, ip);
 	strcpy(pDlg->m_serverPort, port);
 
-	//compose message
-	BYTE connect_msg[1024];
-	int msg_size = MQTT_ConnectMessage(connect_msg, 1024, ip, port, client_id, user_name, passwd, 30, 60, 1);
+	//compose message, session is kept so that messages not acknowledged are resent after recovery
+	BYTE *connect_msg = g_connectMsg;
+	int msg_size = MQTT_ConnectMessage(connect_msg, 1024, ip, port, client_id, user_name, passwd, 30, 60, 0);
+	g_connectMsgSize = msg_size;
 
-	//open tcp socket
-	if((pDlg->m_hSocket = BC28_OpenTcpSocket(ip, port)) == -1)
+	//open tcp socket, recover from cheap steps to reboot
+	if((pDlg->m_hSocket = BC28_OpenTcpSocket(ip, port)) == -1 &&
+		(pDlg->m_hSocket = BC28_RecoverTcpSocket(-1, ip, port)) == -1)
 	{
-		BC28_Reboot();
 		goto flagConnectFailed;
 	}
 
+	//received packets are handled by decoder
+	::EnterCriticalSection(&g_csMqtt);
+	MQTT_DecoderReset(&g_mqttDecoder);
+	::LeaveCriticalSection(&g_csMqtt);
+	BC28_SetTcpSocketListener(pDlg->m_hSocket, MqttSocketListener);
+
 	//connect MQTT
 	if(BC28_WriteTcpSocket(pDlg->m_hSocket, connect_msg, msg_size) > 0)
 	{
-		BYTE buf[8];
-		int count = 0, times = 10000/200;
-
-		while(count < MQTT_MSG_SIZE_CONNACK && times--)
-		{
-			::Sleep(200);
-			count += BC28_ReadTcpSocket(pDlg->m_hSocket, &buf[count], MQTT_MSG_SIZE_CONNACK - count);
-		}
-
-		if(count > 2 && MQTT_CheckConnectAck(buf) != MQTT_CONNACK_ACCEPTED)
+		if(!WaitMqttAck(MQTT_MSG_TYPE_CONNACK, 10000) ||
+			MQTT_CheckConnectAck(g_mqttAck) != MQTT_CONNACK_ACCEPTED)
 		{
 			goto flagConnectFailed;
 		}
@@ -948,14 +1041,22 @@ void CSimWRL8500Dlg::OnBnClickedButtonPublish()
 		msg[num] = 0;
 	}
 
-	BYTE buf[1024];
-	int len = MQTT_PublishMessage(buf, 1024, 0, 0, 0, topic, msg, 0);
-	if(BC28_WriteTcpSocket(m_hSocket, buf, len) > 0)
-	{
+	// message is kept until PUBACK, freed in OnMqttDelivered()
+	int len = strlen(msg);
+	BYTE *payload = new BYTE[len + 1];
+	int msg_id;
 
-	}
-	else
+	memcpy(payload, msg, len);
+
+	::EnterCriticalSection(&g_csMqtt);
+	msg_id = MQTT_InflightPublish(&g_mqttInflight, MQTT_QOS_AT_LEAST_ONCE, 0, topic,
+		payload, len, payload, ::GetTickCount());
+	::LeaveCriticalSection(&g_csMqtt);
+	FlushMqttOutbox();
+
+	if(msg_id == 0)
 	{
+		delete [] payload;
 		::AfxMessageBox(_T("Failed to Publish!"));
 	}
 }
@@ -1061,42 +1162,187 @@ void CSimWRL8500Dlg::CloseMQTT(void)
 	m_flagConnectMQTT = 0;
 }
 
-void MqttSubscribeLisetner(int socket, int size)
+// Called for each complete packet assembled by decoder.
+static void OnMqttPacket(const unsigned char *packet, int size, void *context)
 {
-	BYTE msg[1024];
-	int count = 0, times = 10000/200;
+	int type = MQTT_GetMessageType((unsigned char*)packet);
 
-	while(count < size && times--)
+	if(type == MQTT_MSG_TYPE_PUBLISH)
 	{
-		::Sleep(200);
-		count += BC28_ReadTcpSocket(socket, &msg[count], size - count);
-	}
+		MQTT_PUBLISH_VIEW view;
 
-	if(count > 2)
+		//topic and message point into packet, no copy
+		if(MQTT_ParsePublishView(packet, size, &view))
+		{
+			BYTE ack[MQTT_MSG_SIZE_PUBACK];
+			MQTT_IOVEC iov;
+
+			g_pInstDlg->AddStringToDebugList(CString((LPCSTR)view.topic, view.topic_len));
+			g_pInstDlg->AddStringToDebugList(CString((LPCSTR)view.payload, view.payload_len));
+
+			//acknowledge QoS 1/2
+			iov.data = ack;
+			iov.size = 0;
+			if(view.qos == MQTT_QOS_AT_LEAST_ONCE)
+				iov.size = MQTT_PubAckMessage(ack, sizeof(ack), view.msg_id);
+			else if(view.qos == MQTT_QOS_EXACTLY_ONCE)
+				iov.size = MQTT_PubRecMessage(ack, sizeof(ack), view.msg_id);
+
+			if(iov.size > 0)
+				SendMqttPacket(&iov, 1, NULL);
+		}
+	}
+	else if(type == MQTT_MSG_TYPE_PUBREL)
 	{
-		char topic[1024];
-		char message[1024];
+		BYTE ack[MQTT_MSG_SIZE_PUBACK];
+		MQTT_IOVEC iov;
+		int msg_id;
 
-		if(MQTT_ParsePublishMessage(msg, size, topic, message))
+		//end of QoS 2 message received
+		if(MQTT_ParseAck(packet, size, &msg_id) == MQTT_MSG_TYPE_PUBREL)
 		{
-			CString szMsg;
-			TCHAR temp[1024];
+			iov.data = ack;
+			iov.size = MQTT_PubCompMessage(ack, sizeof(ack), msg_id);
+			SendMqttPacket(&iov, 1, NULL);
+		}
+	}
+	else if(type >= MQTT_MSG_TYPE_PUBACK && type <= MQTT_MSG_TYPE_PUBCOMP)
+	{
+		//PUBACK, PUBREC, PUBCOMP of published messages
+		MQTT_InflightHandleAck(&g_mqttInflight, packet, size, ::GetTickCount());
+	}
+	else if(size <= (int)sizeof(g_mqttAck))
+	{
+		//CONNACK, SUBACK, PINGRESP, ...
+		memcpy(g_mqttAck, packet, size);
+		::SetEvent(g_hMqttAck);
+	}
+}
 
-			for(count=0; count<strlen(topic); count++)
-				temp[count] = topic[count];
+// Send function of in-flight engine and acknowledgements, called with g_csMqtt.
+// Packet is copied to outbox, payload may be freed by PUBACK before it is sent.
+static int SendMqttPacket(const MQTT_IOVEC *iov, int iov_num, void *context)
+{
+	MQTT_OUTBOX_PACKET *packet;
+	int i, total = 0;
 
-			temp[count] = 0;
-			szMsg = CString(temp);
-			g_pInstDlg->AddStringToDebugList(szMsg);
+	::EnterCriticalSection(&g_csMqtt);
 
-			for(count=0; count<strlen(message); count++)
-				temp[count] = message[count];
+	for(i=0; i<iov_num; i++)
+		total += iov[i].size;
 
-			temp[count] = 0;
-			szMsg = CString(temp);
-			g_pInstDlg->AddStringToDebugList(szMsg);
-		}
+	//not queued is retransmitted by MQTT_InflightPoll()
+	if(g_mqttOutboxCount >= MQTT_OUTBOX_NUM || total > MQTT_OUTBOX_SIZE)
+	{
+		::LeaveCriticalSection(&g_csMqtt);
+		return 0;
+	}
+
+	packet = &g_mqttOutbox[(g_mqttOutboxHead + g_mqttOutboxCount) % MQTT_OUTBOX_NUM];
+	packet->size = 0;
+	for(i=0; i<iov_num; i++)
+	{
+		memcpy(&packet->data[packet->size], iov[i].data, iov[i].size);
+		packet->size += iov[i].size;
+	}
+	g_mqttOutboxCount++;
+
+	::LeaveCriticalSection(&g_csMqtt);
+
+	return 1;
+}
+
+// Send packets in outbox without holding g_csMqtt, call it after leaving the lock.
+static void FlushMqttOutbox(void)
+{
+	::EnterCriticalSection(&g_csMqtt);
+
+	//the thread sending now takes packets queued meanwhile
+	if(g_flagMqttSending)
+	{
+		::LeaveCriticalSection(&g_csMqtt);
+		return;
+	}
+	g_flagMqttSending = TRUE;
+
+	while(g_mqttOutboxCount > 0)
+	{
+		//head is not reused until it is removed
+		MQTT_OUTBOX_PACKET *packet = &g_mqttOutbox[g_mqttOutboxHead];
+
+		::LeaveCriticalSection(&g_csMqtt);
+
+		BC28_WriteTcpSocket(g_pInstDlg->m_hSocket, packet->data, packet->size);
+
+		::EnterCriticalSection(&g_csMqtt);
+		g_mqttOutboxHead = (g_mqttOutboxHead + 1) % MQTT_OUTBOX_NUM;
+		g_mqttOutboxCount--;
+	}
+
+	g_flagMqttSending = FALSE;
+
+	::LeaveCriticalSection(&g_csMqtt);
+}
+
+// Called by in-flight engine when message is acknowledged or given up.
+static void OnMqttDelivered(int msg_id, int status, void *user)
+{
+	delete [] (BYTE*)user;
+
+	if(!status)
+	{
+		CString szMsg;
+
+		szMsg.Format(_T("Message %d is not delivered!"), msg_id);
+		g_pInstDlg->AddStringToDebugList(szMsg);
+	}
+}
+
+// Read what +NSONMI notified and feed it to decoder in order.
+static void MqttSocketListener(int socket, int size)
+{
+	BYTE buf[256];
+	int count = 0, times = 10000/50;
+
+	//socket closed
+	if(size < 0)
+		return;
+
+	while(count < size && times--)
+	{
+		int num;
+
+		::EnterCriticalSection(&g_csMqtt);
+		num = BC28_ReadTcpSocket(socket, buf, sizeof(buf));
+		if(num > 0)
+			MQTT_DecoderFeed(&g_mqttDecoder, buf, num);
+		::LeaveCriticalSection(&g_csMqtt);
+
+		//acknowledgements composed by OnMqttPacket()
+		FlushMqttOutbox();
+
+		if(num > 0)
+			count += num;
+		else
+			::Sleep(50);
+	}
+}
+
+// Wait for acknowledgement of type, it is in g_mqttAck.
+static int WaitMqttAck(int type, int timeout)
+{
+	DWORD start = ::GetTickCount();
+
+	while(::GetTickCount() - start < (DWORD)timeout)
+	{
+		if(::WaitForSingleObject(g_hMqttAck, timeout - (::GetTickCount() - start)) != WAIT_OBJECT_0)
+			break;
+
+		if(MQTT_GetMessageType(g_mqttAck) == type)
+			return 1;
 	}
+
+	return 0;
 }
 
 void CSimWRL8500Dlg::OnBnClickedButtonSubscribe()
@@ -1133,21 +1379,10 @@ void CSimWRL8500Dlg::OnBnClickedButtonSubscribe()
 	int len = MQTT_SubscribeMessage(buf, 512, topic);
 	if(BC28_WriteTcpSocket(m_hSocket, buf, len) > 0)
 	{
-		//wait ack
-		int times = 5000/500;
-		int count = 0;
-		while(count < MQTT_MSG_SIZE_SUBACK && times--)
+		//wait ack, incoming messages are handled by MqttSocketListener()
+		if(!WaitMqttAck(MQTT_MSG_TYPE_SUBACK, 5000))
 		{
-			::Sleep(500);
-			count += BC28_ReadTcpSocket(m_hSocket, &buf[count], MQTT_MSG_SIZE_SUBACK - count);
-		}
-
-		if(count > 2)
-		{
-			if(MQTT_GetMessageType(buf) == MQTT_MSG_TYPE_SUBACK)
-			{
-				BC28_SetSocketListener(MqttSubscribeLisetner);
-			}
+			::AfxMessageBox(_T("No SUBACK!"));
 		}
 	}
 	else
@@ -0,0 +1,149 @@
+/**
+  *********************************************************
+  * @file	HexCodecBench.c
+  * @brief  Microbenchmark of hex string codec
+  * @ver	0.01
+  *********************************************************
+  * Reports throughput of the loops before HexCodec.c (sprintf and branches),
+  * the scalar kernel and the kernel chosen at compile time, as CSV:
+  *   op,impl,size,bytes,seconds,gbps
+  * gbps counts binary bytes, i.e. half of the hex characters.
+  * Usage: HexCodecBench [total_mb]
+  */
+
+#define _POSIX_C_SOURCE 199309L
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../HexCodec.h"
+
+#define BENCH_MAX_SIZE		1024	//one AT+NSOSD
+
+typedef int (*ENCODE_FUNC)(char *dst, const unsigned char *src, int size);
+typedef int (*DECODE_FUNC)(unsigned char *dst, const char *src, int len);
+
+static volatile unsigned int sinkBench = 0;	//keep results alive
+
+static double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// AT+NSOSD payload of the first driver, "%02X" per byte
+static int EncodeLegacy(char *dst, const unsigned char *src, int size)
+{
+	int i;
+
+	for(i=0; i<size; i++)
+	{
+		char szHex[4];
+
+		sprintf(szHex, "%02X", src[i]);
+		dst[i << 1] = szHex[0];
+		dst[(i << 1) + 1] = szHex[1];
+	}
+
+	return size << 1;
+}
+
+// AT+NSORF payload of the first driver, two branches per byte, no validation
+static int DecodeLegacy(unsigned char *dst, const char *src, int len)
+{
+	const char *p1 = src;
+	int i, j;
+
+	for(i=0; i<(len >> 1); i++)
+	{
+		unsigned char val = 0;
+
+		for(j=0; j<2; j++)
+		{
+			unsigned char a;
+
+			if(*p1 < 'A')
+				a = *p1 - '0';
+			else
+				a = *p1 - 'A' + 10;
+
+			val = (val << 4) + a;
+			p1++;
+		}
+
+		dst[i] = val;
+	}
+
+	return len >> 1;
+}
+
+static void RunEncode(const char *name, ENCODE_FUNC func, const unsigned char *data, char *hex,
+					  int size, long total)
+{
+	long loops = total / size, i;
+	double start, seconds;
+
+	start = Now();
+	for(i=0; i<loops; i++)
+	{
+		func(hex, data, size);
+		sinkBench += (unsigned char)hex[i % (size << 1)];
+	}
+	seconds = Now() - start;
+
+	printf("encode,%s,%d,%ld,%.6f,%.3f\n", name, size, loops * size, seconds,
+		loops * size / seconds / 1e9);
+}
+
+static void RunDecode(const char *name, DECODE_FUNC func, const char *hex, unsigned char *data,
+					  int size, long total)
+{
+	long loops = total / size, i;
+	double start, seconds;
+
+	start = Now();
+	for(i=0; i<loops; i++)
+	{
+		func(data, hex, size << 1);
+		sinkBench += data[i % size];
+	}
+	seconds = Now() - start;
+
+	printf("decode,%s,%d,%ld,%.6f,%.3f\n", name, size, loops * size, seconds,
+		loops * size / seconds / 1e9);
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const int sizes[] = {16, 64, 256, BENCH_MAX_SIZE};
+	static unsigned char data[BENCH_MAX_SIZE];
+	static char hex[BENCH_MAX_SIZE << 1];
+	long total = ((argc > 1) ? atol(argv[1]) : 64) << 20;
+	unsigned int i;
+
+	for(i=0; i<sizeof(data); i++)
+		data[i] = (unsigned char)(i * 131 + 7);
+
+	printf("op,impl,size,bytes,seconds,gbps\n");
+
+	for(i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++)
+	{
+		int size = sizes[i];
+
+		// sprintf is far slower, a fraction of data is enough
+		RunEncode("legacy", EncodeLegacy, data, hex, size, total >> 4);
+		RunEncode("scalar", HexCodec_EncodeScalar, data, hex, size, total);
+		RunEncode(HexCodec_GetKernel(), HexCodec_Encode, data, hex, size, total);
+
+		HexCodec_Encode(hex, data, size);
+		RunDecode("legacy", DecodeLegacy, hex, data, size, total);
+		RunDecode("scalar", HexCodec_DecodeScalar, hex, data, size, total);
+		RunDecode(HexCodec_GetKernel(), HexCodec_Decode, hex, data, size, total);
+	}
+
+	return (sinkBench == 0xFFFFFFFF) ? 1 : 0;
+}
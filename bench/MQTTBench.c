@@ -0,0 +1,520 @@
+/**
+  *********************************************************
+  * @file	MQTTBench.c
+  * @brief  End-to-end benchmark of MQTT publish through the driver on BC28Emu
+  * @ver	0.01
+  *********************************************************
+  * A local broker stand-in answers CONNECT, acknowledges QoS 1/2 PUBLISH and
+  * sends PUBLISH to the client.
+  * Uplink: QoS 0 by MQTT_PublishVector() and BC28_WriteTcpSocketV(), QoS 1/2
+  * by the in-flight engine. Latency is measured from publish to PUBACK or
+  * PUBCOMP for QoS 1/2, and to arrival at the broker for QoS 0.
+  * Downlink: QoS 0 PUBLISH written by the broker, latency is measured until it
+  * is read by BC28_ReadTcpSocket() and parsed by MQTT_ParsePublishMessage().
+  * Up to window messages are outstanding, 1 is stop-and-wait, larger windows
+  * sweep the message rate up to what the UART pipeline sustains.
+  * Reports CSV:
+  *   dir,qos,window,payload,messages,seconds,msgs_per_s,p50_us,p99_us,uart_tx_per_byte,uart_rx_per_byte
+  * UART bytes are counted by BC28_GetStatistics() and divided by payload bytes.
+  * Neither the driver nor MQTT.c allocates per message, so allocations are not
+  * a column, a comment line is printed if BC28_Wrap_Memory_Alloc() is called.
+  * Usage: MQTTBench [messages]
+  */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "../MQTT.h"
+#include "../test/BC28Host.h"
+
+#define BENCH_MAX_PAYLOAD	1000
+#define BENCH_MAX_MESSAGES	10000
+#define BENCH_PACKET_SIZE	2048
+#define BENCH_TIMEOUT		5000	//milliseconds to wait for one message
+#define BENCH_TOPIC			"bench/data"
+
+enum {
+	BENCH_UPLINK,
+	BENCH_DOWNLINK
+};
+
+static int fdListen = -1;
+static int idSocket = -1;
+
+// state shared with broker stand-in and socket listener
+static pthread_mutex_t lockBench = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t condBench = PTHREAD_COND_INITIALIZER;
+static double timeArrival[BENCH_MAX_MESSAGES];
+static int countArrival = 0;
+static int countNotify = 0;
+static int fdBroker = -1;
+
+// client side, main thread only
+static MQTT_INFLIGHT infBench;
+static MQTT_DECODER decBench;
+static unsigned char bufDecoder[BENCH_PACKET_SIZE];
+static int flagConnected = 0;
+static int flagFailed = 0;
+static int countDone = 0;		//delivered QoS 1/2 or parsed downlink messages
+static double timeBegin[BENCH_MAX_MESSAGES];
+static double latencyBench[BENCH_MAX_MESSAGES];
+
+
+static double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int CompareDouble(const void *a, const void *b)
+{
+	double d = *(const double*)a - *(const double*)b;
+
+	return (d > 0) - (d < 0);
+}
+
+// broker stand-in, index of message is the first 4 bytes of payload
+static void OnBrokerPacket(const unsigned char *packet, int size, void *context)
+{
+	int fd = *(int*)context;
+	unsigned char ack[4];
+	MQTT_PUBLISH_VIEW view;
+	int len = 0;
+
+	switch(packet[0] >> 4)
+	{
+	case MQTT_MSG_TYPE_CONNECT:
+		ack[0] = MQTT_MSG_TYPE_CONNACK << 4;
+		ack[1] = 2;
+		ack[2] = 0;
+		ack[3] = MQTT_CONNACK_ACCEPTED;
+		len = 4;
+		break;
+
+	case MQTT_MSG_TYPE_PUBLISH:
+		if(MQTT_ParsePublishView(packet, size, &view) && view.payload_len >= 4)
+		{
+			int index;
+
+			memcpy(&index, view.payload, sizeof(index));
+
+			pthread_mutex_lock(&lockBench);
+			if(index >= 0 && index < BENCH_MAX_MESSAGES)
+				timeArrival[index] = Now();
+			countArrival++;
+			pthread_cond_broadcast(&condBench);
+			pthread_mutex_unlock(&lockBench);
+
+			if(view.qos == MQTT_QOS_AT_LEAST_ONCE)
+				len = MQTT_PubAckMessage(ack, sizeof(ack), view.msg_id);
+			else if(view.qos == MQTT_QOS_EXACTLY_ONCE)
+				len = MQTT_PubRecMessage(ack, sizeof(ack), view.msg_id);
+		}
+		break;
+
+	case MQTT_MSG_TYPE_PUBREL:
+	{
+		int msg_id;
+
+		if(MQTT_ParseAck(packet, size, &msg_id) == MQTT_MSG_TYPE_PUBREL)
+			len = MQTT_PubCompMessage(ack, sizeof(ack), msg_id);
+		break;
+	}
+	}
+
+	if(len > 0 && write(fd, ack, len) != len)
+		printf("# broker failed to reply\n");
+}
+
+static void *BrokerThread(void *arg)
+{
+	static unsigned char buf[BENCH_PACKET_SIZE];
+	unsigned char data[1024];
+	MQTT_DECODER dec;
+	int fd, num, one = 1;
+
+	(void)arg;
+
+	fd = accept(fdListen, NULL, NULL);
+	if(fd < 0)
+		return NULL;
+
+	// downlink PUBLISH is not delayed by Nagle either, see ConnectSocket() of BC28Emu
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	pthread_mutex_lock(&lockBench);
+	fdBroker = fd;
+	pthread_mutex_unlock(&lockBench);
+
+	MQTT_DecoderInit(&dec, buf, sizeof(buf), OnBrokerPacket, &fd);
+	while((num = (int)read(fd, data, sizeof(data))) > 0)
+		MQTT_DecoderFeed(&dec, data, num);
+
+	close(fd);
+
+	return NULL;
+}
+
+static void SocketListener(int socket, int size)
+{
+	(void)socket;
+	(void)size;
+
+	pthread_mutex_lock(&lockBench);
+	countNotify++;
+	pthread_cond_broadcast(&condBench);
+	pthread_mutex_unlock(&lockBench);
+}
+
+// wait for the listener, the broker or a short time
+static void WaitBench(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 1000000L;
+	if(ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&lockBench);
+	if(countNotify == 0)
+		pthread_cond_timedwait(&condBench, &lockBench, &ts);
+	countNotify = 0;
+	pthread_mutex_unlock(&lockBench);
+}
+
+static void OnClientPacket(const unsigned char *packet, int size, void *context)
+{
+	static char topic[BENCH_PACKET_SIZE];
+	static char message[BENCH_PACKET_SIZE];
+
+	(void)context;
+
+	if(MQTT_CheckConnectAck(packet) == 0)
+	{
+		flagConnected = 1;
+	}
+	else if(MQTT_GetMessageType((unsigned char*)packet) == MQTT_MSG_TYPE_PUBLISH)
+	{
+		int index;
+
+		// copied out like an application would, parsing doesn't modify packet
+		if(!MQTT_ParsePublishMessage((unsigned char*)packet, size, topic, message))
+		{
+			flagFailed = 1;
+			return;
+		}
+
+		memcpy(&index, message, sizeof(index));
+		if(index >= 0 && index < BENCH_MAX_MESSAGES)
+			latencyBench[index] = Now() - timeBegin[index];
+		countDone++;
+	}
+	else
+	{
+		MQTT_InflightHandleAck(&infBench, packet, size, BC28Host_GetTick());
+	}
+}
+
+static void ReadClient(void)
+{
+	unsigned char data[512];
+	int num;
+
+	while((num = BC28_ReadTcpSocket(idSocket, data, sizeof(data))) > 0)
+		MQTT_DecoderFeed(&decBench, data, num);
+}
+
+static int SendPacket(const MQTT_IOVEC *iov, int iov_num, void *context)
+{
+	BC28_IOVEC vec[2];
+	int i, total = 0;
+
+	(void)context;
+
+	for(i=0; i<iov_num && i<2; i++)
+	{
+		vec[i].data = iov[i].data;
+		vec[i].size = iov[i].size;
+		total += iov[i].size;
+	}
+
+	return (BC28_WriteTcpSocketV(idSocket, vec, i) == total) ? 1 : 0;
+}
+
+static void OnDelivered(int msg_id, int status, void *user)
+{
+	int index = (int)(long)user;
+
+	(void)msg_id;
+
+	if(!status)
+		flagFailed = 1;
+
+	latencyBench[index] = Now() - timeBegin[index];
+	countDone++;
+}
+
+static int Connect(void)
+{
+	unsigned char msg[128];
+	MQTT_IOVEC iov;
+	uint32_t start = BC28Host_GetTick();
+
+	iov.data = msg;
+	iov.size = MQTT_ConnectMessage(msg, sizeof(msg), "10.0.0.1", "1883", "bench", NULL, NULL, 30, 60, 1);
+	if(!SendPacket(&iov, 1, NULL))
+		return 0;
+
+	while(!flagConnected && BC28Host_GetTick() - start < BENCH_TIMEOUT)
+	{
+		ReadClient();
+		if(!flagConnected)
+			WaitBench();
+	}
+
+	return flagConnected;
+}
+
+// QoS 0 is done when it arrives at the broker, QoS 1/2 by OnDelivered()
+static int PublishOne(int qos, int index, const unsigned char *payload, int size)
+{
+	timeBegin[index] = Now();
+
+	if(qos == MQTT_QOS_AT_MOST_ONCE)
+	{
+		unsigned char header[MQTT_INFLIGHT_HEADER_SIZE];
+		MQTT_IOVEC iov[2];
+		int num;
+
+		num = MQTT_PublishVector(iov, header, sizeof(header), 0, qos, 0, BENCH_TOPIC, payload, size, 0);
+
+		return (num > 0 && SendPacket(iov, num, NULL));
+	}
+
+	return MQTT_InflightPublish(&infBench, qos, 0, BENCH_TOPIC, payload, size,
+		(void*)(long)index, BC28Host_GetTick()) != 0;
+}
+
+// PUBLISH from the broker stand-in, payload carries index like uplink
+static int WriteDownlink(int index, const unsigned char *payload, int size)
+{
+	static unsigned char msg[BENCH_PACKET_SIZE];
+	int fd, len;
+
+	pthread_mutex_lock(&lockBench);
+	fd = fdBroker;
+	pthread_mutex_unlock(&lockBench);
+
+	len = MQTT_PublishBinaryMessage(msg, sizeof(msg), 0, MQTT_QOS_AT_MOST_ONCE, 0, BENCH_TOPIC,
+		payload, size, 0);
+
+	timeBegin[index] = Now();
+
+	return (fd >= 0 && len > 0 && write(fd, msg, len) == len);
+}
+
+static int CountDone(int dir, int qos)
+{
+	int done;
+
+	if(dir == BENCH_DOWNLINK || qos != MQTT_QOS_AT_MOST_ONCE)
+		return countDone;
+
+	pthread_mutex_lock(&lockBench);
+	done = countArrival;
+	pthread_mutex_unlock(&lockBench);
+
+	return done;
+}
+
+static int RunBench(int dir, int qos, int window, int size, int messages)
+{
+	static unsigned char payload[BENCH_MAX_PAYLOAD];
+	BC28_STATISTICS before, after;
+	uint32_t allocs, last;
+	double start, seconds, bytes;
+	int i, sent = 0, done = 0;
+
+	for(i=0; i<size; i++)
+		payload[i] = (unsigned char)(i * 131 + 7);
+
+	pthread_mutex_lock(&lockBench);
+	countArrival = 0;
+	pthread_mutex_unlock(&lockBench);
+	countDone = 0;
+	flagFailed = 0;
+
+	MQTT_InflightInit(&infBench, window, BENCH_TIMEOUT, 0, SendPacket, OnDelivered, NULL);
+
+	BC28_GetStatistics(&before);
+	allocs = BC28Host_GetAllocCount();
+	start = Now();
+	last = BC28Host_GetTick();
+
+	while(done < messages && !flagFailed)
+	{
+		int ret;
+
+		if(sent < messages && sent - done < window)
+		{
+			memcpy(payload, &sent, sizeof(sent));
+			if(dir == BENCH_UPLINK)
+				ret = PublishOne(qos, sent, payload, size);
+			else
+				ret = WriteDownlink(sent, payload, size);
+
+			if(!ret)
+				break;
+
+			sent++;
+			continue;
+		}
+
+		ReadClient();
+		if(qos != MQTT_QOS_AT_MOST_ONCE)
+			MQTT_InflightPoll(&infBench, BC28Host_GetTick());
+
+		ret = CountDone(dir, qos);
+		if(ret > done)
+		{
+			done = ret;
+			last = BC28Host_GetTick();
+		}
+		else if(BC28Host_GetTick() - last >= BENCH_TIMEOUT)
+		{
+			break;
+		}
+		else
+		{
+			WaitBench();
+		}
+	}
+
+	if(done < messages || flagFailed)
+	{
+		printf("# %s qos %d, window %d, payload %d: %d of %d messages are done\n",
+			dir == BENCH_UPLINK ? "up" : "down", qos, window, size, done, messages);
+		return 0;
+	}
+
+	seconds = Now() - start;
+	allocs = BC28Host_GetAllocCount() - allocs;
+	BC28_GetStatistics(&after);
+
+	if(dir == BENCH_UPLINK && qos == MQTT_QOS_AT_MOST_ONCE)
+	{
+		pthread_mutex_lock(&lockBench);
+		for(i=0; i<messages; i++)
+			latencyBench[i] = timeArrival[i] - timeBegin[i];
+		pthread_mutex_unlock(&lockBench);
+	}
+
+	qsort(latencyBench, messages, sizeof(double), CompareDouble);
+	bytes = (double)size * messages;
+
+	printf("%s,%d,%d,%d,%d,%.6f,%.1f,%.1f,%.1f,%.3f,%.3f\n", dir == BENCH_UPLINK ? "up" : "down",
+		qos, window, size, messages, seconds,
+		messages / seconds, latencyBench[messages / 2] * 1e6, latencyBench[(messages * 99) / 100] * 1e6,
+		(after.uart_tx_bytes - before.uart_tx_bytes) / bytes,
+		(after.uart_rx_bytes - before.uart_rx_bytes) / bytes);
+
+	if(allocs > 0)
+		printf("# %u calls of BC28_Wrap_Memory_Alloc()\n", allocs);
+
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int sizes[] = {16, 128, 512, BENCH_MAX_PAYLOAD};
+	static const int windows[] = {1, 4, MQTT_MAX_INFLIGHT};
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	pthread_t broker;
+	int messages = (argc > 1) ? atoi(argv[1]) : 200;
+	int ret = 0, qos;
+	unsigned int i, j;
+
+	if(messages < 1 || messages > BENCH_MAX_MESSAGES)
+		messages = 200;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fdListen = socket(AF_INET, SOCK_STREAM, 0);
+	if(fdListen < 0 || bind(fdListen, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fdListen, 1) != 0 ||
+		getsockname(fdListen, (struct sockaddr*)&addr, &addr_len) != 0)
+	{
+		printf("# failed to listen\n");
+		return 1;
+	}
+
+	BC28Emu_SetEndpoint("127.0.0.1", ntohs(addr.sin_port));
+	pthread_create(&broker, NULL, BrokerThread, NULL);
+
+	MQTT_DecoderInit(&decBench, bufDecoder, sizeof(bufDecoder), OnClientPacket, NULL);
+
+	if(BC28Host_Init())
+		idSocket = BC28_OpenTcpSocket("10.0.0.1", "1883");
+
+	if(idSocket >= 0)
+	{
+		BC28_SetTcpSocketListener(idSocket, SocketListener);
+
+		if(Connect())
+		{
+			printf("dir,qos,window,payload,messages,seconds,msgs_per_s,p50_us,p99_us,uart_tx_per_byte,uart_rx_per_byte\n");
+
+			for(qos=MQTT_QOS_AT_MOST_ONCE; qos<=MQTT_QOS_EXACTLY_ONCE && ret == 0; qos++)
+			{
+				for(j=0; j<sizeof(windows)/sizeof(windows[0]) && ret == 0; j++)
+				{
+					for(i=0; i<sizeof(sizes)/sizeof(sizes[0]) && ret == 0; i++)
+						ret = RunBench(BENCH_UPLINK, qos, windows[j], sizes[i], messages) ? 0 : 1;
+				}
+			}
+
+			for(j=0; j<sizeof(windows)/sizeof(windows[0]) && ret == 0; j++)
+			{
+				for(i=0; i<sizeof(sizes)/sizeof(sizes[0]) && ret == 0; i++)
+					ret = RunBench(BENCH_DOWNLINK, MQTT_QOS_AT_MOST_ONCE, windows[j], sizes[i], messages) ? 0 : 1;
+			}
+		}
+		else
+		{
+			printf("# no CONNACK\n");
+			ret = 1;
+		}
+
+		BC28_CloseTcpSocket(idSocket);
+	}
+	else
+	{
+		printf("# failed to open socket\n");
+		shutdown(fdListen, SHUT_RDWR);
+		ret = 1;
+	}
+
+	pthread_join(broker, NULL);
+	BC28Host_Close();
+	close(fdListen);
+
+	return ret;
+}
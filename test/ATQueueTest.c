@@ -0,0 +1,183 @@
+/**
+  *********************************************************
+  * @file	ATQueueTest.c
+  * @brief  Test of AT command queue on BC28Emu
+  * @ver	0.01
+  *********************************************************
+  * Late final result code of a timed-out command must not be taken by the
+  * commands after it, blocking or queued by BC28_SubmitATCmd().
+  * Queued commands get result 0 by their own deadline or when BC28 reboots.
+  */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../BC28Emu.h"
+#include "BC28Host.h"
+
+#define TEST_IMSI			"460001234567890"
+#define TEST_IMEI			"861234567890123"
+
+static int countFailed = 0;
+
+#define CHECK(cond, ...) \
+	do { if(!(cond)) { printf("FAILED %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); countFailed++; } } while(0)
+
+typedef struct {
+	pthread_mutex_t		lock;
+	int					done;
+	int					result;
+	char				rcv[64];
+} TEST_AT;
+
+
+static void OnTestAT(int result, char *rcv, int rcv_len, void *context)
+{
+	TEST_AT *at = (TEST_AT*)context;
+
+	pthread_mutex_lock(&at->lock);
+	at->result = result;
+	at->done = 1;
+	pthread_mutex_unlock(&at->lock);
+}
+
+static int WaitTestAT(TEST_AT *at, int ms)
+{
+	int done = 0;
+
+	for(; ms > 0 && !done; ms -= 10)
+	{
+		pthread_mutex_lock(&at->lock);
+		done = at->done;
+		pthread_mutex_unlock(&at->lock);
+
+		if(!done)
+			BC28_Wrap_Sleep(10);
+	}
+
+	return done;
+}
+
+// blocking command after a timed-out one gets its own response
+static void TestLateResponse(void)
+{
+	BC28_STATISTICS stat;
+	char rcv[64];
+
+	BC28_ResetStatistics();
+	BC28Emu_SetLatency("AT+CIMI", 1000);
+
+	CHECK(BC28_SendATCmdWaitRcv("AT+CIMI\r", rcv, sizeof(rcv), 200) == 0, "AT+CIMI is not timeout");
+
+	CHECK(BC28_SendATCmdWaitRcv("AT+CGSN=1\r", rcv, sizeof(rcv), 3000) == 1, "AT+CGSN=1 failed");
+	CHECK(strstr(rcv, "+CGSN:" TEST_IMEI) != NULL && strstr(rcv, TEST_IMSI) == NULL,
+		"AT+CGSN=1 returns \"%s\"", rcv);
+
+	CHECK(BC28_SendATCmdWaitRcv("AT\r", rcv, sizeof(rcv), 500) == 1, "AT after resync");
+
+	BC28_GetStatistics(&stat);
+	CHECK(stat.at_timeouts == 1, "%u timeouts", stat.at_timeouts);
+
+	BC28Emu_SetLatency("AT+CIMI", 0);
+}
+
+// commands queued while draining are written after the late response, in order
+static void TestQueuedAfterTimeout(void)
+{
+	TEST_AT imei, imsi;
+	char rcv[64];
+
+	memset(&imei, 0, sizeof(imei));
+	memset(&imsi, 0, sizeof(imsi));
+	pthread_mutex_init(&imei.lock, NULL);
+	pthread_mutex_init(&imsi.lock, NULL);
+
+	BC28Emu_SetLatency("AT+CIMI", 500);
+
+	CHECK(BC28_SendATCmdWaitRcv("AT+CIMI\r", rcv, sizeof(rcv), 100) == 0, "AT+CIMI is not timeout");
+
+	CHECK(BC28_SubmitATCmd("AT+CGSN=1\r", imei.rcv, sizeof(imei.rcv), OnTestAT, &imei), "queue AT+CGSN=1");
+	CHECK(BC28_SubmitATCmd("AT+CIMI\r", imsi.rcv, sizeof(imsi.rcv), OnTestAT, &imsi), "queue AT+CIMI");
+
+	CHECK(WaitTestAT(&imei, 3000) && imei.result == 1, "AT+CGSN=1 result %d", imei.result);
+	CHECK(strstr(imei.rcv, "+CGSN:" TEST_IMEI) != NULL, "AT+CGSN=1 returns \"%s\"", imei.rcv);
+
+	CHECK(WaitTestAT(&imsi, 3000) && imsi.result == 1, "AT+CIMI result %d", imsi.result);
+	CHECK(strstr(imsi.rcv, TEST_IMSI) != NULL && strstr(imsi.rcv, "+CGSN") == NULL,
+		"AT+CIMI returns \"%s\"", imsi.rcv);
+
+	BC28Emu_SetLatency("AT+CIMI", 0);
+}
+
+// queued command without response gets result 0 in AT_ASYNC_TIMEOUT, not earlier
+static void TestAsyncTimeout(void)
+{
+	TEST_AT imsi;
+	char rcv[64];
+
+	memset(&imsi, 0, sizeof(imsi));
+	pthread_mutex_init(&imsi.lock, NULL);
+
+	BC28Emu_SetLatency("AT+CIMI", 6000);
+
+	CHECK(BC28_SubmitATCmd("AT+CIMI\r", imsi.rcv, sizeof(imsi.rcv), OnTestAT, &imsi), "queue AT+CIMI");
+
+	CHECK(!WaitTestAT(&imsi, 4500), "AT+CIMI result %d before deadline", imsi.result);
+	CHECK(WaitTestAT(&imsi, 1000) && imsi.result == 0, "AT+CIMI result %d", imsi.result);
+
+	CHECK(BC28_SendATCmdWaitRcv("AT\r", rcv, sizeof(rcv), 3000) == 1, "AT after resync");
+
+	BC28Emu_SetLatency("AT+CIMI", 0);
+}
+
+// commands written before reboot are never answered, they fail at once
+static void TestReboot(void)
+{
+	TEST_AT imsi[4];
+	char rcv[64];
+	int i;
+
+	memset(imsi, 0, sizeof(imsi));
+	BC28Emu_SetLatency("AT+CIMI", 3000);
+
+	for(i=0; i<4; i++)
+	{
+		pthread_mutex_init(&imsi[i].lock, NULL);
+		CHECK(BC28_SubmitATCmd("AT+CIMI\r", imsi[i].rcv, sizeof(imsi[i].rcv), OnTestAT, &imsi[i]),
+			"queue AT+CIMI %d", i);
+	}
+
+	BC28_Wrap_Sleep(100);
+	BC28Emu_Reboot();
+
+	for(i=0; i<4; i++)
+		CHECK(WaitTestAT(&imsi[i], 1000) && imsi[i].result == 0, "AT+CIMI %d result %d", i, imsi[i].result);
+
+	CHECK(BC28_SendATCmdWaitRcv("AT\r", rcv, sizeof(rcv), 1000) == 1, "AT after reboot");
+
+	BC28Emu_SetLatency("AT+CIMI", 0);
+}
+
+
+int main(void)
+{
+	CHECK(BC28Host_Init(), "BC28_Init");
+
+	if(countFailed == 0)
+	{
+		TestLateResponse();
+		TestQueuedAfterTimeout();
+		TestAsyncTimeout();
+		TestReboot();
+	}
+
+	BC28Host_Close();
+
+	printf("ATQueueTest: %s\n", countFailed ? "FAILED" : "OK");
+
+	return countFailed ? 1 : 0;
+}
@@ -0,0 +1,253 @@
+/**
+  *********************************************************
+  * @file	BC28Host.c
+  * @brief  BC28 wrapper functions for Linux host, used by tests and benchmarks
+  * @ver	0.01
+  *********************************************************
+  ***************** Application Notes *********************
+  *********************************************************
+  * 1. BC28_Wrap_xxx() are implemented with pthreads, BC28_Wrap_Send() passes
+  *    bytes to BC28Emu, and output of BC28Emu is pushed to the driver.
+  * 2. Tasks of BC28_Wrap_PostTask() run in detached threads, like the sample.
+  * 3. BC28_Wrap_Memory_Alloc() is counted, see BC28Host_GetAllocCount().
+  * 4. Bytes written to UART can be watched by BC28Host_SetMonitor().
+  * 5. BC28_Wrap_Lock() may disable UART IRQ on target, so nested lock aborts.
+  *********************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		//PTHREAD_MUTEX_ERRORCHECK
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "../BC28Emu.h"
+#include "BC28Host.h"
+
+typedef struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int					signaled;	//auto-reset
+} HOST_EVENT;
+
+typedef struct {
+	BC28_TASK			task;
+	int					param1;
+	int					param2;
+} HOST_TASK;
+
+static pthread_mutex_t	lockBC28;
+static HOST_EVENT		eventBC28[BC28_EVENT_NUM];
+static uint32_t			countAlloc = 0;
+static BC28EMU_OUTPUT	funcMonitor = NULL;
+static int				flagInit = 0;
+
+
+/**
+  * BC28 wrapper functions
+  */
+void *BC28_Wrap_Memory_Alloc(uint32_t size)
+{
+	__atomic_add_fetch(&countAlloc, 1, __ATOMIC_RELAXED);
+
+	return malloc(size);
+}
+
+void BC28_Wrap_Memory_Free(void *ptr)
+{
+	free(ptr);
+}
+
+void BC28_Wrap_Sleep(int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	while(nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+int BC28_Wrap_Send(const uint8_t *data, int size)
+{
+	BC28EMU_OUTPUT monitor = __atomic_load_n(&funcMonitor, __ATOMIC_ACQUIRE);
+
+	if(monitor != NULL)
+		monitor(data, size);
+
+	BC28Emu_Input(data, size);
+
+	return size;
+}
+
+static void *HostTaskThread(void *arg)
+{
+	HOST_TASK task = *(HOST_TASK*)arg;
+
+	free(arg);
+	task.task(task.param1, task.param2);
+
+	return NULL;
+}
+
+void BC28_Wrap_PostTask(BC28_TASK task, int param1, int param2)
+{
+	HOST_TASK *param = (HOST_TASK*)malloc(sizeof(HOST_TASK));
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if(param == NULL)
+		return;
+
+	param->task = task;
+	param->param1 = param1;
+	param->param2 = param2;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attr, HostTaskThread, param) != 0)
+		free(param);
+	pthread_attr_destroy(&attr);
+}
+
+int BC28_Wrap_WaitEvent(int event, int ms)
+{
+	HOST_EVENT *e = &eventBC28[event];
+	struct timespec ts;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if(ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&e->lock);
+	while(!e->signaled)
+	{
+		if(pthread_cond_timedwait(&e->cond, &e->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+
+	if(e->signaled)
+	{
+		e->signaled = 0;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return ret;
+}
+
+void BC28_Wrap_SetEvent(int event)
+{
+	HOST_EVENT *e = &eventBC28[event];
+
+	pthread_mutex_lock(&e->lock);
+	e->signaled = 1;
+	pthread_cond_signal(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+}
+
+void BC28_Wrap_Lock(void)
+{
+	if(pthread_mutex_lock(&lockBC28) == EDEADLK)
+	{
+		fprintf(stderr, "BC28_Wrap_Lock: nested lock\n");
+		abort();
+	}
+}
+
+void BC28_Wrap_Unlock(void)
+{
+	pthread_mutex_unlock(&lockBC28);
+}
+
+
+/**
+  * @brief  To start BC28Emu and initialize the driver.
+  * @param  None
+  * @retval 1: Done, 0: Failed
+  */
+int BC28Host_Init(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_condattr_t cond_attr;
+	int i;
+
+	if(!flagInit)
+	{
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+		pthread_mutex_init(&lockBC28, &attr);
+		pthread_mutexattr_destroy(&attr);
+
+		pthread_condattr_init(&cond_attr);
+		pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+		for(i=0; i<BC28_EVENT_NUM; i++)
+		{
+			pthread_mutex_init(&eventBC28[i].lock, NULL);
+			pthread_cond_init(&eventBC28[i].cond, &cond_attr);
+			eventBC28[i].signaled = 0;
+		}
+		pthread_condattr_destroy(&cond_attr);
+
+		flagInit = 1;
+	}
+
+	if(!BC28Emu_Init(BC28_PushReceivedBytes))
+		return 0;
+
+	return BC28_Init() ? 1 : 0;
+}
+
+
+/**
+  * @brief  To stop BC28Emu, sockets of emulator are closed.
+  * @param  None
+  * @retval None
+  */
+void BC28Host_Close(void)
+{
+	BC28Emu_Close();
+}
+
+
+/**
+  * @brief  To watch bytes written to UART, called before they reach BC28Emu.
+  * @param  monitor: called with bytes, NULL to stop
+  * @retval None
+  */
+void BC28Host_SetMonitor(BC28EMU_OUTPUT monitor)
+{
+	__atomic_store_n(&funcMonitor, monitor, __ATOMIC_RELEASE);
+}
+
+
+/**
+  * @brief  To get number of BC28_Wrap_Memory_Alloc() calls.
+  * @param  None
+  * @retval number of calls
+  */
+uint32_t BC28Host_GetAllocCount(void)
+{
+	return __atomic_load_n(&countAlloc, __ATOMIC_RELAXED);
+}
+
+
+/**
+  * @brief  To get monotonic time.
+  * @param  None
+  * @retval milliseconds
+  */
+uint32_t BC28Host_GetTick(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
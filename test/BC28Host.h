@@ -0,0 +1,24 @@
+/**
+  *********************************************************
+  * @file	BC28Host.h
+  * @brief  BC28 wrapper functions for Linux host include file
+  * @ver	0.01
+  *********************************************************
+  *
+  */
+
+#ifndef _BC28HOST_H_
+#define _BC28HOST_H_
+
+#include "../BC28Emu.h"
+
+/**
+ * Public functions.
+ **/
+int BC28Host_Init(void);
+void BC28Host_Close(void);
+void BC28Host_SetMonitor(BC28EMU_OUTPUT monitor);
+uint32_t BC28Host_GetAllocCount(void);
+uint32_t BC28Host_GetTick(void);
+
+#endif
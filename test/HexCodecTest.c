@@ -0,0 +1,136 @@
+/**
+  *********************************************************
+  * @file	HexCodecTest.c
+  * @brief  Test of hex string codec
+  * @ver	0.01
+  *********************************************************
+  *
+  */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../HexCodec.h"
+
+#define TEST_MAX_SIZE		1100	//longer than one AT+NSOSD
+
+static int countFailed = 0;
+
+#define CHECK(cond, ...) \
+	do { if(!(cond)) { printf("FAILED %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); countFailed++; } } while(0)
+
+
+// Every byte value encodes like "%02X" and decodes back, in both cases.
+static void TestAllBytes(void)
+{
+	unsigned char data[256], out[256];
+	char hex[512 + 1], ref[512 + 1];
+	int i;
+
+	for(i=0; i<256; i++)
+	{
+		data[i] = (unsigned char)i;
+		sprintf(&ref[i << 1], "%02X", i);
+	}
+
+	CHECK(HexCodec_Encode(hex, data, 256) == 512, "encode length");
+	CHECK(memcmp(hex, ref, 512) == 0, "encode differs from %%02X");
+
+	memset(out, 0, sizeof(out));
+	CHECK(HexCodec_Decode(out, hex, 512) == 256, "decode length");
+	CHECK(memcmp(out, data, 256) == 0, "round trip of upper case");
+
+	for(i=0; i<512; i++)
+		hex[i] = (char)((hex[i] >= 'A') ? hex[i] + ('a' - 'A') : hex[i]);
+
+	memset(out, 0, sizeof(out));
+	CHECK(HexCodec_Decode(out, hex, 512) == 256, "decode length of lower case");
+	CHECK(memcmp(out, data, 256) == 0, "round trip of lower case");
+
+	// in place, as PushSocketPacket() does
+	HexCodec_Encode(hex, data, 256);
+	CHECK(HexCodec_Decode((unsigned char*)hex, hex, 512) == 256 && memcmp(hex, data, 256) == 0,
+		"decode in place");
+}
+
+// Odd length and every non-hex character are rejected at every position,
+// so that both SIMD blocks and scalar tail are checked.
+static void TestInvalid(void)
+{
+	unsigned char data[64], out[64];
+	char hex[128];
+	int c, pos;
+
+	memset(data, 0x5A, sizeof(data));
+	HexCodec_Encode(hex, data, 64);
+
+	CHECK(HexCodec_Decode(out, hex, 127) == -1, "odd length");
+	CHECK(HexCodec_Decode(out, hex, 1) == -1, "one digit");
+	CHECK(HexCodec_Decode(out, hex, -2) == -1, "negative length");
+	CHECK(HexCodec_Decode(out, hex, 0) == 0, "empty string");
+	CHECK(HexCodec_DecodeScalar(out, hex, 127) == -1, "odd length of scalar kernel");
+
+	for(c=0; c<256; c++)
+	{
+		int valid = (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f');
+		int value = !valid ? -1 : ((c <= '9') ? c - '0' : (c | 0x20) - 'a' + 10);
+
+		CHECK(HexCodec_DigitValue((char)c) == value, "digit value of 0x%02X", c);
+
+		if(valid)
+			continue;
+
+		for(pos=0; pos<128; pos++)
+		{
+			char saved = hex[pos];
+
+			hex[pos] = (char)c;
+			CHECK(HexCodec_Decode(out, hex, 128) == -1, "0x%02X at %d is accepted", c, pos);
+			CHECK(HexCodec_DecodeScalar(out, hex, 128) == -1, "0x%02X at %d is accepted by scalar", c, pos);
+			hex[pos] = saved;
+		}
+	}
+}
+
+// Kernel chosen at compile time gives the same result as scalar kernel for any length.
+static void TestKernel(void)
+{
+	static unsigned char data[TEST_MAX_SIZE], out[TEST_MAX_SIZE], ref_out[TEST_MAX_SIZE];
+	static char hex[TEST_MAX_SIZE << 1], ref[TEST_MAX_SIZE << 1];
+	int size, i;
+
+	srand(1);
+	for(i=0; i<TEST_MAX_SIZE; i++)
+		data[i] = (unsigned char)rand();
+
+	for(size=0; size<=TEST_MAX_SIZE; size += (size < 80) ? 1 : 37)
+	{
+		CHECK(HexCodec_Encode(hex, data, size) == (size << 1), "encode length %d", size);
+		HexCodec_EncodeScalar(ref, data, size);
+		CHECK(memcmp(hex, ref, size << 1) == 0, "encode of %d bytes differs from scalar", size);
+
+		// mixed case
+		for(i=0; i<(size << 1); i+=3)
+		{
+			if(hex[i] >= 'A')
+				hex[i] += 'a' - 'A';
+		}
+
+		CHECK(HexCodec_Decode(out, hex, size << 1) == size, "decode length %d", size);
+		CHECK(HexCodec_DecodeScalar(ref_out, hex, size << 1) == size, "scalar decode length %d", size);
+		CHECK(memcmp(out, data, size) == 0 && memcmp(ref_out, data, size) == 0,
+			"decode of %d bytes", size);
+	}
+}
+
+
+int main(void)
+{
+	TestAllBytes();
+	TestInvalid();
+	TestKernel();
+
+	printf("HexCodecTest (%s): %s\n", HexCodec_GetKernel(), countFailed ? "FAILED" : "OK");
+
+	return countFailed ? 1 : 0;
+}
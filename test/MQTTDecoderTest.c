@@ -0,0 +1,241 @@
+/**
+  *********************************************************
+  * @file	MQTTDecoderTest.c
+  * @brief  Test of MQTT streaming decoder and PUBLISH parser
+  * @ver	0.01
+  *********************************************************
+  * Packets come out the same whether TCP data is split or coalesced, and a
+  * packet longer than the buffer is skipped on both paths of the decoder.
+  * MQTT_ParsePublishView() never reads out of the message it is given.
+  */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../MQTT.h"
+
+#define TEST_BUF_SIZE		64
+#define TEST_STREAM_SIZE	512
+
+static int countFailed = 0;
+
+#define CHECK(cond, ...) \
+	do { if(!(cond)) { printf("FAILED %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); countFailed++; } } while(0)
+
+typedef struct {
+	int				packets;
+	unsigned char	out[TEST_STREAM_SIZE];	//packets passed to callback, back-to-back
+	int				size;
+} TEST_RECORD;
+
+
+static void OnTestPacket(const unsigned char *packet, int size, void *context)
+{
+	TEST_RECORD *rec = (TEST_RECORD*)context;
+
+	rec->packets++;
+	if(rec->size + size <= TEST_STREAM_SIZE)
+		memcpy(&rec->out[rec->size], packet, size);
+	rec->size += size;
+}
+
+// feeds stream in chunks of the size, returns sum of MQTT_DecoderFeed()
+static int FeedChunks(MQTT_DECODER *dec, const unsigned char *stream, int size, int chunk)
+{
+	int pos, ret = 0;
+
+	for(pos=0; pos<size; pos+=chunk)
+	{
+		int num = (size - pos < chunk) ? (size - pos) : chunk;
+		int packets = MQTT_DecoderFeed(dec, &stream[pos], num);
+
+		if(packets < 0)
+			return packets;
+		ret += packets;
+	}
+
+	return ret;
+}
+
+// PUBLISH, PINGRESP without body, PUBACK
+static int BuildStream(unsigned char *stream, int size)
+{
+	static const unsigned char ping[2] = {0xD0, 0x00};
+	unsigned char payload[20];
+	int len;
+
+	memset(payload, 'x', sizeof(payload));
+
+	len = MQTT_PublishBinaryMessage(stream, size, 0, 1, 0, "a/b", payload, sizeof(payload), 7);
+	memcpy(&stream[len], ping, sizeof(ping));
+	len += sizeof(ping);
+	len += MQTT_PubAckMessage(&stream[len], size - len, 7);
+
+	return len;
+}
+
+// chunks of every size, from one byte to the whole stream
+static void TestSplitCoalesced(void)
+{
+	unsigned char stream[TEST_STREAM_SIZE];
+	unsigned char buf[TEST_BUF_SIZE];
+	int size = BuildStream(stream, sizeof(stream));
+	int chunk;
+
+	for(chunk=1; chunk<=size; chunk++)
+	{
+		MQTT_DECODER dec;
+		TEST_RECORD rec;
+		int ret;
+
+		memset(&rec, 0, sizeof(rec));
+		MQTT_DecoderInit(&dec, buf, sizeof(buf), OnTestPacket, &rec);
+
+		ret = FeedChunks(&dec, stream, size, chunk);
+
+		CHECK(ret == 3 && rec.packets == 3, "chunk %d: %d packets, %d callbacks", chunk, ret, rec.packets);
+		CHECK(rec.size == size && memcmp(rec.out, stream, size) == 0, "chunk %d: packets differ", chunk);
+		CHECK(dec.dropped == 0, "chunk %d: %lu dropped", chunk, dec.dropped);
+	}
+}
+
+// remaining length of 5 bytes is rejected, the decoder starts over after it
+static void TestMalformedLength(void)
+{
+	static const unsigned char bad[6] = {0x30, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F};
+	unsigned char stream[TEST_STREAM_SIZE];
+	unsigned char buf[TEST_BUF_SIZE];
+	int size = BuildStream(stream, sizeof(stream));
+	int chunk;
+
+	for(chunk=1; chunk<=(int)sizeof(bad); chunk++)
+	{
+		MQTT_DECODER dec;
+		TEST_RECORD rec;
+
+		memset(&rec, 0, sizeof(rec));
+		MQTT_DecoderInit(&dec, buf, sizeof(buf), OnTestPacket, &rec);
+
+		CHECK(FeedChunks(&dec, bad, sizeof(bad), chunk) == -1, "chunk %d: malformed length is taken", chunk);
+		CHECK(rec.packets == 0, "chunk %d: %d callbacks", chunk, rec.packets);
+
+		CHECK(FeedChunks(&dec, stream, size, chunk) == 3, "chunk %d: no packets after reset", chunk);
+		CHECK(rec.size == size && memcmp(rec.out, stream, size) == 0, "chunk %d: packets differ", chunk);
+	}
+}
+
+// packet longer than buffer is skipped and counted, whole in one chunk or split
+static void TestOversize(void)
+{
+	unsigned char stream[TEST_STREAM_SIZE];
+	unsigned char ref[TEST_STREAM_SIZE];
+	unsigned char buf[TEST_BUF_SIZE];
+	unsigned char payload[200];
+	int size, ref_size, big, chunk;
+
+	memset(payload, 'y', sizeof(payload));
+
+	// PUBACK, PUBLISH longer than buf, PUBACK
+	size = MQTT_PubAckMessage(stream, sizeof(stream), 1);
+	big = MQTT_PublishBinaryMessage(&stream[size], sizeof(stream) - size, 0, 0, 0, "big", payload, sizeof(payload), 0);
+	CHECK(big > TEST_BUF_SIZE, "PUBLISH of %d bytes", big);
+	size += big;
+	size += MQTT_PubAckMessage(&stream[size], sizeof(stream) - size, 2);
+
+	ref_size = MQTT_PubAckMessage(ref, sizeof(ref), 1);
+	ref_size += MQTT_PubAckMessage(&ref[ref_size], sizeof(ref) - ref_size, 2);
+
+	for(chunk=1; chunk<=size; chunk++)
+	{
+		MQTT_DECODER dec;
+		TEST_RECORD rec;
+		int ret;
+
+		memset(&rec, 0, sizeof(rec));
+		MQTT_DecoderInit(&dec, buf, sizeof(buf), OnTestPacket, &rec);
+
+		ret = FeedChunks(&dec, stream, size, chunk);
+
+		CHECK(ret == 2 && rec.packets == 2, "chunk %d: %d packets, %d callbacks", chunk, ret, rec.packets);
+		CHECK(rec.size == ref_size && memcmp(rec.out, ref, ref_size) == 0, "chunk %d: packets differ", chunk);
+		CHECK(dec.dropped == 1, "chunk %d: %lu dropped", chunk, dec.dropped);
+	}
+}
+
+// fields point into message, packet identifier 0 is rejected for QoS 1 and 2
+static void TestPublishView(void)
+{
+	unsigned char msg[TEST_BUF_SIZE];
+	MQTT_PUBLISH_VIEW view;
+	int qos;
+
+	for(qos=MQTT_QOS_AT_MOST_ONCE; qos<=MQTT_QOS_EXACTLY_ONCE; qos++)
+	{
+		int size = MQTT_PublishMessage(msg, sizeof(msg), 0, qos, 1, "a/b", "hello", 0x1234);
+
+		memset(&view, 0, sizeof(view));
+		CHECK(MQTT_ParsePublishView(msg, size, &view) == 1, "QoS %d: PUBLISH is rejected", qos);
+		CHECK(view.qos == qos && view.retain == 1 && view.dup == 0, "QoS %d: flags %d,%d,%d",
+			qos, view.qos, view.retain, view.dup);
+		CHECK(view.topic_len == 3 && memcmp(view.topic, "a/b", 3) == 0, "QoS %d: topic", qos);
+		CHECK(view.msg_id == (qos ? 0x1234 : 0), "QoS %d: msg_id %d", qos, view.msg_id);
+		CHECK(view.payload_len == 5 && view.payload == &msg[size - 5], "QoS %d: payload", qos);
+
+		if(qos == MQTT_QOS_AT_MOST_ONCE)
+			continue;
+
+		size = MQTT_PublishMessage(msg, sizeof(msg), 0, qos, 0, "a/b", "hello", 0);
+		CHECK(MQTT_ParsePublishView(msg, size, &view) == 0, "QoS %d: msg_id 0 is taken", qos);
+	}
+}
+
+// every truncation of a valid PUBLISH fails
+static void TestPublishTruncated(void)
+{
+	unsigned char msg[TEST_BUF_SIZE];
+	MQTT_PUBLISH_VIEW view;
+	int qos;
+
+	for(qos=MQTT_QOS_AT_MOST_ONCE; qos<=MQTT_QOS_EXACTLY_ONCE; qos++)
+	{
+		int size = MQTT_PublishMessage(msg, sizeof(msg), 0, qos, 0, "a/b", "hello", 1);
+		int i;
+
+		for(i=0; i<size; i++)
+			CHECK(MQTT_ParsePublishView(msg, i, &view) == 0, "QoS %d: %d of %d bytes is taken", qos, i, size);
+	}
+}
+
+// topic length beyond remaining length, or leaving no room for packet identifier
+static void TestPublishTopicLength(void)
+{
+	static const unsigned char fit[7] = {0x30, 0x05, 0x00, 0x03, 'a', '/', 'b'};
+	static const unsigned char over[7] = {0x30, 0x05, 0x00, 0x04, 'a', '/', 'b'};
+	static const unsigned char max[7] = {0x30, 0x05, 0xFF, 0xFF, 'a', '/', 'b'};
+	static const unsigned char no_id[7] = {0x32, 0x05, 0x00, 0x03, 'a', '/', 'b'};
+	// remaining length 3 inside a larger buffer, topic must not run past it
+	static const unsigned char inner[9] = {0x30, 0x03, 0x00, 0x03, 'a', '/', 'b', 'c', 'd'};
+	MQTT_PUBLISH_VIEW view;
+
+	CHECK(MQTT_ParsePublishView(fit, sizeof(fit), &view) == 1 && view.topic_len == 3 && view.payload_len == 0,
+		"topic up to the end is rejected");
+	CHECK(MQTT_ParsePublishView(over, sizeof(over), &view) == 0, "topic length 4 of 3 bytes is taken");
+	CHECK(MQTT_ParsePublishView(max, sizeof(max), &view) == 0, "topic length 65535 is taken");
+	CHECK(MQTT_ParsePublishView(no_id, sizeof(no_id), &view) == 0, "QoS 1 without msg_id is taken");
+	CHECK(MQTT_ParsePublishView(inner, sizeof(inner), &view) == 0, "topic past remaining length is taken");
+}
+
+
+int main(void)
+{
+	TestSplitCoalesced();
+	TestMalformedLength();
+	TestOversize();
+	TestPublishView();
+	TestPublishTruncated();
+	TestPublishTopicLength();
+
+	printf("MQTTDecoderTest: %s\n", countFailed ? "FAILED" : "OK");
+
+	return countFailed ? 1 : 0;
+}
@@ -0,0 +1,314 @@
+/**
+  *********************************************************
+  * @file	MQTTInflightTest.c
+  * @brief  Test of MQTT in-flight engine of QoS 1/2 messages
+  * @ver	0.01
+  *********************************************************
+  * Packets are captured by a fake send function, time is given by the test
+  * and starts near the wrap of unsigned long.
+  * Built with MQTT_PACKET_ID_NUM 8, packet IDs run out before the window.
+  */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../MQTT.h"
+
+#define TEST_TIMEOUT		1000
+#define TEST_MAX_PACKETS	32
+#define TEST_PACKET_SIZE	128
+#define TEST_TICK_START		((unsigned long)-1500)	//wraps during each test
+
+static int countFailed = 0;
+
+#define CHECK(cond, ...) \
+	do { if(!(cond)) { printf("FAILED %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); countFailed++; } } while(0)
+
+typedef struct {
+	unsigned char	data[TEST_PACKET_SIZE];
+	int				size;
+} TEST_PACKET;
+
+static TEST_PACKET	tablePacket[TEST_MAX_PACKETS];
+static int			countPacket = 0;
+static int			resultSend = 1;		//returned by fake send
+
+static int			countDone = 0;
+static int			lastDoneId = 0;
+static int			lastDoneStatus = -1;
+static void			*lastDoneUser = NULL;
+
+
+// captures packet instead of writing socket
+static int FakeSend(const MQTT_IOVEC *iov, int iov_num, void *context)
+{
+	TEST_PACKET *pkt = &tablePacket[countPacket % TEST_MAX_PACKETS];
+	int i;
+
+	(void)context;
+
+	pkt->size = 0;
+	for(i=0; i<iov_num; i++)
+	{
+		if(pkt->size + iov[i].size <= TEST_PACKET_SIZE)
+			memcpy(&pkt->data[pkt->size], iov[i].data, iov[i].size);
+		pkt->size += iov[i].size;
+	}
+	countPacket++;
+
+	return resultSend;
+}
+
+static void OnInflightDone(int msg_id, int status, void *user)
+{
+	countDone++;
+	lastDoneId = msg_id;
+	lastDoneStatus = status;
+	lastDoneUser = user;
+}
+
+static void ResetRecord(void)
+{
+	countPacket = 0;
+	resultSend = 1;
+	countDone = 0;
+	lastDoneId = 0;
+	lastDoneStatus = -1;
+	lastDoneUser = NULL;
+}
+
+static const TEST_PACKET *LastPacket(void)
+{
+	return &tablePacket[(countPacket - 1) % TEST_MAX_PACKETS];
+}
+
+// packet identifier of PUBLISH with topic "t", or of PUBACK family
+static int PacketId(const TEST_PACKET *pkt)
+{
+	int type = pkt->data[0] >> 4;
+
+	if(type == MQTT_MSG_TYPE_PUBLISH)
+		return (pkt->data[5] << 8) + pkt->data[6];
+
+	return (pkt->data[2] << 8) + pkt->data[3];
+}
+
+static int Ack(MQTT_INFLIGHT *inf, int type, int msg_id, unsigned long now)
+{
+	unsigned char msg[MQTT_MSG_SIZE_PUBACK];
+
+	if(type == MQTT_MSG_TYPE_PUBACK)
+		MQTT_PubAckMessage(msg, sizeof(msg), msg_id);
+	else if(type == MQTT_MSG_TYPE_PUBREC)
+		MQTT_PubRecMessage(msg, sizeof(msg), msg_id);
+	else
+		MQTT_PubCompMessage(msg, sizeof(msg), msg_id);
+
+	return MQTT_InflightHandleAck(inf, msg, sizeof(msg), now);
+}
+
+// IDs 1 ~ 7 are used once each, freed IDs are reused after the last one, never 0
+static void TestPacketId(void)
+{
+	static const unsigned char payload[4] = {1, 2, 3, 4};
+	MQTT_INFLIGHT inf;
+	unsigned long now = TEST_TICK_START;
+	int i, id;
+
+	ResetRecord();
+	MQTT_InflightInit(&inf, MQTT_MAX_INFLIGHT, TEST_TIMEOUT, 0, FakeSend, OnInflightDone, NULL);
+
+	for(i=1; i<MQTT_PACKET_ID_NUM; i++)
+	{
+		id = MQTT_InflightPublish(&inf, MQTT_QOS_AT_LEAST_ONCE, 0, "t", payload, sizeof(payload), NULL, now);
+		CHECK(id == i, "publish %d gets ID %d", i, id);
+	}
+
+	// window has room, but all IDs are in use
+	id = MQTT_InflightPublish(&inf, MQTT_QOS_AT_LEAST_ONCE, 0, "t", payload, sizeof(payload), NULL, now);
+	CHECK(id == 0, "publish without free ID gets %d", id);
+	CHECK(MQTT_InflightCount(&inf) == MQTT_PACKET_ID_NUM - 1, "%d in flight", MQTT_InflightCount(&inf));
+	CHECK(countPacket == MQTT_PACKET_ID_NUM - 1, "%d packets sent", countPacket);
+
+	CHECK(Ack(&inf, MQTT_MSG_TYPE_PUBACK, 3, now) == 1, "PUBACK 3 is not handled");
+	CHECK(countDone == 1 && lastDoneId == 3 && lastDoneStatus == 1, "PUBACK 3 calls back %d,%d", lastDoneId, lastDoneStatus);
+
+	id = MQTT_InflightPublish(&inf, MQTT_QOS_AT_LEAST_ONCE, 0, "t", payload, sizeof(payload), NULL, now);
+	CHECK(id == 3, "publish gets ID %d instead of freed 3", id);
+
+	// wraps from the last ID to 1
+	CHECK(Ack(&inf, MQTT_MSG_TYPE_PUBACK, 1, now) == 1 && Ack(&inf, MQTT_MSG_TYPE_PUBACK, 5, now) == 1, "PUBACK 1, 5");
+	id = MQTT_InflightPublish(&inf, MQTT_QOS_AT_LEAST_ONCE, 0, "t", payload, sizeof(payload), NULL, now);
+	CHECK(id == 5, "publish gets ID %d after 3, instead of 5", id);
+	id = MQTT_InflightPublish(&inf, MQTT_QOS_AT_LEAST_ONCE, 0, "t", payload, sizeof(payload), NULL, now);
+	CHECK(id == 1, "publish gets ID %d after 5, instead of 1", id);
+
+	// unknown ID is not handled
+	CHECK(Ack(&inf, MQTT_MSG_TYPE_PUBACK, 0, now) == 0, "PUBACK 0 is handled");
+	CHECK(MQTT_InflightCount(&inf) == MQTT_PACKET_ID_NUM - 1, "%d in flight", MQTT_InflightCount(&inf));
+}
+
+// first PUBLISH has no DUP, retransmission after timeout has DUP and the same ID and payload
+static void TestRetransmitDup(void)
+{
+	static const unsigned char payload[5] = {'h', 'e', 'l', 'l', 'o'};
+	MQTT_INFLIGHT inf;
+	TEST_PACKET first;
+	unsigned long now = TEST_TICK_START;
+	int id, user = 0;
+
+	ResetRecord();
+	MQTT_InflightInit(&inf, 2, TEST_TIMEOUT, 0, FakeSend, OnInflightDone, NULL);
+
+	// failed to send is kept and retransmitted
+	resultSend = 0;
+	id = MQTT_InflightPublish(&inf, MQTT_QOS_AT_LEAST_ONCE, 1, "t", payload, sizeof(payload), &user, now);
+	resultSend = 1;
+	CHECK(id > 0 && countPacket == 1, "publish ID %d, %d packets", id, countPacket);
+
+	first = *LastPacket();
+	CHECK((first.data[0] & 0x08) == 0 && (first.data[0] & 0x01) == 1, "first PUBLISH has flags 0x%X", first.data[0] & 0x0F);
+	CHECK(PacketId(&first) == id, "first PUBLISH has ID %d", PacketId(&first));
+
+	CHECK(MQTT_InflightPoll(&inf, now + TEST_TIMEOUT - 1) == 0 && countPacket == 1, "retransmitted before timeout");
+
+	now += TEST_TIMEOUT;
+	CHECK(MQTT_InflightPoll(&inf, now) == 1 && countPacket == 2, "not retransmitted after timeout");
+	CHECK(LastPacket()->data[0] == (first.data[0] | 0x08), "retransmitted PUBLISH has flags 0x%X", LastPacket()->data[0] & 0x0F);
+	CHECK(LastPacket()->size == first.size && memcmp(&LastPacket()->data[1], &first.data[1], first.size - 1) == 0,
+		"retransmitted PUBLISH differs");
+
+	// timeout restarts from retransmission
+	CHECK(MQTT_InflightPoll(&inf, now + TEST_TIMEOUT - 1) == 0, "retransmitted again before timeout");
+
+	CHECK(Ack(&inf, MQTT_MSG_TYPE_PUBACK, id, now) == 1, "PUBACK is not handled");
+	CHECK(countDone == 1 && lastDoneStatus == 1 && lastDoneUser == &user, "PUBACK calls back %d", lastDoneStatus);
+	CHECK(MQTT_InflightPoll(&inf, now + 10 * TEST_TIMEOUT) == 0, "retransmitted after PUBACK");
+}
+
+// PUBREC is answered by PUBREL, which is retransmitted until PUBCOMP
+static void TestQoS2(void)
+{
+	static const unsigned char payload[3] = {7, 8, 9};
+	MQTT_INFLIGHT inf;
+	unsigned long now = TEST_TICK_START;
+	int id;
+
+	ResetRecord();
+	MQTT_InflightInit(&inf, 2, TEST_TIMEOUT, 0, FakeSend, OnInflightDone, NULL);
+
+	id = MQTT_InflightPublish(&inf, MQTT_QOS_EXACTLY_ONCE, 0, "t", payload, sizeof(payload), NULL, now);
+	CHECK(id > 0 && (LastPacket()->data[0] & 0x06) == (MQTT_QOS_EXACTLY_ONCE << 1), "QoS 2 PUBLISH");
+
+	// PUBCOMP before PUBREC is not the end
+	Ack(&inf, MQTT_MSG_TYPE_PUBCOMP, id, now);
+	CHECK(countDone == 0 && MQTT_InflightCount(&inf) == 1, "PUBCOMP before PUBREC completes");
+
+	now += 100;
+	CHECK(Ack(&inf, MQTT_MSG_TYPE_PUBREC, id, now) == 1, "PUBREC is not handled");
+	CHECK(countPacket == 2 && LastPacket()->size == MQTT_MSG_SIZE_PUBACK &&
+		LastPacket()->data[0] == 0x62 && PacketId(LastPacket()) == id, "PUBREL is not sent for PUBREC");
+	CHECK(countDone == 0, "PUBREC completes");
+
+	// PUBREL instead of PUBLISH after timeout
+	now += TEST_TIMEOUT;
+	CHECK(MQTT_InflightPoll(&inf, now) == 1 && countPacket == 3 && LastPacket()->data[0] == 0x62,
+		"PUBREL is not retransmitted");
+
+	// duplicate PUBREC is answered again
+	CHECK(Ack(&inf, MQTT_MSG_TYPE_PUBREC, id, now) == 1 && countPacket == 4 && LastPacket()->data[0] == 0x62,
+		"PUBREL is not sent for duplicate PUBREC");
+
+	CHECK(Ack(&inf, MQTT_MSG_TYPE_PUBCOMP, id, now) == 1, "PUBCOMP is not handled");
+	CHECK(countDone == 1 && lastDoneId == id && lastDoneStatus == 1, "PUBCOMP calls back %d,%d", lastDoneId, lastDoneStatus);
+	CHECK(MQTT_InflightCount(&inf) == 0, "%d in flight", MQTT_InflightCount(&inf));
+}
+
+// callback with status 0 after max_retries retransmissions, nothing is sent then
+static void TestGiveUp(void)
+{
+	MQTT_INFLIGHT inf;
+	unsigned long now = TEST_TICK_START;
+	int id, user = 0;
+
+	ResetRecord();
+	MQTT_InflightInit(&inf, 2, TEST_TIMEOUT, 2, FakeSend, OnInflightDone, NULL);
+
+	id = MQTT_InflightPublish(&inf, MQTT_QOS_AT_LEAST_ONCE, 0, "t", NULL, 0, &user, now);
+	CHECK(id > 0 && countPacket == 1, "publish ID %d, %d packets", id, countPacket);
+
+	now += TEST_TIMEOUT;
+	CHECK(MQTT_InflightPoll(&inf, now) == 1, "retry 1");
+	now += TEST_TIMEOUT;
+	CHECK(MQTT_InflightPoll(&inf, now) == 1, "retry 2");
+	CHECK(countDone == 0, "given up before max_retries");
+
+	now += TEST_TIMEOUT;
+	CHECK(MQTT_InflightPoll(&inf, now) == 0 && countPacket == 3, "sent after max_retries, %d packets", countPacket);
+	CHECK(countDone == 1 && lastDoneId == id && lastDoneStatus == 0 && lastDoneUser == &user,
+		"give-up calls back %d,%d", lastDoneId, lastDoneStatus);
+	CHECK(MQTT_InflightCount(&inf) == 0, "%d in flight", MQTT_InflightCount(&inf));
+
+	// ID is free again
+	CHECK(Ack(&inf, MQTT_MSG_TYPE_PUBACK, id, now) == 0 && countDone == 1, "PUBACK after give-up is handled");
+}
+
+// after reconnection everything is sent at once: PUBLISH with DUP, or PUBREL
+static void TestResend(void)
+{
+	static const unsigned char payload[2] = {0x55, 0xAA};
+	MQTT_INFLIGHT inf;
+	unsigned long now = TEST_TICK_START;
+	int id1, id2, id3, i, publish = 0, rel = 0;
+
+	ResetRecord();
+	MQTT_InflightInit(&inf, 4, TEST_TIMEOUT, 0, FakeSend, OnInflightDone, NULL);
+
+	id1 = MQTT_InflightPublish(&inf, MQTT_QOS_AT_LEAST_ONCE, 0, "t", payload, sizeof(payload), NULL, now);
+	id2 = MQTT_InflightPublish(&inf, MQTT_QOS_EXACTLY_ONCE, 0, "t", payload, sizeof(payload), NULL, now);
+	id3 = MQTT_InflightPublish(&inf, MQTT_QOS_EXACTLY_ONCE, 0, "t", payload, sizeof(payload), NULL, now);
+	CHECK(Ack(&inf, MQTT_MSG_TYPE_PUBREC, id3, now) == 1, "PUBREC is not handled");
+
+	// connection is lost before timeout
+	now += TEST_TIMEOUT / 2;
+	ResetRecord();
+
+	CHECK(MQTT_InflightResend(&inf, now) == 3 && countPacket == 3, "%d packets resent", countPacket);
+
+	for(i=0; i<countPacket; i++)
+	{
+		const TEST_PACKET *pkt = &tablePacket[i];
+		int id = PacketId(pkt);
+
+		if((pkt->data[0] >> 4) == MQTT_MSG_TYPE_PUBLISH)
+		{
+			CHECK(pkt->data[0] & 0x08, "resent PUBLISH %d has no DUP", id);
+			CHECK(id == id1 || id == id2, "resent PUBLISH has ID %d", id);
+			publish++;
+		}
+		else
+		{
+			CHECK(pkt->data[0] == 0x62 && id == id3, "resent 0x%02X with ID %d", pkt->data[0], id);
+			rel++;
+		}
+	}
+	CHECK(publish == 2 && rel == 1, "%d PUBLISH, %d PUBREL resent", publish, rel);
+
+	// timeout restarts from resend
+	CHECK(MQTT_InflightPoll(&inf, now + TEST_TIMEOUT - 1) == 0, "retransmitted before timeout after resend");
+	CHECK(MQTT_InflightPoll(&inf, now + TEST_TIMEOUT) == 3, "not retransmitted after resend");
+}
+
+
+int main(void)
+{
+	TestPacketId();
+	TestRetransmitDup();
+	TestQoS2();
+	TestGiveUp();
+	TestResend();
+
+	printf("MQTTInflightTest: %s\n", countFailed ? "FAILED" : "OK");
+
+	return countFailed ? 1 : 0;
+}
@@ -0,0 +1,333 @@
+/**
+  *********************************************************
+  * @file	MQTTSNGatewayTest.c
+  * @brief  Test of MQTT-SN client messages over UDP sockets of the driver on BC28Emu
+  * @ver	0.01
+  *********************************************************
+  * A local UDP gateway stand-in answers CONNECT, REGISTER, QoS 1 PUBLISH and
+  * SUBSCRIBE, and publishes to the subscribed topic. The client composes and
+  * parses with MQTTSN.c and talks through BC28_OpenUdpSocket(),
+  * BC28_SendUdpSocket() and BC28_ReadUdpSocket().
+  */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "../MQTTSN.h"
+#include "BC28Host.h"
+
+#define TEST_GATEWAY_IP		"10.0.0.2"		//redirected to the stand-in by BC28Emu_SetEndpoint()
+#define TEST_CLIENT_ID		"bc28-test"
+#define TEST_PUB_TOPIC		"sensor/temp"
+#define TEST_SUB_TOPIC		"sensor/cmd"
+#define TEST_PUB_DATA		"23.5"
+#define TEST_SUB_DATA		"on"
+#define TEST_MAX_TOPICS		4
+#define TEST_MSG_SIZE		256
+
+static int countFailed = 0;
+
+#define CHECK(cond, ...) \
+	do { if(!(cond)) { printf("FAILED %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); countFailed++; } } while(0)
+
+// state of gateway stand-in
+static pthread_mutex_t lockGateway = PTHREAD_MUTEX_INITIALIZER;
+static int fdGateway = -1;
+static int flagStop = 0;
+static char tableTopic[TEST_MAX_TOPICS][32];	//topic ID is index + 1
+static int countTopic = 0;
+static char szClientID[32];
+static char szPublished[32];
+
+
+// topic ID of topic name, registered if new, 0: table is full
+static int GetTopicID(const char *topic)
+{
+	int i;
+
+	for(i=0; i<countTopic; i++)
+	{
+		if(strcmp(tableTopic[i], topic) == 0)
+			return i + 1;
+	}
+
+	if(countTopic >= TEST_MAX_TOPICS)
+		return 0;
+
+	strncpy(tableTopic[countTopic], topic, sizeof(tableTopic[0]) - 1);
+
+	return ++countTopic;
+}
+
+// answer one message of client, returns number of bytes of reply in rsp
+static int HandleGatewayMessage(const unsigned char *msg, int size, unsigned char *rsp, int *publish)
+{
+	int type = MQTTSN_GetMessageType(msg, size);
+	int len = MQTTSN_GetMessageLength(msg, size);
+	int offset = (msg[0] == 0x01) ? 4 : 2;		//length field and type
+	int qos, topic_type, topic_id, msg_id, num;
+	const unsigned char *data;
+	char topic[32];
+
+	*publish = 0;
+
+	pthread_mutex_lock(&lockGateway);
+
+	switch(type)
+	{
+	// flags, protocol ID, duration, client ID
+	case MQTTSN_MSG_TYPE_CONNECT:
+		num = len - offset - 4;
+		if(num <= 0 || num >= (int)sizeof(szClientID) || msg[offset + 1] != 0x01)
+		{
+			len = 0;
+			break;
+		}
+		memcpy(szClientID, &msg[offset + 4], num);
+		szClientID[num] = 0;
+		rsp[0] = MQTTSN_MSG_SIZE_CONNACK;
+		rsp[1] = MQTTSN_MSG_TYPE_CONNACK;
+		rsp[2] = MQTTSN_RC_ACCEPTED;
+		len = MQTTSN_MSG_SIZE_CONNACK;
+		break;
+
+	case MQTTSN_MSG_TYPE_REGISTER:
+		if(!MQTTSN_ParseRegister(msg, size, &topic_id, &msg_id, topic, sizeof(topic)))
+		{
+			len = 0;
+			break;
+		}
+		topic_id = GetTopicID(topic);
+		len = MQTTSN_RegAckMessage(rsp, TEST_MSG_SIZE, topic_id, msg_id,
+			topic_id ? MQTTSN_RC_ACCEPTED : MQTTSN_RC_REJECTED_CONGESTION);
+		break;
+
+	case MQTTSN_MSG_TYPE_PUBLISH:
+		num = MQTTSN_ParsePublishMessage(msg, size, &qos, &topic_type, &topic_id, &msg_id, &data);
+		if(num < 0 || topic_type != MQTTSN_TOPIC_TYPE_NORMAL || topic_id < 1 || topic_id > countTopic)
+		{
+			len = (num >= 0 && qos > 0) ? MQTTSN_PubAckMessage(rsp, TEST_MSG_SIZE, topic_id, msg_id,
+				MQTTSN_RC_REJECTED_INVALID_TOPIC_ID) : 0;
+			break;
+		}
+		if(num >= (int)sizeof(szPublished))
+			num = sizeof(szPublished) - 1;
+		memcpy(szPublished, data, num);
+		szPublished[num] = 0;
+		len = (qos == 1) ? MQTTSN_PubAckMessage(rsp, TEST_MSG_SIZE, topic_id, msg_id, MQTTSN_RC_ACCEPTED) : 0;
+		break;
+
+	// flags, message ID, topic name, SUBACK then PUBLISH to the topic
+	case MQTTSN_MSG_TYPE_SUBSCRIBE:
+		num = len - offset - 3;
+		if(num <= 0 || num >= (int)sizeof(topic) || (msg[offset] & 3) != MQTTSN_TOPIC_TYPE_NORMAL)
+		{
+			len = 0;
+			break;
+		}
+		memcpy(topic, &msg[offset + 3], num);
+		topic[num] = 0;
+		topic_id = GetTopicID(topic);
+		rsp[0] = MQTTSN_MSG_SIZE_SUBACK;
+		rsp[1] = MQTTSN_MSG_TYPE_SUBACK;
+		rsp[2] = msg[offset] & 0x60;		//granted QoS
+		rsp[3] = (unsigned char)(topic_id >> 8);
+		rsp[4] = (unsigned char)topic_id;
+		rsp[5] = msg[offset + 1];
+		rsp[6] = msg[offset + 2];
+		rsp[7] = topic_id ? MQTTSN_RC_ACCEPTED : MQTTSN_RC_REJECTED_CONGESTION;
+		len = MQTTSN_MSG_SIZE_SUBACK;
+		*publish = topic_id;
+		break;
+
+	default:
+		len = 0;
+		break;
+	}
+
+	pthread_mutex_unlock(&lockGateway);
+
+	return len;
+}
+
+static void *GatewayThread(void *arg)
+{
+	unsigned char msg[TEST_MSG_SIZE];
+	unsigned char rsp[TEST_MSG_SIZE];
+
+	(void)arg;
+
+	for(;;)
+	{
+		struct sockaddr_in addr;
+		socklen_t addr_len = sizeof(addr);
+		int num, len, publish, stop;
+
+		pthread_mutex_lock(&lockGateway);
+		stop = flagStop;
+		pthread_mutex_unlock(&lockGateway);
+		if(stop)
+			break;
+
+		// timeout of socket, see main()
+		num = (int)recvfrom(fdGateway, msg, sizeof(msg), 0, (struct sockaddr*)&addr, &addr_len);
+		if(num <= 0)
+			continue;
+
+		len = HandleGatewayMessage(msg, num, rsp, &publish);
+		if(len > 0)
+			sendto(fdGateway, rsp, len, 0, (struct sockaddr*)&addr, addr_len);
+
+		// QoS 0 message to the new subscriber
+		if(publish > 0)
+		{
+			len = MQTTSN_PublishMessage(rsp, sizeof(rsp), 0, 0, 0, MQTTSN_TOPIC_TYPE_NORMAL, publish, 0,
+				(const unsigned char*)TEST_SUB_DATA, (int)strlen(TEST_SUB_DATA));
+			sendto(fdGateway, rsp, len, 0, (struct sockaddr*)&addr, addr_len);
+		}
+	}
+
+	return NULL;
+}
+
+static int SendToGateway(int socket, const unsigned char *msg, int len)
+{
+	return BC28_SendUdpSocket(socket, TEST_GATEWAY_IP, DEFAULT_MQTTSN_GATEWAY_PORT, msg, len) == len;
+}
+
+// datagrams are pushed by +NSONMI and AT+NSORF in the background
+static int WaitDatagram(int socket, unsigned char *msg, int size)
+{
+	int wait, num = 0;
+
+	for(wait=0; wait<3000 && num == 0; wait+=10)
+	{
+		num = BC28_ReadUdpSocket(socket, msg, size, NULL, NULL);
+		if(num == 0)
+			BC28_Wrap_Sleep(10);
+	}
+
+	return num;
+}
+
+static void TestSession(int socket)
+{
+	unsigned char msg[TEST_MSG_SIZE];
+	const unsigned char *data;
+	int len, qos, topic_type, topic_id, msg_id, pub_topic_id = 0;
+
+	// CONNECT / CONNACK
+	len = MQTTSN_ConnectMessage(msg, sizeof(msg), TEST_CLIENT_ID, 60, 1);
+	CHECK(len > 0 && SendToGateway(socket, msg, len), "send CONNECT");
+	len = WaitDatagram(socket, msg, sizeof(msg));
+	CHECK(MQTTSN_CheckConnectAck(msg, len) == MQTTSN_RC_ACCEPTED, "CONNACK of %d bytes", len);
+
+	pthread_mutex_lock(&lockGateway);
+	CHECK(strcmp(szClientID, TEST_CLIENT_ID) == 0, "client ID \"%s\"", szClientID);
+	pthread_mutex_unlock(&lockGateway);
+
+	// REGISTER / REGACK
+	len = MQTTSN_RegisterMessage(msg, sizeof(msg), 1, TEST_PUB_TOPIC);
+	CHECK(len > 0 && SendToGateway(socket, msg, len), "send REGISTER");
+	len = WaitDatagram(socket, msg, sizeof(msg));
+	CHECK(MQTTSN_ParseRegAck(msg, len, &pub_topic_id, &msg_id) == MQTTSN_RC_ACCEPTED, "REGACK of %d bytes", len);
+	CHECK(pub_topic_id > 0 && msg_id == 1, "REGACK topic ID %d, message ID %d", pub_topic_id, msg_id);
+
+	// PUBLISH / PUBACK at QoS 1
+	len = MQTTSN_PublishMessage(msg, sizeof(msg), 0, 1, 0, MQTTSN_TOPIC_TYPE_NORMAL, pub_topic_id, 2,
+		(const unsigned char*)TEST_PUB_DATA, (int)strlen(TEST_PUB_DATA));
+	CHECK(len > 0 && SendToGateway(socket, msg, len), "send PUBLISH");
+	len = WaitDatagram(socket, msg, sizeof(msg));
+	CHECK(MQTTSN_ParsePubAck(msg, len, &topic_id, &msg_id) == MQTTSN_RC_ACCEPTED, "PUBACK of %d bytes", len);
+	CHECK(topic_id == pub_topic_id && msg_id == 2, "PUBACK topic ID %d, message ID %d", topic_id, msg_id);
+
+	pthread_mutex_lock(&lockGateway);
+	CHECK(strcmp(szPublished, TEST_PUB_DATA) == 0, "gateway received \"%s\"", szPublished);
+	pthread_mutex_unlock(&lockGateway);
+
+	// topic ID not registered is rejected
+	len = MQTTSN_PublishMessage(msg, sizeof(msg), 0, 1, 0, MQTTSN_TOPIC_TYPE_NORMAL, pub_topic_id + 10, 3,
+		(const unsigned char*)TEST_PUB_DATA, (int)strlen(TEST_PUB_DATA));
+	CHECK(len > 0 && SendToGateway(socket, msg, len), "send PUBLISH");
+	len = WaitDatagram(socket, msg, sizeof(msg));
+	CHECK(MQTTSN_ParsePubAck(msg, len, NULL, &msg_id) == MQTTSN_RC_REJECTED_INVALID_TOPIC_ID && msg_id == 3,
+		"PUBACK of unknown topic ID, message ID %d", msg_id);
+
+	// SUBSCRIBE / SUBACK, then PUBLISH of gateway
+	len = MQTTSN_SubscribeMessage(msg, sizeof(msg), 1, 4, TEST_SUB_TOPIC);
+	CHECK(len > 0 && SendToGateway(socket, msg, len), "send SUBSCRIBE");
+	len = WaitDatagram(socket, msg, sizeof(msg));
+	CHECK(MQTTSN_ParseSubAck(msg, len, &qos, &topic_id, &msg_id) == MQTTSN_RC_ACCEPTED, "SUBACK of %d bytes", len);
+	CHECK(qos == 1 && topic_id > 0 && topic_id != pub_topic_id && msg_id == 4,
+		"SUBACK QoS %d, topic ID %d, message ID %d", qos, topic_id, msg_id);
+
+	len = WaitDatagram(socket, msg, sizeof(msg));
+	len = MQTTSN_ParsePublishMessage(msg, len, &qos, &topic_type, &pub_topic_id, &msg_id, &data);
+	CHECK(len == (int)strlen(TEST_SUB_DATA) && memcmp(data, TEST_SUB_DATA, len) == 0,
+		"PUBLISH of gateway with %d bytes", len);
+	CHECK(qos == 0 && topic_type == MQTTSN_TOPIC_TYPE_NORMAL && pub_topic_id == topic_id,
+		"PUBLISH of gateway QoS %d, topic type %d, topic ID %d", qos, topic_type, pub_topic_id);
+
+	len = MQTTSN_DisconnectMessage(msg, sizeof(msg), 0);
+	CHECK(len > 0 && SendToGateway(socket, msg, len), "send DISCONNECT");
+}
+
+
+int main(void)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	struct timeval tv;
+	pthread_t gateway;
+	int idSocket = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	fdGateway = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fdGateway < 0 || bind(fdGateway, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+		getsockname(fdGateway, (struct sockaddr*)&addr, &addr_len) != 0 ||
+		setsockopt(fdGateway, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+	{
+		printf("MQTTSNGatewayTest: FAILED to bind\n");
+		return 1;
+	}
+
+	BC28Emu_SetEndpoint("127.0.0.1", ntohs(addr.sin_port));
+	pthread_create(&gateway, NULL, GatewayThread, NULL);
+
+	CHECK(BC28Host_Init(), "BC28_Init");
+	if(countFailed == 0)
+	{
+		idSocket = BC28_OpenUdpSocket();
+		CHECK(idSocket >= 0, "open UDP socket");
+	}
+
+	if(idSocket >= 0)
+	{
+		TestSession(idSocket);
+		CHECK(BC28_CloseUdpSocket(idSocket) == 1, "close UDP socket");
+	}
+
+	pthread_mutex_lock(&lockGateway);
+	flagStop = 1;
+	pthread_mutex_unlock(&lockGateway);
+	pthread_join(gateway, NULL);
+	BC28Host_Close();
+	close(fdGateway);
+
+	printf("MQTTSNGatewayTest: %s\n", countFailed ? "FAILED" : "OK");
+
+	return countFailed ? 1 : 0;
+}
@@ -0,0 +1,235 @@
+/**
+  *********************************************************
+  * @file	SocketRcvQTest.c
+  * @brief  Stress test of socket receive queue, one producer and one consumer
+  * @ver	0.01
+  *********************************************************
+  * A local TCP server streams a counter pattern through BC28Emu. The producer
+  * is the driver (+NSONMI, AT+NSORF), the consumer is one thread reading the
+  * queue by random sizes with BC28_ReadTcpSocket(), BC28_PeekTcpSocket() and
+  * BC28_SkipTcpSocket(). Every byte must arrive once, in order.
+  * Build with -fsanitize=thread to check the memory ordering of the queue.
+  * Usage: SocketRcvQTest [total_kb]
+  */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "../BC28Emu.h"
+#include "BC28Host.h"
+
+#define TEST_READ_SIZE		1500	//larger than one AT+NSORF
+#define TEST_IDLE_TIMEOUT	20000	//milliseconds without data
+
+static int countFailed = 0;
+
+#define CHECK(cond, ...) \
+	do { if(!(cond)) { printf("FAILED %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); countFailed++; } } while(0)
+
+static int fdListen = -1;
+static long totalBytes = 0;
+
+static pthread_mutex_t lockNotify = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t condNotify = PTHREAD_COND_INITIALIZER;
+static int countNotify = 0;
+
+
+// pattern changes every byte and every 256 bytes, so lost or repeated blocks are found
+static uint8_t PatternByte(long offset)
+{
+	return (uint8_t)(offset + (offset >> 8) + (offset >> 16));
+}
+
+// accept the emulator and write the pattern, keep the connection until the driver closes it
+static void *ServerThread(void *arg)
+{
+	uint8_t buf[4096];
+	long sent = 0;
+	int fd, i;
+
+	(void)arg;
+
+	fd = accept(fdListen, NULL, NULL);
+	if(fd < 0)
+		return NULL;
+
+	while(sent < totalBytes)
+	{
+		int num = (totalBytes - sent > (long)sizeof(buf)) ? (int)sizeof(buf) : (int)(totalBytes - sent);
+
+		for(i=0; i<num; i++)
+			buf[i] = PatternByte(sent + i);
+
+		num = (int)write(fd, buf, num);
+		if(num <= 0)
+			break;
+		sent += num;
+	}
+
+	// until AT+NSOCL closes the connection of emulator
+	while(read(fd, buf, sizeof(buf)) > 0);
+
+	close(fd);
+
+	return NULL;
+}
+
+static void SocketListener(int socket, int size)
+{
+	(void)socket;
+	(void)size;
+
+	pthread_mutex_lock(&lockNotify);
+	countNotify++;
+	pthread_cond_signal(&condNotify);
+	pthread_mutex_unlock(&lockNotify);
+}
+
+// wait for the listener or a short time, the queue may be filled without notification
+static void WaitNotify(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 5000000L;
+	if(ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&lockNotify);
+	if(countNotify == 0)
+		pthread_cond_timedwait(&condNotify, &lockNotify, &ts);
+	countNotify = 0;
+	pthread_mutex_unlock(&lockNotify);
+}
+
+// the only consumer of the queue
+static void *ConsumerThread(void *arg)
+{
+	int socket = *(int*)arg;
+	uint8_t buf[TEST_READ_SIZE];
+	uint32_t idle = BC28Host_GetTick();
+	long received = 0;
+	unsigned int seed = 1;
+
+	while(received < totalBytes && countFailed == 0)
+	{
+		int size = 1 + rand_r(&seed) % TEST_READ_SIZE;
+		int num, i;
+
+		if(rand_r(&seed) & 1)
+		{
+			num = BC28_ReadTcpSocket(socket, buf, size);
+		}
+		else
+		{
+			// peek, then skip part of it
+			num = BC28_PeekTcpSocket(socket, buf, size);
+			if(num > 0)
+			{
+				int skip = 1 + rand_r(&seed) % num;
+
+				CHECK(BC28_SkipTcpSocket(socket, skip) == skip, "skip %d of %d peeked bytes", skip, num);
+				num = skip;
+			}
+		}
+
+		CHECK(num >= 0 && num <= size, "%d bytes for %d", num, size);
+
+		for(i=0; i<num; i++)
+		{
+			if(buf[i] != PatternByte(received + i))
+			{
+				CHECK(0, "byte %ld is 0x%02X, expected 0x%02X", received + i, buf[i], PatternByte(received + i));
+				break;
+			}
+		}
+
+		if(num > 0)
+		{
+			received += num;
+			idle = BC28Host_GetTick();
+		}
+		else if(BC28Host_GetTick() - idle > TEST_IDLE_TIMEOUT)
+		{
+			CHECK(0, "no data after %ld of %ld bytes", received, totalBytes);
+			break;
+		}
+		else
+		{
+			WaitNotify();
+		}
+	}
+
+	CHECK(received == totalBytes || countFailed > 0, "%ld of %ld bytes", received, totalBytes);
+
+	return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	pthread_t server, consumer;
+	uint32_t start;
+	int idSocket = -1;
+
+	totalBytes = ((argc > 1) ? atol(argv[1]) : 8192) << 10;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fdListen = socket(AF_INET, SOCK_STREAM, 0);
+	if(fdListen < 0 || bind(fdListen, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fdListen, 1) != 0 ||
+		getsockname(fdListen, (struct sockaddr*)&addr, &addr_len) != 0)
+	{
+		printf("SocketRcvQTest: FAILED to listen\n");
+		return 1;
+	}
+
+	BC28Emu_SetEndpoint("127.0.0.1", ntohs(addr.sin_port));
+	pthread_create(&server, NULL, ServerThread, NULL);
+
+	CHECK(BC28Host_Init(), "BC28_Init");
+	BC28_SetSocketOverflowPolicy(BC28_SOCKET_OVERFLOW_BLOCK);
+	CHECK(BC28_SetSocketNotifyMode(BC28_SOCKET_NOTIFY_LENGTH) == 1, "AT+NSONMI");
+
+	if(countFailed == 0)
+	{
+		idSocket = BC28_OpenTcpSocket("10.0.0.1", "1883");
+		CHECK(idSocket >= 0, "open socket");
+	}
+
+	start = BC28Host_GetTick();
+	if(idSocket >= 0)
+	{
+		BC28_SetTcpSocketListener(idSocket, SocketListener);
+		pthread_create(&consumer, NULL, ConsumerThread, &idSocket);
+		pthread_join(consumer, NULL);
+		CHECK(BC28_GetSocketOverflow(idSocket) == 0, "data dropped with BC28_SOCKET_OVERFLOW_BLOCK");
+		BC28_CloseTcpSocket(idSocket);
+	}
+	else
+	{
+		shutdown(fdListen, SHUT_RDWR);
+	}
+	pthread_join(server, NULL);
+	BC28Host_Close();
+	close(fdListen);
+
+	printf("SocketRcvQTest (%ld KB in %u ms): %s\n", totalBytes >> 10, BC28Host_GetTick() - start,
+		countFailed ? "FAILED" : "OK");
+
+	return countFailed ? 1 : 0;
+}
@@ -0,0 +1,384 @@
+/**
+  *********************************************************
+  * @file	SocketSendTest.c
+  * @brief  Test of asynchronous send window on BC28Emu
+  * @ver	0.01
+  *********************************************************
+  * Sends pending while the socket fails, e.g. by reboot, must not be released
+  * before their AT+NSOSD completes: the AT queue still refers to the entries,
+  * and the next send would reuse them. Each send gets exactly one callback,
+  * after its own AT+NSOSD is completed.
+  * BC28_FlushUplink() puts RAI only on the packet which is last when it is sent,
+  * also if a packet is queued while flushing, and drops packets of closed socket.
+  */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "../BC28Emu.h"
+#include "BC28Host.h"
+
+#define TEST_SEND_NUM		2
+#define TEST_UPLINK_NUM		4
+#define TEST_LINE_SIZE		4096
+
+static int countFailed = 0;
+
+#define CHECK(cond, ...) \
+	do { if(!(cond)) { printf("FAILED %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); countFailed++; } } while(0)
+
+typedef struct {
+	int		seq;
+	int		calls;
+	int		status;
+	int		errors;		// AT commands completed with ERROR when called back
+} TEST_SEND;
+
+static pthread_mutex_t lockSend = PTHREAD_MUTEX_INITIALIZER;
+static TEST_SEND tableTestSend[TEST_SEND_NUM << 1];
+static int fdListen = -1;
+static int flagServerDrain = 0;
+
+static pthread_mutex_t lockMonitor = PTHREAD_MUTEX_INITIALIZER;
+static char lineMonitor[TEST_LINE_SIZE];
+static int lenMonitor = 0;
+static int tableFlag[256];		// flag of AT+NSOSD by sequence, -1: not sent
+static int countNSOSD = 0;
+
+static int callsUplink[TEST_UPLINK_NUM];
+static int statusUplink[TEST_UPLINK_NUM];
+static int seqUplink[TEST_UPLINK_NUM];
+
+
+// accept the emulator, then read until closed by AT+NSOCL, or close at once so that AT+NSOSD fails
+static void *ServerThread(void *arg)
+{
+	uint8_t buf[256];
+	int fd, drain;
+
+	(void)arg;
+
+	while((fd = accept(fdListen, NULL, NULL)) >= 0)
+	{
+		pthread_mutex_lock(&lockSend);
+		drain = flagServerDrain;
+		pthread_mutex_unlock(&lockSend);
+
+		if(drain)
+			while(read(fd, buf, sizeof(buf)) > 0);
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+// AT+NSOSD=<socket>,<length>,<data>,<flag>,<sequence> is written in pieces
+static void MonitorUart(const uint8_t *data, int size)
+{
+	int i;
+
+	pthread_mutex_lock(&lockMonitor);
+	for(i=0; i<size; i++)
+	{
+		if(data[i] != '\r')
+		{
+			if(lenMonitor < TEST_LINE_SIZE - 1)
+				lineMonitor[lenMonitor++] = (char)data[i];
+			continue;
+		}
+
+		lineMonitor[lenMonitor] = 0;
+		if(strncmp(lineMonitor, "AT+NSOSD=", 9) == 0)
+		{
+			char *p = strrchr(lineMonitor, ',');
+			unsigned int flag;
+			int seq;
+
+			while(p != NULL && p > lineMonitor && *(--p) != ',');
+			if(p != NULL && sscanf(p, ",0x%X,%d", &flag, &seq) == 2 && seq > 0 && seq < 256)
+				tableFlag[seq] = (int)flag;
+			countNSOSD++;
+		}
+		lenMonitor = 0;
+	}
+	pthread_mutex_unlock(&lockMonitor);
+}
+
+static void OnTestSent(int socket, int seq, int status, void *context)
+{
+	TEST_SEND *send = (TEST_SEND*)context;
+	BC28_STATISTICS stat;
+
+	BC28_GetStatistics(&stat);
+
+	pthread_mutex_lock(&lockSend);
+	CHECK(send->seq == seq, "sequence %d of callback, %d is sent", seq, send->seq);
+	send->calls++;
+	send->status = status;
+	send->errors = (int)stat.at_errors;
+	pthread_mutex_unlock(&lockSend);
+}
+
+static int CountCalls(void)
+{
+	int i, count = 0;
+
+	pthread_mutex_lock(&lockSend);
+	for(i=0; i<(TEST_SEND_NUM << 1); i++)
+		count += tableTestSend[i].calls;
+	pthread_mutex_unlock(&lockSend);
+
+	return count;
+}
+
+static void SendAll(int socket, int first)
+{
+	static const uint8_t data[64] = {0};
+	int i;
+
+	for(i=first; i<first + TEST_SEND_NUM; i++)
+	{
+		int seq;
+
+		// callback is called by emulator thread, it waits until seq is kept
+		pthread_mutex_lock(&lockSend);
+		seq = BC28_SendTcpSocket(socket, data, sizeof(data), OnTestSent, &tableTestSend[i]);
+		tableTestSend[i].seq = seq;
+		pthread_mutex_unlock(&lockSend);
+
+		CHECK(seq > 0, "send %d is not queued", i);
+	}
+}
+
+static void OnUplinkSent(int socket, int seq, int status, void *context)
+{
+	int i = (int)(long)context;
+
+	(void)socket;
+
+	pthread_mutex_lock(&lockSend);
+	callsUplink[i]++;
+	statusUplink[i] = status;
+	seqUplink[i] = seq;
+	pthread_mutex_unlock(&lockSend);
+}
+
+// queue the last packet while the third one waits for +NSOSTR of the second
+static void *AppendThread(void *arg)
+{
+	static const uint8_t data[16] = {0};
+	int socket = *(int*)arg;
+	int count = 0, wait;
+
+	for(wait=0; wait<3000 && count < 2; wait++)
+	{
+		BC28_Wrap_Sleep(1);
+
+		pthread_mutex_lock(&lockMonitor);
+		count = countNSOSD;
+		pthread_mutex_unlock(&lockMonitor);
+	}
+
+	BC28_Wrap_Sleep(100);
+	CHECK(BC28_QueueUplink(socket, data, sizeof(data), 0, OnUplinkSent, (void*)(long)(TEST_UPLINK_NUM - 1)),
+		"queue uplink while flushing");
+
+	return NULL;
+}
+
+static int CountUplinkCalls(void)
+{
+	int i, count = 0;
+
+	pthread_mutex_lock(&lockSend);
+	for(i=0; i<TEST_UPLINK_NUM; i++)
+		count += callsUplink[i];
+	pthread_mutex_unlock(&lockSend);
+
+	return count;
+}
+
+static void TestUplinkRAI(void)
+{
+	static const uint8_t data[16] = {0};
+	pthread_t append;
+	int socket, i, wait;
+
+	pthread_mutex_lock(&lockSend);
+	flagServerDrain = 1;
+	pthread_mutex_unlock(&lockSend);
+
+	memset(tableFlag, -1, sizeof(tableFlag));
+	BC28Host_SetMonitor(MonitorUart);
+
+	socket = BC28_OpenTcpSocket("10.0.0.1", "1883");
+	CHECK(socket >= 0, "open socket");
+	if(socket < 0)
+		return;
+
+	// one send at a time, the third waits 200ms for +NSOSTR of the second
+	BC28_SetSendWindow(1);
+	BC28Emu_SetLatency("AT+NSOSD", 200);
+
+	for(i=0; i<TEST_UPLINK_NUM - 1; i++)
+		CHECK(BC28_QueueUplink(socket, data, sizeof(data), 0, OnUplinkSent, (void*)(long)i), "queue uplink %d", i);
+
+	pthread_create(&append, NULL, AppendThread, &socket);
+	CHECK(BC28_FlushUplink() == TEST_UPLINK_NUM, "flush uplink");
+	pthread_join(append, NULL);
+
+	for(wait=0; wait<3000 && CountUplinkCalls() < TEST_UPLINK_NUM; wait+=10)
+		BC28_Wrap_Sleep(10);
+
+	pthread_mutex_lock(&lockSend);
+	pthread_mutex_lock(&lockMonitor);
+	for(i=0; i<TEST_UPLINK_NUM; i++)
+	{
+		int flag = (i == TEST_UPLINK_NUM - 1) ? BC28_RAI_UL : BC28_RAI_NONE;
+
+		CHECK(callsUplink[i] == 1 && statusUplink[i] == 1, "uplink %d has %d callbacks, status %d",
+			i, callsUplink[i], statusUplink[i]);
+		CHECK(tableFlag[seqUplink[i] & 0xFF] == flag, "uplink %d is sent with flag 0x%X",
+			i, tableFlag[seqUplink[i] & 0xFF]);
+	}
+	pthread_mutex_unlock(&lockMonitor);
+	pthread_mutex_unlock(&lockSend);
+
+	BC28Host_SetMonitor(NULL);
+	BC28Emu_SetLatency("AT+NSOSD", 0);
+	BC28_SetSendWindow(255);		//back to MAX_SEND_WINDOW
+	BC28_CloseTcpSocket(socket);
+}
+
+// packet of closed socket is dropped at once, not retried until timeout
+static void TestUplinkClosed(void)
+{
+	static const uint8_t data[16] = {0};
+	uint32_t start;
+	int socket;
+
+	socket = BC28_OpenTcpSocket("10.0.0.1", "1883");
+	CHECK(socket >= 0, "open socket");
+	if(socket < 0)
+		return;
+
+	memset(callsUplink, 0, sizeof(callsUplink));
+	CHECK(BC28_QueueUplink(socket, data, sizeof(data), 0, OnUplinkSent, (void*)0L), "queue uplink");
+	BC28_CloseTcpSocket(socket);
+
+	start = BC28Host_GetTick();
+	CHECK(BC28_FlushUplink() == 0, "flush uplink of closed socket");
+	CHECK(BC28Host_GetTick() - start < 1000, "flush uplink takes %u ms", BC28Host_GetTick() - start);
+
+	pthread_mutex_lock(&lockSend);
+	CHECK(callsUplink[0] == 1 && statusUplink[0] == 0, "uplink has %d callbacks, status %d",
+		callsUplink[0], statusUplink[0]);
+	pthread_mutex_unlock(&lockSend);
+
+	// nothing is left in queue
+	CHECK(BC28_FlushUplink() == 0 && CountUplinkCalls() == 1, "uplink is kept");
+}
+
+static void TestFailWhileQueued(void)
+{
+	BC28_STATISTICS stat;
+	int socket, i, wait;
+
+	pthread_mutex_lock(&lockSend);
+	flagServerDrain = 0;
+	pthread_mutex_unlock(&lockSend);
+
+	socket = BC28_OpenTcpSocket("10.0.0.1", "1883");
+	CHECK(socket >= 0, "open socket");
+	if(socket < 0)
+		return;
+
+	// connection is closed by server, AT+NSOSD returns ERROR
+	BC28_Wrap_Sleep(200);
+	BC28_ResetStatistics();
+	BC28Emu_SetLatency("AT+NSOSD", 200);
+
+	SendAll(socket, 0);
+
+	// reboot while AT+NSOSD are in flight, then send again on the same entries
+	BC28Emu_Reboot();
+	BC28_Wrap_Sleep(20);
+	SendAll(socket, TEST_SEND_NUM);
+
+	for(wait=0; wait<3000 && CountCalls() < (TEST_SEND_NUM << 1); wait+=10)
+		BC28_Wrap_Sleep(10);
+
+	// late callbacks, if any
+	BC28_Wrap_Sleep(100);
+
+	pthread_mutex_lock(&lockSend);
+	for(i=0; i<(TEST_SEND_NUM << 1); i++)
+	{
+		CHECK(tableTestSend[i].calls == 1, "send %d has %d callbacks", i, tableTestSend[i].calls);
+
+		// AT+NSOSD in flight are lost by reboot, socket is closed after it
+		if(i < TEST_SEND_NUM)
+			CHECK(tableTestSend[i].status == 0, "send %d before reboot has status %d", i, tableTestSend[i].status);
+		else
+		{
+			CHECK(tableTestSend[i].status == -1, "send %d has status %d", i, tableTestSend[i].status);
+			CHECK(tableTestSend[i].errors >= i + 1 - TEST_SEND_NUM, "send %d is called back after %d of AT+NSOSD",
+				i, tableTestSend[i].errors);
+		}
+	}
+	pthread_mutex_unlock(&lockSend);
+
+	// only data accepted by BC28 is counted
+	BC28_GetStatistics(&stat);
+	CHECK(stat.socket_tx_bytes == 0, "%u bytes sent", stat.socket_tx_bytes);
+
+	BC28Emu_SetLatency("AT+NSOSD", 0);
+}
+
+
+int main(void)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	pthread_t server;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fdListen = socket(AF_INET, SOCK_STREAM, 0);
+	if(fdListen < 0 || bind(fdListen, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fdListen, 4) != 0 ||
+		getsockname(fdListen, (struct sockaddr*)&addr, &addr_len) != 0)
+	{
+		printf("SocketSendTest: FAILED to listen\n");
+		return 1;
+	}
+
+	BC28Emu_SetEndpoint("127.0.0.1", ntohs(addr.sin_port));
+	pthread_create(&server, NULL, ServerThread, NULL);
+
+	CHECK(BC28Host_Init(), "BC28_Init");
+	if(countFailed == 0)
+	{
+		TestUplinkRAI();
+		TestUplinkClosed();
+		TestFailWhileQueued();
+	}
+
+	BC28Host_Close();
+	shutdown(fdListen, SHUT_RDWR);
+	pthread_join(server, NULL);
+	close(fdListen);
+
+	printf("SocketSendTest: %s\n", countFailed ? "FAILED" : "OK");
+
+	return countFailed ? 1 : 0;
+}